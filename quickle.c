@@ -3,6 +3,10 @@
 #include "datetime.h"
 #include "structmember.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 PyDoc_STRVAR(quickle__doc__,
 "`quickle` - a quicker pickle.");
 
@@ -67,6 +71,34 @@ enum opcode {
     TIMEZONE_UTC     = '\xbe',
     TIMEZONE         = '\xbf',
     ZONEINFO         = '\xc0',
+    PACKED_INTS      = '\xc1',
+    PACKED_FLOATS    = '\xc2',
+    PACKED_BOOLS     = '\xc3',
+    ARRAY            = '\xc4',
+    ARRAY_BUFFER     = '\xc5',
+    MEMORYVIEW       = '\xc6',
+    MEMORYVIEW_BUFFER = '\xc7',
+    VARINT           = '\xc8',
+    INT64            = '\xc9',
+    APPENDS_N        = '\xca',
+    EMPTY_DICT_N     = '\xcb',
+    SETITEMS_N       = '\xcc',
+    ADDITEMS_N       = '\xcd',
+    DEFINE_SHAPE     = '\xce',
+    SHAPED_DICT      = '\xcf',
+    STRUCT_COLUMNS1  = '\xd0',
+    STRUCT_COLUMNS2  = '\xd1',
+    STRUCT_COLUMNS4  = '\xd2',
+    EMPTY_STRUCT_ARRAY1 = '\xd3',
+    EMPTY_STRUCT_ARRAY2 = '\xd4',
+    EMPTY_STRUCT_ARRAY4 = '\xd5',
+    STRUCT_ARRAY_EXTEND = '\xd6',
+    TYPED_STRUCT1    = '\xd7',
+    TYPED_STRUCT2    = '\xd8',
+    TYPED_STRUCT4    = '\xd9',
+    BUILDSTRUCT_N    = '\xda',
+    BUILDSTRUCT_SPARSE = '\xdb',
+    NATIVE_UNICODE   = '\xdc',
 
     /* Unused, but kept for compt with pickle */
     PROTO            = '\x80',
@@ -77,6 +109,14 @@ enum {
    /* Number of elements save_list/dict/set writes out before
     * doing APPENDS/SETITEMS/ADDITEMS. */
     BATCHSIZE = 1000,
+   /* Minimum length of a list to consider writing it with PACKED_* opcodes */
+    PACKED_LIST_MIN_SIZE = 8,
+   /* Number of elements converted at a time when writing packed lists */
+    PACKED_CHUNK_SIZE = 512,
+   /* Maximum number of keys in a dict written with a shape */
+    SHAPE_MAX_KEYS = 64,
+   /* Maximum number of dict shapes defined in a single message */
+    SHAPE_MAX_COUNT = 1024,
 };
 
 /*************************************************************************
@@ -88,14 +128,31 @@ typedef struct {
     PyObject *QuickleError;
     PyObject *EncodingError;
     PyObject *DecodingError;
+    PyObject *BufferTooSmallError;
     PyObject *StructType;
     PyTypeObject *EnumType;
     PyTypeObject *TimeZoneType;
     PyTypeObject *ZoneInfoType;
+    PyTypeObject *ArrayType;
     PyObject *encoder_dumps_kws;
+    PyObject *encoder_dumps_into_kws;
+    PyObject *encoder_dumps_many_kws;
     PyObject *decoder_loads_kws;
+    PyObject *decoder_loads_at_kws;
     PyObject *value2member_map_str;
     PyObject *name_str;
+    PyObject *write_str;
+    PyObject *release_str;
+    PyObject *readinto_str;
+    PyObject *seek_str;
+    PyObject *seekable_str;
+    PyObject *needed_str;
+    PyObject *frombytes_str;
+    PyObject *byteswap_str;
+    PyObject *typecode_str;
+    PyObject *cast_str;
+    PyObject *toreadonly_str;
+    PyObject *byte_format_str;
 } QuickleState;
 
 /* Forward declaration of the quickle module definition. */
@@ -234,8 +291,20 @@ typedef struct {
     PyObject *struct_fields;
     PyObject *struct_defaults;
     Py_ssize_t *struct_offsets;
+    char *struct_layout;        /* A FIELD_* kind per field */
+    int struct_typed;           /* Whether every field has a known kind */
 } StructMetaObject;
 
+/* The kinds of field annotations understood by the typed struct encoding */
+enum field_kind {
+    FIELD_UNTYPED = 0,
+    FIELD_INT = 'i',
+    FIELD_FLOAT = 'f',
+    FIELD_BOOL = '?',
+    FIELD_STR = 's',
+    FIELD_BYTES = 'b',
+};
+
 static PyTypeObject StructMetaType;
 static PyTypeObject StructMixinType;
 
@@ -243,6 +312,37 @@ static PyTypeObject StructMixinType;
 #define StructMeta_GET_NFIELDS(s) (PyTuple_GET_SIZE((((StructMetaObject *)(s))->struct_fields)));
 #define StructMeta_GET_DEFAULTS(s) (((StructMetaObject *)(s))->struct_defaults);
 #define StructMeta_GET_OFFSETS(s) (((StructMetaObject *)(s))->struct_offsets);
+#define StructMeta_GET_LAYOUT(s) (((StructMetaObject *)(s))->struct_layout);
+
+/* Map a field annotation to a FIELD_* kind. String annotations (as used by
+ * `from __future__ import annotations`) are matched by name. */
+static char
+annotation_field_kind(PyObject *annotation)
+{
+    if (annotation == (PyObject *)&PyLong_Type)
+        return FIELD_INT;
+    else if (annotation == (PyObject *)&PyFloat_Type)
+        return FIELD_FLOAT;
+    else if (annotation == (PyObject *)&PyBool_Type)
+        return FIELD_BOOL;
+    else if (annotation == (PyObject *)&PyUnicode_Type)
+        return FIELD_STR;
+    else if (annotation == (PyObject *)&PyBytes_Type)
+        return FIELD_BYTES;
+    else if (PyUnicode_CheckExact(annotation)) {
+        if (PyUnicode_CompareWithASCIIString(annotation, "int") == 0)
+            return FIELD_INT;
+        else if (PyUnicode_CompareWithASCIIString(annotation, "float") == 0)
+            return FIELD_FLOAT;
+        else if (PyUnicode_CompareWithASCIIString(annotation, "bool") == 0)
+            return FIELD_BOOL;
+        else if (PyUnicode_CompareWithASCIIString(annotation, "str") == 0)
+            return FIELD_STR;
+        else if (PyUnicode_CompareWithASCIIString(annotation, "bytes") == 0)
+            return FIELD_BYTES;
+    }
+    return FIELD_UNTYPED;
+}
 
 static int
 dict_discard(PyObject *dict, PyObject *key) {
@@ -262,10 +362,13 @@ StructMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
     PyObject *name = NULL, *bases = NULL, *orig_dict = NULL;
     PyObject *arg_fields = NULL, *kwarg_fields = NULL, *new_dict = NULL, *new_args = NULL;
     PyObject *fields = NULL, *defaults = NULL, *offsets_lk = NULL, *offset = NULL, *slots = NULL, *slots_list = NULL;
-    PyObject *base, *base_fields, *base_defaults, *annotations;
+    PyObject *kinds_lk = NULL, *kind = NULL;
+    PyObject *base, *base_fields, *base_defaults, *annotations, *annotation;
     PyObject *default_val, *field;
     Py_ssize_t nfields, ndefaults, i, j, k;
     Py_ssize_t *offsets = NULL, *base_offsets;
+    char *layout = NULL, *base_layout;
+    int typed;
 
     /* Parse arguments: (name, bases, dict) */
     if (!PyArg_ParseTuple(args, "UO!O!:StructMeta.__new__", &name, &PyTuple_Type,
@@ -294,6 +397,9 @@ StructMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
     offsets_lk = PyDict_New();
     if (offsets_lk == NULL)
         goto error;
+    kinds_lk = PyDict_New();
+    if (kinds_lk == NULL)
+        goto error;
 
     for (i = PyTuple_GET_SIZE(bases) - 1; i >= 0; i--) {
         base = PyTuple_GET_ITEM(bases, i);
@@ -311,6 +417,7 @@ StructMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         base_fields = StructMeta_GET_FIELDS(base);
         base_defaults = StructMeta_GET_DEFAULTS(base);
         base_offsets = StructMeta_GET_OFFSETS(base);
+        base_layout = StructMeta_GET_LAYOUT(base);
         nfields = PyTuple_GET_SIZE(base_fields);
         ndefaults = PyTuple_GET_SIZE(base_defaults);
         for (j = 0; j < nfields; j++) {
@@ -333,7 +440,13 @@ StructMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
                 goto error;
             if (PyDict_SetItem(offsets_lk, field, offset) < 0)
                 goto error;
-            Py_DECREF(offset);
+            Py_CLEAR(offset);
+            kind = PyLong_FromLong(base_layout[j]);
+            if (kind == NULL)
+                goto error;
+            if (PyDict_SetItem(kinds_lk, field, kind) < 0)
+                goto error;
+            Py_CLEAR(kind);
         }
     }
 
@@ -352,7 +465,7 @@ StructMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         }
 
         i = 0;
-        while (PyDict_Next(annotations, &i, &field, NULL)) {
+        while (PyDict_Next(annotations, &i, &field, &annotation)) {
             if (!PyUnicode_CheckExact(field)) {
                 PyErr_SetString(
                     PyExc_TypeError,
@@ -361,6 +474,13 @@ StructMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
                 goto error;
             }
 
+            kind = PyLong_FromLong(annotation_field_kind(annotation));
+            if (kind == NULL)
+                goto error;
+            if (PyDict_SetItem(kinds_lk, field, kind) < 0)
+                goto error;
+            Py_CLEAR(kind);
+
             /* If the field is new, add it to slots */
             if (PyDict_GetItem(arg_fields, field) == NULL && PyDict_GetItem(kwarg_fields, field) == NULL) {
                 if (PyList_Append(slots_list, field) < 0)
@@ -453,10 +573,28 @@ StructMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         offsets[i] = PyLong_AsSsize_t(offset);
     }
     Py_CLEAR(offsets_lk);
+    offset = NULL;
+
+    /* Allocate at least one byte, so field-less types have a layout too */
+    layout = PyMem_Malloc(PyTuple_GET_SIZE(fields) + 1);
+    if (layout == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    typed = PyTuple_GET_SIZE(fields) > 0;
+    for (i = 0; i < PyTuple_GET_SIZE(fields); i++) {
+        kind = PyDict_GetItem(kinds_lk, PyTuple_GET_ITEM(fields, i));
+        layout[i] = (kind == NULL) ? FIELD_UNTYPED : (char)PyLong_AsLong(kind);
+        typed &= layout[i] != FIELD_UNTYPED;
+    }
+    kind = NULL;
+    Py_CLEAR(kinds_lk);
 
     cls->struct_fields = fields;
     cls->struct_defaults = defaults;
     cls->struct_offsets = offsets;
+    cls->struct_layout = layout;
+    cls->struct_typed = typed;
     return (PyObject *) cls;
 error:
     Py_XDECREF(arg_fields);
@@ -468,8 +606,12 @@ error:
     Py_XDECREF(new_args);
     Py_XDECREF(offsets_lk);
     Py_XDECREF(offset);
+    Py_XDECREF(kinds_lk);
+    Py_XDECREF(kind);
     if (offsets != NULL)
         PyMem_Free(offsets);
+    if (layout != NULL)
+        PyMem_Free(layout);
     return NULL;
 }
 
@@ -487,6 +629,8 @@ StructMeta_clear(StructMetaObject *self)
     Py_CLEAR(self->struct_fields);
     Py_CLEAR(self->struct_defaults);
     PyMem_Free(self->struct_offsets);
+    PyMem_Free(self->struct_layout);
+    self->struct_layout = NULL;
     return PyType_Type.tp_clear((PyObject *)self);
 }
 
@@ -624,10 +768,11 @@ static PyTypeObject StructMetaType = {
 };
 
 
-static PyObject *
-maybe_deepcopy_default(PyObject *obj, int *is_copy) {
+/* Whether a default value is shared between instances as is, rather than
+ * copied by `maybe_deepcopy_default` */
+static int
+default_is_shared(PyObject *obj) {
     QuickleState *st;
-    PyObject *copy = NULL, *deepcopy = NULL, *res = NULL;
     PyTypeObject *type = Py_TYPE(obj);
 
     /* Known non-collection types */
@@ -637,28 +782,38 @@ maybe_deepcopy_default(PyObject *obj, int *is_copy) {
         type == &PyUnicode_Type || type == &PyByteArray_Type ||
         type == &PyPickleBuffer_Type
     ) {
-        return obj;
+        return 1;
     }
     else if (type == &PyTuple_Type && (PyTuple_GET_SIZE(obj) == 0)) {
-        return obj;
+        return 1;
     }
     else if (type == &PyFrozenSet_Type && PySet_GET_SIZE(obj) == 0) {
-        return obj;
+        return 1;
     }
     else if (type == PyDateTimeAPI->DeltaType ||
              type == PyDateTimeAPI->DateTimeType ||
              type == PyDateTimeAPI->DateType ||
              type == PyDateTimeAPI->TimeType
     ) {
-        return obj;
+        return 1;
     }
     st = quickle_get_global_state();
     if (type == st->TimeZoneType || type == st->ZoneInfoType) {
-        return obj;
+        return 1;
     }
     else if (PyType_IsSubtype(type, st->EnumType)) {
-        return obj;
+        return 1;
     }
+    return 0;
+}
+
+static PyObject *
+maybe_deepcopy_default(PyObject *obj, int *is_copy) {
+    PyObject *copy = NULL, *deepcopy = NULL, *res = NULL;
+    PyTypeObject *type = Py_TYPE(obj);
+
+    if (default_is_shared(obj))
+        return obj;
 
     if (is_copy != NULL)
         *is_copy = 1;
@@ -694,6 +849,11 @@ cleanup:
 #define IS_TRACKED  PyObject_GC_IsTracked
 #define CALL_ONE_ARG(fn, arg) PyObject_CallOneArg((fn), (arg))
 #endif
+
+#if PY_VERSION_HEX < 0x030900A4
+#define Py_SET_SIZE(o, size) (Py_SIZE(o) = (size))
+#endif
+
 /* Is this object something that is/could be GC tracked? True if
  * - the value supports GC
  * - the value isn't a tuple or the object is tracked (skip tracked checks for non-tuples)
@@ -1049,136 +1209,562 @@ PyDoc_STRVAR(Struct__doc__,
 "Dog(name='snickers', breed='corgi', is_good_boy=True)\n"
 );
 
+/* Create an instance of the Struct type `type` from row `i` of `columns`,
+ * which must be lists with at least `i + 1` items. Fields past `ncols` are
+ * set to their default values. Returns a new reference. */
+static PyObject *
+Struct_from_columns(PyTypeObject *type, PyObject *const *columns,
+                    Py_ssize_t ncols, Py_ssize_t i)
+{
+    PyObject *obj, *fields, *defaults, *val;
+    Py_ssize_t nfields, npos, j;
+    int is_copy, should_untrack;
+
+    fields = StructMeta_GET_FIELDS(type);
+    defaults = StructMeta_GET_DEFAULTS(type);
+    nfields = PyTuple_GET_SIZE(fields);
+    npos = nfields - PyTuple_GET_SIZE(defaults);
+
+    obj = type->tp_alloc(type, 0);
+    if (obj == NULL)
+        return NULL;
+    should_untrack = PyObject_IS_GC(obj);
+    for (j = 0; j < nfields; j++) {
+        if (j < ncols) {
+            val = PyList_GET_ITEM(columns[j], i);
+            Py_INCREF(val);
+        }
+        else if (j < npos) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "Missing required argument '%U'",
+                PyTuple_GET_ITEM(fields, j)
+            );
+            goto error;
+        }
+        else {
+            is_copy = 0;
+            val = maybe_deepcopy_default(PyTuple_GET_ITEM(defaults, j - npos), &is_copy);
+            if (val == NULL)
+                goto error;
+            if (!is_copy)
+                Py_INCREF(val);
+        }
+        Struct_set_index(obj, j, val);
+        if (should_untrack) {
+            should_untrack = !OBJ_IS_GC(val);
+        }
+    }
+    if (should_untrack)
+        PyObject_GC_UnTrack(obj);
+    return obj;
+error:
+    Py_DECREF(obj);
+    return NULL;
+}
+
 /*************************************************************************
- * LookupTable object                                                    *
+ * StructArray                                                           *
  *************************************************************************
- * A custom hashtable mapping PyObject * to Py_ssize_t. This is used by the
- * encoder for both memoization and type registry. Using a custom hashtable
- * rather than PyDict allows us to skip a bunch of unnecessary object creation.
- * This makes a huge performance difference. */
-typedef struct {
-    PyObject *key;
-    Py_ssize_t value;
-} LookupEntry;
+ * A sequence of instances of a single Struct type, stored as one list per
+ * field. Records are only materialized as Struct instances on access, so a
+ * large array costs a single pointer per field per record, with no object
+ * header or GC tracking per record. */
 
 typedef struct {
-    size_t mask;
-    size_t used;
-    size_t allocated;
-    size_t buffered_size;
-    LookupEntry *table;
-} LookupTable;
+    PyObject_HEAD
+    PyTypeObject *type;         /* The Struct type */
+    PyObject *columns;          /* A tuple of lists, one per field */
+    Py_ssize_t len;
+} StructArrayObject;
 
-#define LT_MINSIZE 8
-#define PERTURB_SHIFT 5
+static PyTypeObject StructArray_Type;
 
-static LookupTable *
-LookupTable_New(Py_ssize_t buffered_size)
+#define StructArray_Check(op) (Py_TYPE(op) == &StructArray_Type)
+
+/* Create a new empty StructArray of `type`, which must be a Struct type */
+static PyObject *
+StructArray_New(PyTypeObject *type)
 {
-    LookupTable *self = PyMem_Malloc(sizeof(LookupTable));
-    if (self == NULL) {
-        PyErr_NoMemory();
-        return NULL;
-    }
+    StructArrayObject *self;
+    Py_ssize_t i, nfields;
 
-    self->buffered_size = LT_MINSIZE;
-    if (buffered_size > 0) {
-        /* Find the smallest valid table size >= buffered_size. */
-        while (self->buffered_size < (size_t)buffered_size) {
-            self->buffered_size <<= 1;
-        }
-    }
-    self->used = 0;
-    self->allocated = LT_MINSIZE;
-    self->mask = LT_MINSIZE - 1;
-    self->table = PyMem_Malloc(LT_MINSIZE * sizeof(LookupEntry));
-    if (self->table == NULL) {
-        PyMem_Free(self);
-        PyErr_NoMemory();
+    self = PyObject_GC_New(StructArrayObject, &StructArray_Type);
+    if (self == NULL)
         return NULL;
+    Py_INCREF(type);
+    self->type = type;
+    self->len = 0;
+    nfields = StructMeta_GET_NFIELDS(type);
+    self->columns = PyTuple_New(nfields);
+    if (self->columns == NULL)
+        goto error;
+    for (i = 0; i < nfields; i++) {
+        PyObject *column = PyList_New(0);
+        if (column == NULL)
+            goto error;
+        PyTuple_SET_ITEM(self->columns, i, column);
     }
-    memset(self->table, 0, LT_MINSIZE * sizeof(LookupEntry));
-
-    return self;
-}
-
-static Py_ssize_t
-LookupTable_Size(LookupTable *self)
-{
-    return self->used;
+    PyObject_GC_Track(self);
+    return (PyObject *)self;
+error:
+    Py_XDECREF(self->columns);
+    self->columns = NULL;
+    Py_DECREF(self);
+    return NULL;
 }
 
+/* Append `obj` to the array. On failure the array is left unchanged. */
 static int
-LookupTable_Traverse(LookupTable *self, visitproc visit, void *arg)
+StructArray_Append(StructArrayObject *self, PyObject *obj)
 {
-    Py_ssize_t i = self->allocated;
-    while (--i >= 0) {
-        Py_VISIT(self->table[i].key);
+    PyObject *column, *val;
+    Py_ssize_t i, nfields;
+
+    if (Py_TYPE(obj) != self->type) {
+        PyErr_Format(PyExc_TypeError,
+                     "Expected an instance of %.200s, got %.200s",
+                     self->type->tp_name, Py_TYPE(obj)->tp_name);
+        return -1;
     }
+    nfields = PyTuple_GET_SIZE(self->columns);
+    for (i = 0; i < nfields; i++) {
+        column = PyTuple_GET_ITEM(self->columns, i);
+        val = Struct_get_index(obj, i);
+        if (val == NULL || PyList_Append(column, val) < 0)
+            goto error;
+    }
+    self->len++;
     return 0;
+error:
+    /* Roll back any columns already extended */
+    while (--i >= 0) {
+        column = PyTuple_GET_ITEM(self->columns, i);
+        PyList_SetSlice(column, self->len, self->len + 1, NULL);
+    }
+    return -1;
 }
 
-static int
-LookupTable_Clear(LookupTable *self)
+static PyObject *
+StructArray_new(PyTypeObject *cls, PyObject *args, PyObject *kwds)
 {
-    Py_ssize_t i = self->allocated;
+    static char *kwlist[] = {"type", "items", NULL};
+    PyObject *type, *items = NULL, *self, *iter, *item;
 
-    while (--i >= 0) {
-        Py_XDECREF(self->table[i].key);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:StructArray", kwlist,
+                                     &type, &items)) {
+        return NULL;
     }
-    self->used = 0;
-    memset(self->table, 0, self->allocated * sizeof(LookupEntry));
-    return 0;
+    if (Py_TYPE(type) != &StructMetaType) {
+        PyErr_Format(PyExc_TypeError,
+                     "type must be a Struct type, got %.200s",
+                     Py_TYPE(type)->tp_name);
+        return NULL;
+    }
+    self = StructArray_New((PyTypeObject *)type);
+    if (self == NULL || items == NULL || items == Py_None)
+        return self;
+
+    iter = PyObject_GetIter(items);
+    if (iter == NULL)
+        goto error;
+    while ((item = PyIter_Next(iter)) != NULL) {
+        int status = StructArray_Append((StructArrayObject *)self, item);
+        Py_DECREF(item);
+        if (status < 0) {
+            Py_DECREF(iter);
+            goto error;
+        }
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred())
+        goto error;
+    return self;
+error:
+    Py_DECREF(self);
+    return NULL;
 }
 
-static void
-LookupTable_Del(LookupTable *self)
+PyDoc_STRVAR(StructArray__doc__,
+"StructArray(type, items=None)\n"
+"--\n"
+"\n"
+"A compact sequence of instances of a single `Struct` type.\n"
+"\n"
+"Values are stored column-wise, one list per field, rather than as one\n"
+"object per record. Struct instances are only created when the array is\n"
+"indexed or iterated over, making this a good fit for holding large numbers\n"
+"of records. ``StructArray`` objects are serialized column-wise, and decode\n"
+"directly back to columns without creating any per-record objects.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"type : type\n"
+"    The `Struct` type of the records. Like other `Struct` types, it must be\n"
+"    in the ``registry`` of any `Encoder` or `Decoder` used to serialize the\n"
+"    array.\n"
+"items : iterable, optional\n"
+"    An iterable of instances of ``type`` to initialize the array with.\n"
+"\n"
+"Examples\n"
+"--------\n"
+">>> class Point(Struct):\n"
+"...     x: int\n"
+"...     y: int\n"
+"...\n"
+">>> points = StructArray(Point, [Point(1, 2), Point(3, 4)])\n"
+">>> points.append(Point(5, 6))\n"
+">>> points[-1]\n"
+"Point(x=5, y=6)\n"
+">>> points.columns\n"
+"{'x': [1, 3, 5], 'y': [2, 4, 6]}"
+);
+
+PyDoc_STRVAR(StructArray_append__doc__,
+"append(self, obj)\n"
+"--\n"
+"\n"
+"Append an instance of the array's `Struct` type to the end of the array."
+);
+static PyObject*
+StructArray_append(StructArrayObject *self, PyObject *obj)
 {
-    LookupTable_Clear(self);
-    PyMem_Free(self->table);
-    PyMem_Free(self);
+    if (StructArray_Append(self, obj) < 0)
+        return NULL;
+    Py_RETURN_NONE;
 }
 
-/* Since entries cannot be deleted from this hashtable, _LookupTable_Lookup()
-   can be considerably simpler than dictobject.c's lookdict(). */
-static LookupEntry *
-_LookupTable_Lookup(LookupTable *self, PyObject *key)
+PyDoc_STRVAR(StructArray_tolist__doc__,
+"tolist(self)\n"
+"--\n"
+"\n"
+"Return the records in the array as a list of `Struct` instances."
+);
+static PyObject*
+StructArray_tolist(StructArrayObject *self, PyObject *Py_UNUSED(ignored))
 {
-    size_t i;
-    size_t perturb;
-    size_t mask = self->mask;
-    LookupEntry *table = self->table;
-    LookupEntry *entry;
-    Py_hash_t hash = (Py_hash_t)key >> 3;
-
-    i = hash & mask;
-    entry = &table[i];
-    if (entry->key == NULL || entry->key == key)
-        return entry;
+    PyObject *out, *item;
+    Py_ssize_t i;
 
-    for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
-        i = (i << 2) + i + perturb + 1;
-        entry = &table[i & mask];
-        if (entry->key == NULL || entry->key == key)
-            return entry;
+    out = PyList_New(self->len);
+    if (out == NULL)
+        return NULL;
+    for (i = 0; i < self->len; i++) {
+        item = Struct_from_columns(
+            self->type, &PyTuple_GET_ITEM(self->columns, 0),
+            PyTuple_GET_SIZE(self->columns), i
+        );
+        if (item == NULL) {
+            Py_DECREF(out);
+            return NULL;
+        }
+        PyList_SET_ITEM(out, i, item);
     }
-    Py_UNREACHABLE();
+    return out;
 }
 
-/* Returns -1 on failure, 0 on success. */
-static int
-_LookupTable_Resize(LookupTable *self, size_t min_size)
+static PyObject*
+StructArray_reduce(StructArrayObject *self, PyObject *Py_UNUSED(ignored))
 {
-    LookupEntry *oldtable = NULL;
-    LookupEntry *oldentry, *newentry;
-    size_t new_size = LT_MINSIZE;
-    size_t to_process;
+    PyObject *items, *out;
+    items = StructArray_tolist(self, NULL);
+    if (items == NULL)
+        return NULL;
+    out = Py_BuildValue("O(ON)", Py_TYPE(self), self->type, items);
+    return out;
+}
 
-    assert(min_size > 0);
+static Py_ssize_t
+StructArray_len(StructArrayObject *self)
+{
+    return self->len;
+}
 
-    if (min_size > PY_SSIZE_T_MAX) {
-        PyErr_NoMemory();
-        return -1;
+static PyObject *
+StructArray_item(StructArrayObject *self, Py_ssize_t i)
+{
+    if (i < 0 || i >= self->len) {
+        PyErr_SetString(PyExc_IndexError, "StructArray index out of range");
+        return NULL;
+    }
+    return Struct_from_columns(
+        self->type, &PyTuple_GET_ITEM(self->columns, 0),
+        PyTuple_GET_SIZE(self->columns), i
+    );
+}
+
+static PyObject *
+StructArray_get_type(StructArrayObject *self, void *closure)
+{
+    Py_INCREF(self->type);
+    return (PyObject *)self->type;
+}
+
+static PyObject *
+StructArray_get_columns(StructArrayObject *self, void *closure)
+{
+    PyObject *out, *fields, *column;
+    Py_ssize_t i, nfields;
+
+    out = PyDict_New();
+    if (out == NULL)
+        return NULL;
+    fields = StructMeta_GET_FIELDS(self->type);
+    nfields = PyTuple_GET_SIZE(fields);
+    for (i = 0; i < nfields; i++) {
+        /* Copy the columns so they can't be resized out from under us */
+        column = PyList_GetSlice(PyTuple_GET_ITEM(self->columns, i), 0, self->len);
+        if (column == NULL)
+            goto error;
+        if (PyDict_SetItem(out, PyTuple_GET_ITEM(fields, i), column) < 0) {
+            Py_DECREF(column);
+            goto error;
+        }
+        Py_DECREF(column);
+    }
+    return out;
+error:
+    Py_DECREF(out);
+    return NULL;
+}
+
+static PyObject *
+StructArray_repr(StructArrayObject *self)
+{
+    return PyUnicode_FromFormat("%s(%s, len=%zd)", Py_TYPE(self)->tp_name,
+                                self->type->tp_name, self->len);
+}
+
+static PyObject *
+StructArray_richcompare(PyObject *self, PyObject *other, int op)
+{
+    StructArrayObject *a, *b;
+    int status;
+
+    if (!StructArray_Check(other) || (op != Py_EQ && op != Py_NE)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    a = (StructArrayObject *)self;
+    b = (StructArrayObject *)other;
+    if (a->type != b->type || a->len != b->len) {
+        status = 0;
+    }
+    else {
+        status = PyObject_RichCompareBool(a->columns, b->columns, Py_EQ);
+        if (status < 0)
+            return NULL;
+    }
+    if (status == ((op == Py_EQ) ? 1 : 0)) {
+        Py_RETURN_TRUE;
+    } else {
+        Py_RETURN_FALSE;
+    }
+}
+
+static int
+StructArray_clear(StructArrayObject *self)
+{
+    Py_CLEAR(self->columns);
+    Py_CLEAR(self->type);
+    self->len = 0;
+    return 0;
+}
+
+static void
+StructArray_dealloc(StructArrayObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    StructArray_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+StructArray_traverse(StructArrayObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->type);
+    Py_VISIT(self->columns);
+    return 0;
+}
+
+static struct PyMethodDef StructArray_methods[] = {
+    {
+        "append", (PyCFunction) StructArray_append, METH_O,
+        StructArray_append__doc__,
+    },
+    {
+        "tolist", (PyCFunction) StructArray_tolist, METH_NOARGS,
+        StructArray_tolist__doc__,
+    },
+    {"__reduce__", (PyCFunction) StructArray_reduce, METH_NOARGS, "reduce a StructArray"},
+    {NULL, NULL}                /* sentinel */
+};
+
+static PyGetSetDef StructArray_getset[] = {
+    {"type", (getter) StructArray_get_type, NULL, "The Struct type of the records", NULL},
+    {"columns", (getter) StructArray_get_columns, NULL,
+     "A dict mapping field names to lists of values", NULL},
+    {NULL},
+};
+
+static PySequenceMethods StructArray_as_sequence = {
+    .sq_length = (lenfunc)StructArray_len,
+    .sq_item = (ssizeargfunc)StructArray_item,
+};
+
+static PyTypeObject StructArray_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "quickle.StructArray",
+    .tp_doc = StructArray__doc__,
+    .tp_basicsize = sizeof(StructArrayObject),
+    .tp_dealloc = (destructor)StructArray_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)StructArray_traverse,
+    .tp_clear = (inquiry)StructArray_clear,
+    .tp_new = StructArray_new,
+    .tp_repr = (reprfunc)StructArray_repr,
+    .tp_richcompare = StructArray_richcompare,
+    .tp_methods = StructArray_methods,
+    .tp_getset = StructArray_getset,
+    .tp_as_sequence = &StructArray_as_sequence,
+};
+
+/*************************************************************************
+ * LookupTable object                                                    *
+ *************************************************************************
+ * A custom hashtable mapping PyObject * to Py_ssize_t. This is used by the
+ * encoder for both memoization and type registry. Using a custom hashtable
+ * rather than PyDict allows us to skip a bunch of unnecessary object creation.
+ * This makes a huge performance difference. */
+typedef struct {
+    PyObject *key;
+    Py_ssize_t value;
+} LookupEntry;
+
+typedef struct {
+    size_t mask;
+    size_t used;
+    size_t allocated;
+    size_t buffered_size;
+    LookupEntry *table;
+} LookupTable;
+
+#define LT_MINSIZE 8
+#define PERTURB_SHIFT 5
+
+static LookupTable *
+LookupTable_New(Py_ssize_t buffered_size)
+{
+    LookupTable *self = PyMem_Malloc(sizeof(LookupTable));
+    if (self == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    self->buffered_size = LT_MINSIZE;
+    if (buffered_size > 0) {
+        /* Find the smallest valid table size >= buffered_size. */
+        while (self->buffered_size < (size_t)buffered_size) {
+            self->buffered_size <<= 1;
+        }
+    }
+    self->used = 0;
+    self->allocated = LT_MINSIZE;
+    self->mask = LT_MINSIZE - 1;
+    self->table = PyMem_Malloc(LT_MINSIZE * sizeof(LookupEntry));
+    if (self->table == NULL) {
+        PyMem_Free(self);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(self->table, 0, LT_MINSIZE * sizeof(LookupEntry));
+
+    return self;
+}
+
+static Py_ssize_t
+LookupTable_Size(LookupTable *self)
+{
+    return self->used;
+}
+
+static int
+LookupTable_Traverse(LookupTable *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i = self->allocated;
+    while (--i >= 0) {
+        Py_VISIT(self->table[i].key);
+    }
+    return 0;
+}
+
+static int
+LookupTable_Clear(LookupTable *self)
+{
+    Py_ssize_t i, remaining = self->used;
+
+    /* Nothing to do for an empty table, common for small messages */
+    if (remaining == 0)
+        return 0;
+
+    for (i = 0; remaining > 0; i++) {
+        if (self->table[i].key != NULL) {
+            Py_DECREF(self->table[i].key);
+            remaining--;
+        }
+    }
+    self->used = 0;
+    memset(self->table, 0, self->allocated * sizeof(LookupEntry));
+    return 0;
+}
+
+static void
+LookupTable_Del(LookupTable *self)
+{
+    LookupTable_Clear(self);
+    PyMem_Free(self->table);
+    PyMem_Free(self);
+}
+
+/* Since entries cannot be deleted from this hashtable, _LookupTable_Lookup()
+   can be considerably simpler than dictobject.c's lookdict(). */
+static LookupEntry *
+_LookupTable_Lookup(LookupTable *self, PyObject *key)
+{
+    size_t i;
+    size_t perturb;
+    size_t mask = self->mask;
+    LookupEntry *table = self->table;
+    LookupEntry *entry;
+    Py_hash_t hash = (Py_hash_t)key >> 3;
+
+    i = hash & mask;
+    entry = &table[i];
+    if (entry->key == NULL || entry->key == key)
+        return entry;
+
+    for (perturb = hash; ; perturb >>= PERTURB_SHIFT) {
+        i = (i << 2) + i + perturb + 1;
+        entry = &table[i & mask];
+        if (entry->key == NULL || entry->key == key)
+            return entry;
+    }
+    Py_UNREACHABLE();
+}
+
+/* Returns -1 on failure, 0 on success. */
+static int
+_LookupTable_Resize(LookupTable *self, size_t min_size)
+{
+    LookupEntry *oldtable = NULL;
+    LookupEntry *oldentry, *newentry;
+    size_t new_size = LT_MINSIZE;
+    size_t to_process;
+
+    assert(min_size > 0);
+
+    if (min_size > PY_SSIZE_T_MAX) {
+        PyErr_NoMemory();
+        return -1;
     }
 
     /* Find the smallest valid table size >= min_size. */
@@ -1229,6 +1815,47 @@ LookupTable_Reset(LookupTable *self)
     return 0;
 }
 
+/* Remove all entries with a value >= size, for tables whose values are a
+ * dense range of indices (as in the memo). Since entries cannot be deleted
+ * in place, the surviving entries are reinserted into a fresh table. Returns
+ * -1 on failure, 0 on success. */
+static int
+LookupTable_Truncate(LookupTable *self, Py_ssize_t size)
+{
+    LookupEntry *oldtable, *oldentry, *newentry;
+    size_t to_process;
+
+    if ((Py_ssize_t)self->used <= size)
+        return 0;
+
+    oldtable = self->table;
+    self->table = PyMem_NEW(LookupEntry, self->allocated);
+    if (self->table == NULL) {
+        self->table = oldtable;
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(self->table, 0, sizeof(LookupEntry) * self->allocated);
+
+    to_process = self->used;
+    self->used = 0;
+    for (oldentry = oldtable; to_process > 0; oldentry++) {
+        if (oldentry->key != NULL) {
+            to_process--;
+            if (oldentry->value >= size) {
+                Py_DECREF(oldentry->key);
+                continue;
+            }
+            newentry = _LookupTable_Lookup(self, oldentry->key);
+            newentry->key = oldentry->key;
+            newentry->value = oldentry->value;
+            self->used++;
+        }
+    }
+    PyMem_Free(oldtable);
+    return 0;
+}
+
 /* Returns -1 on failure, a value otherwise. */
 static Py_ssize_t
 LookupTable_Get(LookupTable *self, PyObject *key)
@@ -1239,7 +1866,7 @@ LookupTable_Get(LookupTable *self, PyObject *key)
     return entry->value;
 }
 #define MEMO_GET(self, obj) \
-    ((self)->active_memoize ? LookupTable_Get((self)->memo, (obj)) : -1)
+    ((self)->active_memoize ? _Encoder_MemoGet((self), (obj)) : -1)
 
 /* Returns -1 on failure, 0 on success. */
 static int
@@ -1289,22 +1916,67 @@ typedef struct EncoderObject {
     Py_ssize_t write_buffer_size;
     LookupTable *registry;
     int collect_buffers;
+    int dedupe_strings;
+    int dedupe_bytes;
+    int packed_lists;
+    int varints;
+    int counted_containers;
+    int dict_shapes;
+    int struct_columns;
+    int typed_structs;
+    int omit_defaults;
+    int native_strings;
+    int persistent_memo;        /* Whether the memo persists across calls,
+                                   set for `EncoderSession` objects */
 
     /* Per-dumps state */
+    int in_use;                 /* Whether a `dump*` call is in progress */
     int active_collect_buffers;
     int memoize;
     int active_memoize;
     PyObject *buffers;
     LookupTable *memo;            /* Memo table, keep track of the seen
                                    objects to support self-referential objects */
+    PyObject *value_memo;       /* dict mapping str/bytes values to their memo
+                                   index, NULL if no dedupe options are set */
+    PyObject *shapes;           /* dict mapping tuples of dict keys to their
+                                   shape index, NULL if dict_shapes is unset */
+    PyObject *last_shape;       /* Borrowed key tuple of the last shape used */
+    PyObject *dictionary;       /* tuple of objects preceding the memo,
+                                   NULL if no dictionary was provided */
+    LookupTable *dictionary_memo; /* dictionary objects by identity to their
+                                     memo index, kept across messages */
+    PyObject *dictionary_values; /* dict mapping str/bytes values in the
+                                    dictionary to their memo index */
+    Py_ssize_t memo_mark;       /* Size of the memo at the start of the call,
+                                   used to roll back a failed session call */
+    Py_ssize_t last_shape_index;
     PyObject *output_buffer;    /* Write into a local bytearray buffer before
                                    flushing to the stream. */
-    Py_ssize_t output_len;      /* Length of output_buffer. */
-    Py_ssize_t max_output_len;  /* Allocation size of output_buffer. */
+    char *output_data;          /* Start of the memory currently written to.
+                                   Points into output_buffer, except in
+                                   `dumps_into`. */
+    Py_ssize_t output_len;      /* Length of output_data. */
+    Py_ssize_t max_output_len;  /* Allocation size of output_data. */
+    PyObject *write;            /* `write` method of the file being written
+                                   to in `dump`, NULL otherwise. */
+    PyObject *output_target;    /* bytearray being written to in
+                                   `dumps_into`, NULL otherwise. */
+    Py_ssize_t output_offset;   /* Offset of output_data in output_target */
+    Py_buffer output_target_view; /* Export held on output_target so it can't
+                                     be resized by user code mid-encode, obj
+                                     is NULL otherwise. */
+    Py_buffer output_view;      /* Fixed-size buffer being written to in
+                                   `dumps_into`, buf is NULL otherwise. */
+    Py_ssize_t output_overflow; /* Bytes not written once output_view has
+                                   filled up. */
+    Py_ssize_t output_written;  /* Bytes written to the file by the last
+                                   `dump` call. */
 } EncoderObject;
 
 static int save(EncoderObject *, PyObject *, int);
 static int save_unicode(EncoderObject *, PyObject *);
+static int save_struct_columns(EncoderObject *, PyObject *, int);
 
 static void
 _write_size64(char *out, size_t value)
@@ -1321,34 +1993,140 @@ _write_size64(char *out, size_t value)
     }
 }
 
-static Py_ssize_t
-_Encoder_Write(EncoderObject *self, const char *s, Py_ssize_t data_len)
+/* Write `data` to the file being written to by `dump`. If `payload` is a
+ * bytes object it's passed to `write` directly, otherwise a temporary
+ * memoryview of `data` is used. The memoryview is released after the call,
+ * so a `write` that holds on to its argument will error rather than see
+ * the buffer contents change under it. Returns -1 on failure, 0 on success. */
+static int
+_Encoder_WriteToFile(EncoderObject *self, const char *data,
+                     Py_ssize_t data_len, PyObject *payload)
 {
-    Py_ssize_t i, n, required;
-    char *buffer;
+    PyObject *view, *res, *temp;
 
-    assert(s != NULL);
-
-    n = data_len;
-
-    required = self->output_len + n;
-    if (required > self->max_output_len) {
-        /* Make space in buffer */
-        if (self->output_len >= PY_SSIZE_T_MAX / 2 - n) {
-            PyErr_NoMemory();
-            return -1;
-        }
-        self->max_output_len = (self->output_len + n) / 2 * 3;
-        if (_PyBytes_Resize(&self->output_buffer, self->max_output_len) < 0)
+    if (payload != NULL && PyBytes_CheckExact(payload)) {
+        res = CALL_ONE_ARG(self->write, payload);
+        if (res == NULL)
             return -1;
+        Py_DECREF(res);
+        self->output_written += data_len;
+        return 0;
+    }
+
+    view = PyMemoryView_FromMemory((char *)data, data_len, PyBUF_READ);
+    if (view == NULL)
+        return -1;
+    res = CALL_ONE_ARG(self->write, view);
+    if (res == NULL) {
+        Py_DECREF(view);
+        return -1;
+    }
+    Py_DECREF(res);
+    temp = PyObject_CallMethodObjArgs(
+        view, quickle_get_global_state()->release_str, NULL
+    );
+    Py_DECREF(view);
+    if (temp == NULL)
+        return -1;
+    Py_DECREF(temp);
+    self->output_written += data_len;
+    return 0;
+}
+
+/* Flush the contents of output_buffer to the file being written to by
+ * `dump`. Returns -1 on failure, 0 on success. */
+static int
+_Encoder_FlushToFile(EncoderObject *self)
+{
+    assert(self->write != NULL);
+
+    if (self->output_len == 0)
+        return 0;
+    if (_Encoder_WriteToFile(self, self->output_data, self->output_len, NULL) < 0)
+        return -1;
+    self->output_len = 0;
+    return 0;
+}
+
+/* Resize the bytearray being written to in `dumps_into`. The export that
+ * keeps user code from resizing it is dropped for the duration. Returns -1
+ * on failure, 0 on success. */
+static int
+_Encoder_ResizeTarget(EncoderObject *self, Py_ssize_t size)
+{
+    int status;
+
+    PyBuffer_Release(&self->output_target_view);
+    status = PyByteArray_Resize(self->output_target, size);
+    if (PyObject_GetBuffer(self->output_target, &self->output_target_view,
+                           PyBUF_SIMPLE) < 0) {
+        self->output_target_view.obj = NULL;
+        status = -1;
+    }
+    return status;
+}
+
+static Py_ssize_t
+_Encoder_Write(EncoderObject *self, const char *s, Py_ssize_t data_len)
+{
+    Py_ssize_t i, n, required;
+    char *buffer;
+
+    assert(s != NULL);
+
+    n = data_len;
+
+    required = self->output_len + n;
+    if (required > self->max_output_len) {
+        if (self->write != NULL) {
+            /* Writing to a file, flush the buffer rather than growing it */
+            if (_Encoder_FlushToFile(self) < 0)
+                return -1;
+            if (n > self->max_output_len) {
+                if (_Encoder_WriteToFile(self, s, n, NULL) < 0)
+                    return -1;
+                return data_len;
+            }
+        }
+        else if (self->output_view.buf != NULL) {
+            /* Writing to fixed-size memory that's now full. Continue without
+             * writing to count the total size needed. */
+            self->output_overflow += self->output_len + n;
+            self->output_len = 0;
+            self->max_output_len = 0;
+            return data_len;
+        }
+        else {
+            /* Make space in buffer */
+            if (self->output_len >= PY_SSIZE_T_MAX / 2 - n - self->output_offset) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            self->max_output_len = Py_MAX(
+                (self->output_len + n) / 2 * 3, self->write_buffer_size
+            );
+            if (self->output_target != NULL) {
+                if (_Encoder_ResizeTarget(self,
+                                          self->output_offset + self->max_output_len) < 0)
+                    return -1;
+                self->output_data = (
+                    PyByteArray_AS_STRING(self->output_target) + self->output_offset
+                );
+            }
+            else {
+                if (_PyBytes_Resize(&self->output_buffer, self->max_output_len) < 0)
+                    return -1;
+                self->output_data = PyBytes_AS_STRING(self->output_buffer);
+            }
+        }
+    }
+    buffer = self->output_data;
+    if (data_len < 8) {
+        /* This is faster than memcpy when the string is short. */
+        for (i = 0; i < data_len; i++) {
+            buffer[self->output_len + i] = s[i];
+        }
     }
-    buffer = PyBytes_AS_STRING(self->output_buffer);
-    if (data_len < 8) {
-        /* This is faster than memcpy when the string is short. */
-        for (i = 0; i < data_len; i++) {
-            buffer[self->output_len + i] = s[i];
-        }
-    }
     else {
         memcpy(buffer + self->output_len, s, data_len);
     }
@@ -1389,6 +2167,25 @@ memo_get(EncoderObject *self, PyObject *key, Py_ssize_t memo_index)
     return 0;
 }
 
+/* The memo indices of a message start after the dictionary */
+#define MEMO_BASE(self) \
+    ((self)->dictionary == NULL ? 0 : PyTuple_GET_SIZE((self)->dictionary))
+
+/* Find the memo index of `obj`, checking the dictionary before the memo of
+ * the message. Returns -1 if not found. */
+static Py_ssize_t
+_Encoder_MemoGet(EncoderObject *self, PyObject *obj)
+{
+    Py_ssize_t idx;
+    if (self->dictionary_memo != NULL) {
+        idx = LookupTable_Get(self->dictionary_memo, obj);
+        if (idx >= 0)
+            return idx;
+    }
+    idx = LookupTable_Get(self->memo, obj);
+    return idx < 0 ? -1 : idx + MEMO_BASE(self);
+}
+
 /* Store an object in the memo, assign it a new unique ID based on the number
    of objects currently stored in the memo and generate a PUT opcode. */
 static int
@@ -1411,6 +2208,50 @@ memo_put(EncoderObject *self, PyObject *obj)
 #define MEMO_PUT_MAYBE(self, obj, memoize) \
     (((self)->active_memoize && (memoize || Py_REFCNT(obj) > 1)) ? memo_put((self), (obj)) : 0)
 
+/* Reset the memo between messages. Returns -1 on failure, 0 on success. */
+static int
+_Encoder_MemoReset(EncoderObject *self)
+{
+    if (self->value_memo != NULL && PyDict_GET_SIZE(self->value_memo) > 0)
+        PyDict_Clear(self->value_memo);
+    return LookupTable_Reset(self->memo);
+}
+
+/* Discard everything added to the memo since the start of the current call,
+ * so a failed call leaves a session memo in sync with its decoder. Returns
+ * -1 on failure, 0 on success. */
+static int
+_Encoder_MemoRollback(EncoderObject *self)
+{
+    /* The value memo may refer to discarded entries. It only deduplicates
+     * values, so dropping it entirely is still correct. */
+    if (self->value_memo != NULL && PyDict_GET_SIZE(self->value_memo) > 0)
+        PyDict_Clear(self->value_memo);
+    return LookupTable_Truncate(self->memo, self->memo_mark);
+}
+
+/* Write a reference to a str or bytes value in the dictionary. Returns 1 if
+ * written, 0 if the value isn't in the dictionary, -1 on error. */
+static int
+save_dictionary_value(EncoderObject *self, PyObject *obj)
+{
+    PyObject *index = PyDict_GetItemWithError(self->dictionary_values, obj);
+    if (index == NULL)
+        return PyErr_Occurred() ? -1 : 0;
+    if (memo_get(self, obj, PyLong_AsSsize_t(index)) < 0)
+        return -1;
+    return 1;
+}
+
+/* Forget the dict shapes defined in a message */
+static void
+_Encoder_ShapesReset(EncoderObject *self)
+{
+    self->last_shape = NULL;
+    if (self->shapes != NULL && PyDict_GET_SIZE(self->shapes) > 0)
+        PyDict_Clear(self->shapes);
+}
+
 static int
 save_none(EncoderObject *self, PyObject *obj)
 {
@@ -1430,6 +2271,51 @@ save_bool(EncoderObject *self, PyObject *obj)
     return 0;
 }
 
+/* The size in bytes of `val` written by `save_varint`. */
+static Py_ssize_t
+_varint_size(long long val)
+{
+    uint64_t z = ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+    Py_ssize_t len = 2;
+
+    if (z >= ((uint64_t)1 << 56))
+        return 9;
+    while (z >= 0x80) {
+        len++;
+        z >>= 7;
+    }
+    return len;
+}
+
+/* Write a 64 bit integer as a zigzag encoded LEB128 VARINT op, or as an
+ * INT64 op if that would be smaller. */
+static int
+save_varint(EncoderObject *self, long long val)
+{
+    char pdata[10];
+    Py_ssize_t len = 1;
+    uint64_t z = ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+    uint64_t x = (uint64_t)val;
+    int i;
+
+    if (z < ((uint64_t)1 << 56)) {
+        pdata[0] = VARINT;
+        while (z >= 0x80) {
+            pdata[len++] = (unsigned char)(z | 0x80);
+            z >>= 7;
+        }
+        pdata[len++] = (unsigned char)z;
+    }
+    else {
+        pdata[0] = INT64;
+        for (i = 0; i < 8; i++, x >>= 8)
+            pdata[len++] = (unsigned char)(x & 0xff);
+    }
+    if (_Encoder_Write(self, pdata, len) < 0)
+        return -1;
+    return 0;
+}
+
 static int
 save_long(EncoderObject *self, PyObject *obj)
 {
@@ -1439,6 +2325,26 @@ save_long(EncoderObject *self, PyObject *obj)
     int overflow;
     int status = 0;
 
+    if (self->varints) {
+        long long llval = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (!overflow) {
+            /* Use whichever encoding is smaller, keeping the pickle
+             * compatible BININT ops on ties. Outside the 4 byte range
+             * VARINT/INT64 are never larger than LONG1. */
+            Py_ssize_t binint_size;
+            if (llval < -0x80000000LL || llval > 0x7fffffffLL)
+                binint_size = PY_SSIZE_T_MAX;
+            else if (llval >= 0 && llval <= 0xff)
+                binint_size = 2;
+            else if (llval >= 0 && llval <= 0xffff)
+                binint_size = 3;
+            else
+                binint_size = 5;
+            if (_varint_size(llval) < binint_size)
+                return save_varint(self, llval);
+        }
+    }
+
     val= PyLong_AsLongAndOverflow(obj, &overflow);
     if (!overflow && (sizeof(long) <= 4 ||
             (val <= 0x7fffffffL && val >= (-0x7fffffffL - 1))))
@@ -1780,6 +2686,16 @@ _write_bytes(EncoderObject *self,
              const char *data, Py_ssize_t data_size,
              PyObject *payload)
 {
+    if (self->write != NULL && data_size >= self->write_buffer_size) {
+        /* Writing to a file, and the payload is large. Bypass the buffer and
+         * write the payload directly to avoid an extra copy. */
+        if (_Encoder_Write(self, header, header_size) < 0 ||
+            _Encoder_FlushToFile(self) < 0 ||
+            _Encoder_WriteToFile(self, data, data_size, payload) < 0) {
+            return -1;
+        }
+        return 0;
+    }
     if (_Encoder_Write(self, header, header_size) < 0 ||
         _Encoder_Write(self, data, data_size) < 0) {
         return -1;
@@ -1862,6 +2778,11 @@ _save_bytearray_data(EncoderObject *self, PyObject *obj, const char *data,
 static int
 save_bytearray(EncoderObject *self, PyObject *obj)
 {
+    if (obj == self->output_target) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Cannot serialize the bytearray being written to");
+        return -1;
+    }
     return _save_bytearray_data(self, obj, PyByteArray_AS_STRING(obj),
                                 PyByteArray_GET_SIZE(obj));
 }
@@ -1909,30 +2830,478 @@ save_picklebuffer(EncoderObject *self, PyObject *obj)
     return 0;
 }
 
+/* The itemsize of an `array.array` typecode on this platform, or 0 if the
+ * typecode is unknown. */
+static Py_ssize_t
+array_typecode_itemsize(char typecode)
+{
+    switch (typecode) {
+        case 'b':
+        case 'B':
+            return 1;
+        case 'u':
+            return sizeof(wchar_t);
+#if PY_VERSION_HEX >= 0x030D0000
+        case 'w':
+            return 4;
+#endif
+        case 'h':
+        case 'H':
+            return sizeof(short);
+        case 'i':
+        case 'I':
+            return sizeof(int);
+        case 'l':
+        case 'L':
+            return sizeof(long);
+        case 'q':
+        case 'Q':
+            return sizeof(long long);
+        case 'f':
+            return sizeof(float);
+        case 'd':
+            return sizeof(double);
+        default:
+            return 0;
+    }
+}
+
+/* Array items are written in native byte order, the high bit of the itemsize
+ * byte marks data written by a big-endian machine. */
+#define ARRAY_BIG_ENDIAN 0x80
+
+static int
+save_array(EncoderObject *self, PyObject *obj)
+{
+    Py_buffer view;
+    PyObject *temp;
+    char header[11];
+    char typecode, itemsize;
+    int status = -1;
+
+    /* The buffer format doesn't always match the typecode (e.g. 'u' arrays
+     * export as 'w'), so look up the typecode directly */
+    temp = PyObject_GetAttr(obj, quickle_get_global_state()->typecode_str);
+    if (temp == NULL)
+        return -1;
+    typecode = (char)PyUnicode_READ_CHAR(temp, 0);
+    Py_DECREF(temp);
+
+    if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0)
+        return -1;
+    itemsize = (unsigned char)array_typecode_itemsize(typecode);
+#if PY_BIG_ENDIAN
+    itemsize |= ARRAY_BIG_ENDIAN;
+#endif
+
+    if (self->active_collect_buffers) {
+        /* Write data out-of-band */
+        PyObject *buffer = PyPickleBuffer_FromObject(obj);
+        if (buffer == NULL)
+            goto done;
+        if (PyList_Append(self->buffers, buffer) < 0) {
+            Py_DECREF(buffer);
+            goto done;
+        }
+        Py_DECREF(buffer);
+        header[0] = NEXT_BUFFER;
+        header[1] = ARRAY_BUFFER;
+        header[2] = typecode;
+        header[3] = itemsize;
+        if (_Encoder_Write(self, header, 4) < 0)
+            goto done;
+    }
+    else {
+        /* Write data in-band */
+        header[0] = ARRAY;
+        header[1] = typecode;
+        header[2] = itemsize;
+        _write_size64(header + 3, view.len);
+        if (_write_bytes(self, header, 11, view.buf, view.len, obj) < 0)
+            goto done;
+    }
+    status = 0;
+
+done:
+    /* Release the view first, it holds a reference to `obj` */
+    PyBuffer_Release(&view);
+    if (status == 0)
+        status = MEMO_PUT_MAYBE(self, obj, 0);
+    return status;
+}
+
+/* The itemsize of a single character native struct format that
+ * `memoryview.cast` supports, or 0 if unsupported. */
+static Py_ssize_t
+buffer_format_itemsize(char format)
+{
+    switch (format) {
+        case '?':
+            return sizeof(_Bool);
+        case 'c':
+        case 'b':
+        case 'B':
+            return 1;
+        case 'h':
+        case 'H':
+            return sizeof(short);
+        case 'i':
+        case 'I':
+            return sizeof(int);
+        case 'l':
+        case 'L':
+            return sizeof(long);
+        case 'q':
+        case 'Q':
+            return sizeof(long long);
+        case 'n':
+        case 'N':
+            return sizeof(size_t);
+        case 'f':
+            return sizeof(float);
+        case 'd':
+            return sizeof(double);
+        case 'P':
+            return sizeof(void *);
+        default:
+            return 0;
+    }
+}
+
+/* Flags for MEMORYVIEW ops */
+#define MEMORYVIEW_READONLY 0x01
+#define MEMORYVIEW_BIG_ENDIAN 0x02
+
+static int
+save_memoryview(EncoderObject *self, PyObject *obj)
+{
+    Py_buffer view;
+    PyObject *contiguous = NULL;
+    char header[7 + 8 * PyBUF_MAX_NDIM + 8];
+    const char *format, *data;
+    Py_ssize_t i, len;
+    int status = -1;
+
+    if (PyObject_GetBuffer(obj, &view, PyBUF_FULL_RO) < 0)
+        return -1;
+
+    format = view.format;
+    if (format[0] == '@')
+        format++;
+    if (format[0] == '\0' || format[1] != '\0' ||
+        buffer_format_itemsize(format[0]) != view.itemsize) {
+        QuickleState *st = quickle_get_global_state();
+        PyErr_Format(st->EncodingError,
+                     "memoryview with format '%s' can not be serialized, "
+                     "only single character native formats are supported",
+                     view.format);
+        goto done;
+    }
+    if (view.ndim != 1) {
+        for (i = 0; i < view.ndim; i++) {
+            if (view.shape[i] == 0) {
+                QuickleState *st = quickle_get_global_state();
+                PyErr_SetString(st->EncodingError,
+                                "multi-dimensional memoryview with zeros in "
+                                "shape can not be serialized");
+                goto done;
+            }
+        }
+    }
+
+    /* Make non-contiguous views contiguous, keeping their mutability */
+    data = view.buf;
+    if (!PyBuffer_IsContiguous(&view, 'C')) {
+        char *copy;
+        if (view.readonly) {
+            contiguous = PyBytes_FromStringAndSize(NULL, view.len);
+            if (contiguous == NULL)
+                goto done;
+            copy = PyBytes_AS_STRING(contiguous);
+        }
+        else {
+            contiguous = PyByteArray_FromStringAndSize(NULL, view.len);
+            if (contiguous == NULL)
+                goto done;
+            copy = PyByteArray_AS_STRING(contiguous);
+        }
+        if (PyBuffer_ToContiguous(copy, &view, view.len, 'C') < 0)
+            goto done;
+        data = copy;
+    }
+
+    len = 0;
+    if (self->active_collect_buffers)
+        header[len++] = NEXT_BUFFER;
+    header[len++] = self->active_collect_buffers ? MEMORYVIEW_BUFFER : MEMORYVIEW;
+    header[len] = 0;
+    if (view.readonly)
+        header[len] |= MEMORYVIEW_READONLY;
+#if PY_BIG_ENDIAN
+    header[len] |= MEMORYVIEW_BIG_ENDIAN;
+#endif
+    header[len + 1] = format[0];
+    header[len + 2] = (unsigned char)view.itemsize;
+    header[len + 3] = (unsigned char)view.ndim;
+    len += 4;
+    for (i = 0; i < view.ndim; i++, len += 8)
+        _write_size64(header + len, view.shape[i]);
+
+    if (self->active_collect_buffers) {
+        /* Write data out-of-band */
+        PyObject *buffer = PyPickleBuffer_FromObject(
+            contiguous == NULL ? obj : contiguous
+        );
+        if (buffer == NULL)
+            goto done;
+        if (PyList_Append(self->buffers, buffer) < 0) {
+            Py_DECREF(buffer);
+            goto done;
+        }
+        Py_DECREF(buffer);
+        if (_Encoder_Write(self, header, len) < 0)
+            goto done;
+    }
+    else {
+        /* Write data in-band */
+        _write_size64(header + len, view.len);
+        len += 8;
+        if (_write_bytes(self, header, len, data, view.len, contiguous) < 0)
+            goto done;
+    }
+    status = 0;
+
+done:
+    Py_XDECREF(contiguous);
+    /* Release the view first, it holds a reference to `obj` */
+    PyBuffer_Release(&view);
+    if (status == 0)
+        status = MEMO_PUT_MAYBE(self, obj, 0);
+    return status;
+}
+
+/* Strings are written as utf-8, with lone surrogates encoded as if they were
+ * valid code points (the "surrogatepass" error handler). Rather than using
+ * `PyUnicode_AsUTF8AndSize` (which permanently attaches a utf-8 copy to every
+ * non-ASCII str it's called on), non-ASCII strings are transcoded directly
+ * from their PEP 393 representation into the output. */
+
+/* Returns a pointer to the utf-8 data of a ready str if it's already
+ * available (ASCII strings, or strings with a cached utf-8 copy), or NULL if
+ * the string needs to be transcoded. The size of the utf-8 data in bytes is
+ * stored in `size` either way. */
+static const char *
+_unicode_utf8(PyObject *obj, Py_ssize_t *size)
+{
+    int kind;
+    const void *data;
+    Py_ssize_t i, n, len;
+
+    len = PyUnicode_GET_LENGTH(obj);
+    if (PyUnicode_IS_ASCII(obj)) {
+        *size = len;
+        return PyUnicode_DATA(obj);
+    }
+    if (((PyCompactUnicodeObject *)obj)->utf8 != NULL) {
+        *size = ((PyCompactUnicodeObject *)obj)->utf8_length;
+        return ((PyCompactUnicodeObject *)obj)->utf8;
+    }
+
+    kind = PyUnicode_KIND(obj);
+    data = PyUnicode_DATA(obj);
+    n = len;
+    if (kind == PyUnicode_1BYTE_KIND) {
+        const unsigned char *s = data;
+        /* Every byte >= 0x80 encodes as 2 bytes. Count them 8 at a time,
+         * summing the high bits with a multiply. */
+        for (i = 0; i + 8 <= len; i += 8) {
+            uint64_t chunk;
+            memcpy(&chunk, s + i, 8);
+            chunk = (chunk >> 7) & 0x0101010101010101ULL;
+            n += (Py_ssize_t)((chunk * 0x0101010101010101ULL) >> 56);
+        }
+        for (; i < len; i++) {
+            n += s[i] >> 7;
+        }
+    }
+    else if (kind == PyUnicode_2BYTE_KIND) {
+        const Py_UCS2 *s = data;
+        for (i = 0; i < len; i++) {
+            n += (s[i] >= 0x80) + (s[i] >= 0x800);
+        }
+    }
+    else {
+        const Py_UCS4 *s = data;
+        for (i = 0; i < len; i++) {
+            n += (s[i] >= 0x80) + (s[i] >= 0x800) + (s[i] >= 0x10000);
+        }
+    }
+    *size = n;
+    return NULL;
+}
+
+/* Encode the code points [start, end) of a str as utf-8 into `out`, which
+ * must have enough space. Returns the number of bytes written. */
+static Py_ssize_t
+_encode_utf8(int kind, const void *data, Py_ssize_t start, Py_ssize_t end,
+             char *out)
+{
+    Py_ssize_t i;
+    Py_UCS4 ch;
+    unsigned char *p = (unsigned char *)out;
+
+    if (kind == PyUnicode_1BYTE_KIND) {
+        const unsigned char *s = data;
+        i = start;
+        while (i < end) {
+#if defined(__SSE2__)
+            /* Copy runs of ASCII characters 16 at a time */
+            if (end - i >= 16) {
+                __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+                if (_mm_movemask_epi8(chunk) == 0) {
+                    _mm_storeu_si128((__m128i *)p, chunk);
+                    i += 16;
+                    p += 16;
+                    continue;
+                }
+            }
+#endif
+            ch = s[i++];
+            if (ch < 0x80) {
+                *p++ = (unsigned char)ch;
+            }
+            else {
+                *p++ = (unsigned char)(0xc0 | (ch >> 6));
+                *p++ = (unsigned char)(0x80 | (ch & 0x3f));
+            }
+        }
+        return (char *)p - out;
+    }
+
+    for (i = start; i < end; i++) {
+        ch = PyUnicode_READ(kind, data, i);
+        if (ch < 0x80) {
+            *p++ = (unsigned char)ch;
+        }
+        else if (ch < 0x800) {
+            *p++ = (unsigned char)(0xc0 | (ch >> 6));
+            *p++ = (unsigned char)(0x80 | (ch & 0x3f));
+        }
+        else if (ch < 0x10000) {
+            /* Lone surrogates are encoded like any other code point */
+            *p++ = (unsigned char)(0xe0 | (ch >> 12));
+            *p++ = (unsigned char)(0x80 | ((ch >> 6) & 0x3f));
+            *p++ = (unsigned char)(0x80 | (ch & 0x3f));
+        }
+        else {
+            *p++ = (unsigned char)(0xf0 | (ch >> 18));
+            *p++ = (unsigned char)(0x80 | ((ch >> 12) & 0x3f));
+            *p++ = (unsigned char)(0x80 | ((ch >> 6) & 0x3f));
+            *p++ = (unsigned char)(0x80 | (ch & 0x3f));
+        }
+    }
+    return (char *)p - out;
+}
+
+/* Write `header`, followed by the `size` bytes of utf-8 data for `obj`.
+ * `data` is the result of `_unicode_utf8`. Returns -1 on failure, 0 on
+ * success. */
+static int
+_write_unicode(EncoderObject *self, const char *header, Py_ssize_t header_size,
+               PyObject *obj, const char *data, Py_ssize_t size)
+{
+    int kind;
+    const void *udata;
+    Py_ssize_t i, n, len;
+    char chunk[1024];
+
+    if (data != NULL)
+        return _write_bytes(self, header, header_size, data, size, NULL);
+
+    if (_Encoder_Write(self, header, header_size) < 0)
+        return -1;
+
+    kind = PyUnicode_KIND(obj);
+    udata = PyUnicode_DATA(obj);
+    len = PyUnicode_GET_LENGTH(obj);
+    if (self->output_len + size <= self->max_output_len) {
+        /* Enough space, transcode directly into the output buffer */
+        self->output_len += _encode_utf8(
+            kind, udata, 0, len, self->output_data + self->output_len
+        );
+        return 0;
+    }
+    /* Otherwise transcode through a small buffer, letting `_Encoder_Write`
+     * grow or flush the output as needed. */
+    for (i = 0; i < len; i += n) {
+        n = Py_MIN(len - i, (Py_ssize_t)sizeof(chunk) / 4);
+        if (_Encoder_Write(self, chunk, _encode_utf8(kind, udata, i, i + n, chunk)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* LEB128 encode `x` into `buf` (which must have room for 10 bytes),
+ * returning the number of bytes used */
+static Py_ssize_t
+_encode_uvarint(char *buf, size_t x)
+{
+    Py_ssize_t len = 0;
+    while (x >= 0x80) {
+        buf[len++] = (unsigned char)(x | 0x80);
+        x >>= 7;
+    }
+    buf[len++] = (unsigned char)x;
+    return len;
+}
+
+/* Flags for the kind byte of NATIVE_UNICODE ops */
+#define NATIVE_UNICODE_BIG_ENDIAN 0x80
+
+/* Write a str as its PEP 393 kind followed by the raw code units, for the
+ * `native_strings` option. Only used for UCS-1 and UCS-2 strings that are no
+ * larger than their utf-8 encoding, and avoids transcoding on both ends. */
+static int
+save_native_unicode(EncoderObject *self, PyObject *obj)
+{
+    char header[12];
+    Py_ssize_t len = PyUnicode_GET_LENGTH(obj);
+    int kind = PyUnicode_KIND(obj);
+
+    assert(kind == PyUnicode_1BYTE_KIND || kind == PyUnicode_2BYTE_KIND);
+    header[0] = NATIVE_UNICODE;
+    header[1] = (unsigned char)kind;
+#if PY_BIG_ENDIAN
+    header[1] |= NATIVE_UNICODE_BIG_ENDIAN;
+#endif
+    if (_write_bytes(self, header, 2 + _encode_uvarint(header + 2, (size_t)len),
+                     PyUnicode_DATA(obj), len * kind, NULL) < 0)
+        return -1;
+    return MEMO_PUT_MAYBE(self, obj, 0);
+}
+
 static int
 save_unicode(EncoderObject *self, PyObject *obj)
 {
     char header[9];
     Py_ssize_t len;
-    PyObject *encoded = NULL;
     Py_ssize_t size;
     const char *data;
 
     if (PyUnicode_READY(obj))
         return -1;
 
-    data = PyUnicode_AsUTF8AndSize(obj, &size);
-    if (data == NULL) {
-        /* Issue #8383: for strings with lone surrogates, fallback on the
-           "surrogatepass" error handler. */
-        PyErr_Clear();
-        encoded = PyUnicode_AsEncodedString(obj, "utf-8", "surrogatepass");
-        if (encoded == NULL)
-            return -1;
+    /* ASCII strings are the same in utf-8, and have a shorter header */
+    if (self->native_strings && !PyUnicode_IS_ASCII(obj) &&
+            PyUnicode_KIND(obj) == PyUnicode_1BYTE_KIND)
+        return save_native_unicode(self, obj);
 
-        data = PyBytes_AS_STRING(encoded);
-        size = PyBytes_GET_SIZE(encoded);
-    }
+    data = _unicode_utf8(obj, &size);
+
+    /* UCS-2 strings that are mostly ASCII are smaller as utf-8 */
+    if (self->native_strings && PyUnicode_KIND(obj) == PyUnicode_2BYTE_KIND &&
+            PyUnicode_GET_LENGTH(obj) <= size / 2)
+        return save_native_unicode(self, obj);
 
     assert(size >= 0);
     if (size <= 0xff) {
@@ -1954,11 +3323,8 @@ save_unicode(EncoderObject *self, PyObject *obj)
         len = 9;
     }
 
-    if (_write_bytes(self, header, len, data, size, encoded) < 0) {
-        Py_XDECREF(encoded);
+    if (_write_unicode(self, header, len, obj, data, size) < 0)
         return -1;
-    }
-    Py_XDECREF(encoded);
 
     if (MEMO_PUT_MAYBE(self, obj, 0) < 0) {
         return -1;
@@ -1967,6 +3333,41 @@ save_unicode(EncoderObject *self, PyObject *obj)
     return 0;
 }
 
+/* Save a str or bytes object, deduplicating by value rather than identity.
+ * Repeated values are written as a memo lookup of the first occurrence. */
+static int
+save_deduped(EncoderObject *self, PyObject *obj,
+             int (*save_func)(EncoderObject *, PyObject *))
+{
+    PyObject *index;
+    Py_ssize_t memo_index;
+
+    index = PyDict_GetItemWithError(self->value_memo, obj);
+    if (index != NULL) {
+        return memo_get(self, obj, PyLong_AsSsize_t(index));
+    }
+    if (PyErr_Occurred())
+        return -1;
+
+    memo_index = LookupTable_Size(self->memo);
+    if (save_func(self, obj) < 0)
+        return -1;
+    /* Force memoization if the refcount heuristic skipped it */
+    if (LookupTable_Size(self->memo) == memo_index) {
+        if (memo_put(self, obj) < 0)
+            return -1;
+    }
+    index = PyLong_FromSsize_t(memo_index + MEMO_BASE(self));
+    if (index == NULL)
+        return -1;
+    if (PyDict_SetItem(self->value_memo, obj, index) < 0) {
+        Py_DECREF(index);
+        return -1;
+    }
+    Py_DECREF(index);
+    return 0;
+}
+
 /* A helper for save_tuple.  Push the len elements in tuple t on the stack. */
 static int
 store_tuple_elements(EncoderObject *self, PyObject *t, Py_ssize_t len, int memoize)
@@ -1996,6 +3397,24 @@ store_tuple_elements(EncoderObject *self, PyObject *t, Py_ssize_t len, int memoi
     return 0;
 }
 
+/* Whether a container of `size` items should be written with the counted
+ * container opcodes */
+#define USE_COUNTED(self, size) ((self)->counted_containers && (size) > 1)
+
+/* Write an opcode followed by a LEB128 encoded count */
+static int
+_write_counted_op(EncoderObject *self, char op, Py_ssize_t count)
+{
+    char header[11];
+    Py_ssize_t len;
+
+    header[0] = op;
+    len = 1 + _encode_uvarint(header + 1, (size_t)count);
+    if (_Encoder_Write(self, header, len) < 0)
+        return -1;
+    return 0;
+}
+
 static int
 save_tuple(EncoderObject *self, PyObject *obj, int memoize)
 {
@@ -2104,6 +3523,20 @@ batch_list(EncoderObject *self, PyObject *obj, int memoize)
         return 0;
     }
 
+    if (USE_COUNTED(self, PyList_GET_SIZE(obj))) {
+        /* Write all items, followed by their count */
+        Py_ssize_t size = PyList_GET_SIZE(obj);
+        for (total = 0; total < size; total++) {
+            if (PyList_GET_SIZE(obj) != size)
+                goto changed_size;
+            if (save(self, PyList_GET_ITEM(obj, total), memoize) < 0)
+                return -1;
+        }
+        if (PyList_GET_SIZE(obj) != size)
+            goto changed_size;
+        return _write_counted_op(self, APPENDS_N, size);
+    }
+
     /* Write in batches of BATCHSIZE. */
     total = 0;
     do {
@@ -2124,6 +3557,162 @@ batch_list(EncoderObject *self, PyObject *obj, int memoize)
     } while (total < PyList_GET_SIZE(obj));
 
     return 0;
+
+changed_size:
+    PyErr_SetString(PyExc_RuntimeError, "list changed size during iteration");
+    return -1;
+}
+
+/* Write `n` ints that all fit in `width` bytes as a PACKED_INTS op */
+static int
+save_packed_ints(EncoderObject *self, PyObject **items, Py_ssize_t n,
+                 int width)
+{
+    char header[10], chunk[PACKED_CHUNK_SIZE * 8], *p;
+    Py_ssize_t i, j;
+    long long x;
+
+    header[0] = PACKED_INTS;
+    header[1] = (char)width;
+    _write_size64(header + 2, n);
+    if (_Encoder_Write(self, header, 10) < 0)
+        return -1;
+
+    for (i = 0; i < n; i += PACKED_CHUNK_SIZE) {
+        Py_ssize_t stop = Py_MIN(n, i + PACKED_CHUNK_SIZE);
+        p = chunk;
+        for (j = i; j < stop; j++) {
+            /* Range already checked, can't fail */
+            x = PyLong_AsLongLong(items[j]);
+            switch (width) {
+                case 8:
+                    p[7] = (char)(x >> 56);
+                    p[6] = (char)(x >> 48);
+                    p[5] = (char)(x >> 40);
+                    p[4] = (char)(x >> 32);
+                    /* fall through */
+                case 4:
+                    p[3] = (char)(x >> 24);
+                    p[2] = (char)(x >> 16);
+                    /* fall through */
+                case 2:
+                    p[1] = (char)(x >> 8);
+                    /* fall through */
+                default:
+                    p[0] = (char)x;
+            }
+            p += width;
+        }
+        if (_Encoder_Write(self, chunk, p - chunk) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write `n` floats as a PACKED_FLOATS op */
+static int
+save_packed_floats(EncoderObject *self, PyObject **items, Py_ssize_t n)
+{
+    char header[9], chunk[PACKED_CHUNK_SIZE * 8], *p;
+    Py_ssize_t i, j;
+
+    header[0] = PACKED_FLOATS;
+    _write_size64(header + 1, n);
+    if (_Encoder_Write(self, header, 9) < 0)
+        return -1;
+
+    for (i = 0; i < n; i += PACKED_CHUNK_SIZE) {
+        Py_ssize_t stop = Py_MIN(n, i + PACKED_CHUNK_SIZE);
+        p = chunk;
+        for (j = i; j < stop; j++, p += 8) {
+            double x = PyFloat_AS_DOUBLE(items[j]);
+            if (_PyFloat_Pack8(x, (unsigned char *)p, 1) < 0)
+                return -1;
+        }
+        if (_Encoder_Write(self, chunk, p - chunk) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write `n` bools as a PACKED_BOOLS op */
+static int
+save_packed_bools(EncoderObject *self, PyObject **items, Py_ssize_t n)
+{
+    char header[9], chunk[PACKED_CHUNK_SIZE];
+    Py_ssize_t i, j;
+
+    header[0] = PACKED_BOOLS;
+    _write_size64(header + 1, n);
+    if (_Encoder_Write(self, header, 9) < 0)
+        return -1;
+
+    for (i = 0; i < n; i += PACKED_CHUNK_SIZE) {
+        Py_ssize_t stop = Py_MIN(n, i + PACKED_CHUNK_SIZE);
+        for (j = i; j < stop; j++) {
+            chunk[j - i] = items[j] == Py_True;
+        }
+        if (_Encoder_Write(self, chunk, stop - i) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Try to write `n` items as a list with one of the PACKED_* opcodes.
+ * Returns 1 if the items were written, 0 if they aren't homogeneous and must
+ * be written normally, -1 on error. */
+static int
+save_packed_list(EncoderObject *self, PyObject **items, Py_ssize_t n)
+{
+    Py_ssize_t i;
+    PyObject *item = items[0];
+    PyTypeObject *type = Py_TYPE(item);
+
+    if (type == &PyFloat_Type) {
+        for (i = 1; i < n; i++) {
+            if (Py_TYPE(items[i]) != &PyFloat_Type)
+                return 0;
+        }
+        return save_packed_floats(self, items, n) < 0 ? -1 : 1;
+    }
+    else if (type == &PyBool_Type) {
+        for (i = 1; i < n; i++) {
+            if (Py_TYPE(items[i]) != &PyBool_Type)
+                return 0;
+        }
+        return save_packed_bools(self, items, n) < 0 ? -1 : 1;
+    }
+    else if (type == &PyLong_Type) {
+        int overflow;
+        long long x, lo = 0, hi = 0;
+        int width;
+
+        for (i = 0; i < n; i++) {
+            item = items[i];
+            if (Py_TYPE(item) != &PyLong_Type)
+                return 0;
+            x = PyLong_AsLongLongAndOverflow(item, &overflow);
+            if (overflow)
+                return 0;
+            if (x == -1 && PyErr_Occurred())
+                return -1;
+            if (x < lo)
+                lo = x;
+            else if (x > hi)
+                hi = x;
+        }
+        /* Use the smallest width that fits all values */
+        if (lo >= -0x80 && hi <= 0x7f)
+            width = 1;
+        else if (lo >= -0x8000 && hi <= 0x7fff)
+            width = 2;
+        else if (lo >= -0x80000000LL && hi <= 0x7fffffffLL)
+            width = 4;
+        else
+            width = 8;
+        return save_packed_ints(self, items, n, width) < 0 ? -1 : 1;
+    }
+    return 0;
 }
 
 static int
@@ -2132,6 +3721,17 @@ save_list(EncoderObject *self, PyObject *obj, int memoize)
     char header[3];
     Py_ssize_t len;
 
+    if (self->packed_lists && PyList_GET_SIZE(obj) >= PACKED_LIST_MIN_SIZE) {
+        /* Packed lists only contain atoms, so can't be recursive. The list
+         * is memoized after being written */
+        int status = save_packed_list(self, PySequence_Fast_ITEMS(obj),
+                                      PyList_GET_SIZE(obj));
+        if (status < 0)
+            return -1;
+        if (status == 1)
+            return MEMO_PUT_MAYBE(self, obj, memoize);
+    }
+
     /* Create an empty list. */
     header[0] = EMPTY_LIST;
     len = 1;
@@ -2142,6 +3742,12 @@ save_list(EncoderObject *self, PyObject *obj, int memoize)
     if (MEMO_PUT_MAYBE(self, obj, memoize) < 0)
         return -1;
 
+    if (self->struct_columns && PyList_GET_SIZE(obj) > 1) {
+        int status = save_struct_columns(self, obj, memoize);
+        if (status != 0)
+            return status < 0 ? -1 : 0;
+    }
+
     if (PyList_GET_SIZE(obj))
         return batch_list(self, obj, memoize);
     return 0;
@@ -2180,6 +3786,19 @@ batch_dict(EncoderObject *self, PyObject *obj, int memoize)
         return 0;
     }
 
+    if (USE_COUNTED(self, dict_size)) {
+        /* Write all items, followed by their count */
+        while (PyDict_Next(obj, &ppos, &key, &value)) {
+            if (save(self, key, memoize) < 0)
+                return -1;
+            if (save(self, value, memoize) < 0)
+                return -1;
+            if (PyDict_GET_SIZE(obj) != dict_size)
+                goto changed_size;
+        }
+        return _write_counted_op(self, SETITEMS_N, dict_size);
+    }
+
     /* Write in batches of BATCHSIZE. */
     do {
         i = 0;
@@ -2195,15 +3814,124 @@ batch_dict(EncoderObject *self, PyObject *obj, int memoize)
         }
         if (_Encoder_Write(self, &setitems_op, 1) < 0)
             return -1;
-        if (PyDict_GET_SIZE(obj) != dict_size) {
+        if (PyDict_GET_SIZE(obj) != dict_size)
+            goto changed_size;
+
+    } while (i == BATCHSIZE);
+    return 0;
+
+changed_size:
+    PyErr_Format(
+        PyExc_RuntimeError,
+        "dictionary changed size during iteration");
+    return -1;
+}
+
+/* Find the index of the shape matching the keys of `obj`, defining a new
+ * shape if needed. Returns -1 on failure, -2 if `obj` can't be written with
+ * a shape. */
+static Py_ssize_t
+_Encoder_DictShape(EncoderObject *self, PyObject *obj, int memoize)
+{
+    PyObject *key, *value, *keys, *index;
+    Py_ssize_t i, ppos = 0, n = PyDict_GET_SIZE(obj);
+
+    /* Fast path, the same keys as the last dict */
+    if (self->last_shape != NULL && PyTuple_GET_SIZE(self->last_shape) == n) {
+        for (i = 0; PyDict_Next(obj, &ppos, &key, &value); i++) {
+            PyObject *expected = PyTuple_GET_ITEM(self->last_shape, i);
+            if (key != expected &&
+                !(PyUnicode_CheckExact(key) && _PyUnicode_EQ(key, expected)))
+                break;
+        }
+        if (i == n)
+            return self->last_shape_index;
+        ppos = 0;
+    }
+
+    keys = PyTuple_New(n);
+    if (keys == NULL)
+        return -1;
+    for (i = 0; PyDict_Next(obj, &ppos, &key, &value); i++) {
+        if (!PyUnicode_CheckExact(key)) {
+            /* Only str keys, other types may compare equal to each other */
+            Py_DECREF(keys);
+            return -2;
+        }
+        Py_INCREF(key);
+        PyTuple_SET_ITEM(keys, i, key);
+    }
+
+    index = PyDict_GetItemWithError(self->shapes, keys);
+    if (index != NULL) {
+        i = PyLong_AsSsize_t(index);
+    }
+    else if (PyErr_Occurred()) {
+        Py_DECREF(keys);
+        return -1;
+    }
+    else if (PyDict_GET_SIZE(self->shapes) >= SHAPE_MAX_COUNT) {
+        Py_DECREF(keys);
+        return -2;
+    }
+    else {
+        /* Define a new shape */
+        i = PyDict_GET_SIZE(self->shapes);
+        for (ppos = 0; ppos < n; ppos++) {
+            if (save(self, PyTuple_GET_ITEM(keys, ppos), memoize) < 0) {
+                Py_DECREF(keys);
+                return -1;
+            }
+        }
+        if (_write_counted_op(self, DEFINE_SHAPE, n) < 0) {
+            Py_DECREF(keys);
+            return -1;
+        }
+        index = PyLong_FromSsize_t(i);
+        if (index == NULL || PyDict_SetItem(self->shapes, keys, index) < 0) {
+            Py_XDECREF(index);
+            Py_DECREF(keys);
+            return -1;
+        }
+        Py_DECREF(index);
+    }
+    /* The shapes dict keeps the tuple alive */
+    Py_DECREF(keys);
+    self->last_shape = keys;
+    self->last_shape_index = i;
+    return i;
+}
+
+/* Write a dict as its values, followed by a SHAPED_DICT op referencing the
+ * shape of its keys. The dict is created after its values, so it must not be
+ * reachable from them - this is guaranteed when nothing else references it.
+ * Returns -1 on failure, 0 if the dict can't be written with a shape, 1 on
+ * success. */
+static int
+save_shaped_dict(EncoderObject *self, PyObject *obj, int memoize)
+{
+    PyObject *key, *value;
+    Py_ssize_t index, ppos = 0, n = PyDict_GET_SIZE(obj);
+
+    index = _Encoder_DictShape(self, obj, memoize);
+    if (index == -2)
+        return 0;
+    if (index < 0)
+        return -1;
+
+    while (PyDict_Next(obj, &ppos, &key, &value)) {
+        if (save(self, value, memoize) < 0)
+            return -1;
+        if (PyDict_GET_SIZE(obj) != n) {
             PyErr_Format(
                 PyExc_RuntimeError,
                 "dictionary changed size during iteration");
             return -1;
         }
-
-    } while (i == BATCHSIZE);
-    return 0;
+    }
+    if (_write_counted_op(self, SHAPED_DICT, index) < 0)
+        return -1;
+    return 1;
 }
 
 static int
@@ -2211,16 +3939,35 @@ save_dict(EncoderObject *self, PyObject *obj, int memoize)
 {
     char header[3];
     Py_ssize_t len;
+    /* The same decision as MEMO_PUT_MAYBE. A memoized dict may be referenced
+     * from its own values, so it can't be written with a shape. */
+    int memoized = self->active_memoize && (memoize || Py_REFCNT(obj) > 1);
     assert(PyDict_Check(obj));
 
-    /* Create an empty dict. */
-    header[0] = EMPTY_DICT;
-    len = 1;
+    if (self->shapes != NULL && !memoized && PyDict_GET_SIZE(obj) > 0 &&
+            PyDict_GET_SIZE(obj) <= SHAPE_MAX_KEYS) {
+        int status = save_shaped_dict(self, obj, memoize);
+        if (status < 0)
+            return -1;
+        if (status == 1)
+            return 0;
+    }
 
-    if (_Encoder_Write(self, header, len) < 0)
-        return -1;
+    if (USE_COUNTED(self, PyDict_GET_SIZE(obj))) {
+        /* Create an empty dict, presized by the decoder */
+        if (_write_counted_op(self, EMPTY_DICT_N, PyDict_GET_SIZE(obj)) < 0)
+            return -1;
+    }
+    else {
+        /* Create an empty dict. */
+        header[0] = EMPTY_DICT;
+        len = 1;
 
-    if (MEMO_PUT_MAYBE(self, obj, memoize) < 0)
+        if (_Encoder_Write(self, header, len) < 0)
+            return -1;
+    }
+
+    if (memoized && memo_put(self, obj) < 0)
         return -1;
 
     if (PyDict_GET_SIZE(obj))
@@ -2250,6 +3997,17 @@ save_set(EncoderObject *self, PyObject *obj, int memoize)
     if (set_size == 0)
         return 0;  /* nothing to do */
 
+    if (USE_COUNTED(self, set_size)) {
+        /* Write all items, followed by their count */
+        while (_PySet_NextEntry(obj, &ppos, &item, &hash)) {
+            if (save(self, item, memoize) < 0)
+                return -1;
+            if (PySet_GET_SIZE(obj) != set_size)
+                goto changed_size;
+        }
+        return _write_counted_op(self, ADDITEMS_N, set_size);
+    }
+
     /* Write in batches of BATCHSIZE. */
     do {
         i = 0;
@@ -2263,15 +4021,17 @@ save_set(EncoderObject *self, PyObject *obj, int memoize)
         }
         if (_Encoder_Write(self, &additems_op, 1) < 0)
             return -1;
-        if (PySet_GET_SIZE(obj) != set_size) {
-            PyErr_Format(
-                PyExc_RuntimeError,
-                "set changed size during iteration");
-            return -1;
-        }
+        if (PySet_GET_SIZE(obj) != set_size)
+            goto changed_size;
     } while (i == BATCHSIZE);
 
     return 0;
+
+changed_size:
+    PyErr_Format(
+        PyExc_RuntimeError,
+        "set changed size during iteration");
+    return -1;
 }
 
 static int
@@ -2333,18 +4093,18 @@ save_frozenset(EncoderObject *self, PyObject *obj, int memoize)
 }
 
 static int
-write_typecode(EncoderObject *self, PyObject *obj, const char op1, const char op2, const char op3) {
+write_type_typecode(EncoderObject *self, PyTypeObject *type, const char op1, const char op2, const char op3) {
     int n;
     Py_ssize_t code = -1;
     char pdata[6];
 
     if (self->registry != NULL) {
-        code = LookupTable_Get(self->registry, (PyObject*)Py_TYPE(obj));
+        code = LookupTable_Get(self->registry, (PyObject*)type);
     }
     if (code == -1) {
         PyErr_Format(PyExc_TypeError,
                      "Type %.200s isn't in type registry",
-                     Py_TYPE(obj)->tp_name);
+                     type->tp_name);
         return -1;
     }
     if (code < 0xff) {
@@ -2373,66 +4133,404 @@ write_typecode(EncoderObject *self, PyObject *obj, const char op1, const char op
 }
 
 static int
-save_struct(EncoderObject *self, PyObject *obj, int memoize)
+write_typecode(EncoderObject *self, PyObject *obj, const char op1, const char op2, const char op3) {
+    return write_type_typecode(self, Py_TYPE(obj), op1, op2, op3);
+}
+
+/* Write a struct of a fully typed Struct type as its typecode and field
+ * count, followed by the field values without type tags. Returns 1 if the
+ * struct was written, 0 if a field value doesn't match its annotation, -1 on
+ * error. */
+static int
+save_typed_struct(EncoderObject *self, PyObject *obj, int memoize)
 {
-    Py_ssize_t i, nfields;
+    char *layout, buf[10];
+    Py_ssize_t i, nfields, size;
     PyObject *val;
+    const char *data;
+    long long x;
+    int overflow;
 
-    const char mark_op = MARK;
-    const char buildstruct_op = BUILDSTRUCT;
+    nfields = StructMeta_GET_NFIELDS(Py_TYPE(obj));
+    layout = StructMeta_GET_LAYOUT(Py_TYPE(obj));
 
-    if (write_typecode(self, obj, STRUCT1, STRUCT2, STRUCT4) < 0)
-        return -1;
+    /* Check every value matches the layout before writing anything */
+    for (i = 0; i < nfields; i++) {
+        val = Struct_get_index(obj, i);
+        if (val == NULL)
+            return -1;
+        switch (layout[i]) {
+            case FIELD_INT:
+                if (Py_TYPE(val) != &PyLong_Type)
+                    return 0;
+                PyLong_AsLongLongAndOverflow(val, &overflow);
+                if (overflow)
+                    return 0;
+                break;
+            case FIELD_FLOAT:
+                if (Py_TYPE(val) != &PyFloat_Type)
+                    return 0;
+                break;
+            case FIELD_BOOL:
+                if (val != Py_True && val != Py_False)
+                    return 0;
+                break;
+            case FIELD_STR:
+                if (Py_TYPE(val) != &PyUnicode_Type)
+                    return 0;
+                if (PyUnicode_READY(val) < 0)
+                    return -1;
+                break;
+            case FIELD_BYTES:
+                if (Py_TYPE(val) != &PyBytes_Type)
+                    return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
 
-    if (MEMO_PUT_MAYBE(self, obj, memoize) < 0)
+    if (write_typecode(self, obj, TYPED_STRUCT1, TYPED_STRUCT2, TYPED_STRUCT4) < 0)
         return -1;
-
-    if (_Encoder_Write(self, &mark_op, 1) < 0)
+    if (_Encoder_Write(self, buf, _encode_uvarint(buf, (size_t)nfields)) < 0)
         return -1;
-
-    nfields = StructMeta_GET_NFIELDS(Py_TYPE(obj));
     for (i = 0; i < nfields; i++) {
         val = Struct_get_index(obj, i);
-        if (val == NULL) {
-            return -1;
+        switch (layout[i]) {
+            case FIELD_INT:
+                x = PyLong_AsLongLong(val);
+                size = _encode_uvarint(
+                    buf, ((unsigned long long)x << 1) ^ (unsigned long long)(x >> 63)
+                );
+                if (_Encoder_Write(self, buf, size) < 0)
+                    return -1;
+                break;
+            case FIELD_FLOAT:
+                if (_PyFloat_Pack8(PyFloat_AS_DOUBLE(val), (unsigned char *)buf, 1) < 0)
+                    return -1;
+                if (_Encoder_Write(self, buf, 8) < 0)
+                    return -1;
+                break;
+            case FIELD_BOOL:
+                buf[0] = (val == Py_True);
+                if (_Encoder_Write(self, buf, 1) < 0)
+                    return -1;
+                break;
+            case FIELD_STR:
+                data = _unicode_utf8(val, &size);
+                if (_write_unicode(self, buf, _encode_uvarint(buf, (size_t)size),
+                                   val, data, size) < 0)
+                    return -1;
+                break;
+            default:
+                size = PyBytes_GET_SIZE(val);
+                if (_write_bytes(self, buf, _encode_uvarint(buf, (size_t)size),
+                                 PyBytes_AS_STRING(val), size, val) < 0)
+                    return -1;
+                break;
         }
-        if (save(self, val, memoize) < 0)
-            return -1;
     }
-    if (_Encoder_Write(self, &buildstruct_op, 1) < 0)
+    if (MEMO_PUT_MAYBE(self, obj, memoize) < 0)
         return -1;
-
-    return 0;
+    return 1;
 }
 
+/* Whether a field value can be omitted in favor of the field default. Values
+ * must be of the same type as the default, so decoding can't change the type
+ * of a value (e.g. `1` vs `True`). A default that's copied on decode is a new
+ * object, so values that may be referenced elsewhere in the message are kept
+ * when memoizing. Returns -1 on error. */
 static int
-save_enum(EncoderObject *self, PyObject *obj)
+_is_default_value(EncoderObject *self, PyObject *val, PyObject *default_val)
 {
-    if (PyLong_Check(obj)) {
-        if (save_long(self, obj) < 0) {
-            return -1;
+    if (self->active_memoize && Py_REFCNT(val) > 1 &&
+            !default_is_shared(default_val))
+        return 0;
+    if (val == default_val)
+        return 1;
+    if (Py_TYPE(val) != Py_TYPE(default_val))
+        return 0;
+    return PyObject_RichCompareBool(val, default_val, Py_EQ);
+}
+
+/* Fill in `omit` with whether each defaulted field of `obj` is equal to its
+ * default. Returns the number of leading fields that must be written (fields
+ * after that are all defaults), or -1 on error. */
+static Py_ssize_t
+_struct_omitted_fields(EncoderObject *self, PyObject *obj, char *omit,
+                       Py_ssize_t *ninterior)
+{
+    PyObject *defaults, *val;
+    Py_ssize_t i, nfields, npos, nwrite;
+    int status;
+
+    defaults = StructMeta_GET_DEFAULTS(Py_TYPE(obj));
+    nfields = StructMeta_GET_NFIELDS(Py_TYPE(obj));
+    npos = nfields - PyTuple_GET_SIZE(defaults);
+    nwrite = npos;
+    *ninterior = 0;
+    for (i = 0; i < nfields; i++) {
+        if (i < npos) {
+            omit[i] = 0;
+            continue;
         }
-    } else {
-        int status;
-        PyObject *name = NULL;
-        QuickleState *st = quickle_get_global_state();
-        name = PyObject_GetAttr(obj, st->name_str);
-        if (name == NULL)
+        val = Struct_get_index(obj, i);
+        if (val == NULL)
             return -1;
-
-        status = save(self, name, 0);
-        Py_DECREF(name);
+        status = _is_default_value(self, val, PyTuple_GET_ITEM(defaults, i - npos));
         if (status < 0)
             return -1;
+        omit[i] = status;
+        if (status)
+            *ninterior += 1;
+        else
+            nwrite = i + 1;
     }
-
-    if (write_typecode(self, obj, ENUM1, ENUM2, ENUM4) < 0)
-        return -1;
-
-    if (MEMO_PUT(self, obj) < 0)
-        return -1;
-
-    return 0;
+    /* Only count defaults before the last written field */
+    for (i = nwrite; i < nfields; i++) {
+        *ninterior -= omit[i];
+    }
+    return nwrite;
+}
+
+static int
+save_struct(EncoderObject *self, PyObject *obj, int memoize)
+{
+    Py_ssize_t i, nfields, nwrite, ninterior = 0, nbitmap;
+    PyObject *val;
+    char *omit = NULL;
+    int sparse = 0, status = -1;
+
+    const char mark_op = MARK;
+    const char buildstruct_op = BUILDSTRUCT;
+
+    if (self->typed_structs && ((StructMetaObject *)Py_TYPE(obj))->struct_typed) {
+        status = save_typed_struct(self, obj, memoize);
+        if (status != 0)
+            return status < 0 ? -1 : 0;
+        status = -1;
+    }
+
+    nfields = nwrite = StructMeta_GET_NFIELDS(Py_TYPE(obj));
+    nbitmap = (nfields + 7) / 8;
+    if (self->omit_defaults && nfields > 0) {
+        omit = PyMem_Malloc(nfields);
+        if (omit == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        nwrite = _struct_omitted_fields(self, obj, omit, &ninterior);
+        if (nwrite < 0)
+            goto done;
+        /* Skip interior defaults with a bitmap of the written fields, if
+         * that's smaller than writing them */
+        nbitmap = (nwrite + 7) / 8;
+        sparse = ninterior > nbitmap + 1;
+    }
+
+    if (write_typecode(self, obj, STRUCT1, STRUCT2, STRUCT4) < 0)
+        goto done;
+
+    if (MEMO_PUT_MAYBE(self, obj, memoize) < 0)
+        goto done;
+
+    /* With counted containers or a bitmap the number of fields follows the
+     * fields, so no MARK is needed */
+    if (!self->counted_containers && !sparse && _Encoder_Write(self, &mark_op, 1) < 0)
+        goto done;
+
+    for (i = 0; i < nwrite; i++) {
+        if (sparse && omit[i])
+            continue;
+        val = Struct_get_index(obj, i);
+        if (val == NULL)
+            goto done;
+        if (save(self, val, memoize) < 0)
+            goto done;
+    }
+
+    if (sparse) {
+        char bitmap[256], *p = bitmap;
+        if (nbitmap > (Py_ssize_t)sizeof(bitmap)) {
+            if ((p = PyMem_Calloc(nbitmap, 1)) == NULL) {
+                PyErr_NoMemory();
+                goto done;
+            }
+        }
+        else {
+            memset(bitmap, 0, nbitmap);
+        }
+        for (i = 0; i < nwrite; i++) {
+            if (!omit[i])
+                p[i / 8] |= (1 << (i % 8));
+        }
+        if (_write_counted_op(self, BUILDSTRUCT_SPARSE, nwrite) == 0 &&
+                _Encoder_Write(self, p, nbitmap) >= 0)
+            status = 0;
+        if (p != bitmap)
+            PyMem_Free(p);
+    }
+    else if (self->counted_containers) {
+        status = _write_counted_op(self, BUILDSTRUCT_N, nwrite);
+    }
+    else if (_Encoder_Write(self, &buildstruct_op, 1) >= 0) {
+        status = 0;
+    }
+
+done:
+    PyMem_Free(omit);
+    return status;
+}
+
+/* Write one column of `n` struct field values as a list */
+static int
+_save_struct_column(EncoderObject *self, PyObject **items, Py_ssize_t n,
+                    int memoize)
+{
+    const char empty_list_op = EMPTY_LIST;
+    Py_ssize_t i;
+
+    if (n >= PACKED_LIST_MIN_SIZE) {
+        int status = save_packed_list(self, items, n);
+        if (status != 0)
+            return status < 0 ? -1 : 0;
+    }
+    if (_Encoder_Write(self, &empty_list_op, 1) < 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (save(self, items[i], memoize) < 0)
+            return -1;
+    }
+    return _write_counted_op(self, APPENDS_N, n);
+}
+
+/* Try to write the items of a list of structs column-wise, appending them to
+ * the (already written) list with a STRUCT_COLUMNS op. The structs are built
+ * after their fields, so this is only done when nothing else references
+ * them. Returns 1 if the items were written, 0 if the list isn't eligible,
+ * -1 on error. */
+static int
+save_struct_columns(EncoderObject *self, PyObject *obj, int memoize)
+{
+    PyObject *item, **column;
+    PyTypeObject *type;
+    Py_ssize_t i, j, nfields, n = PyList_GET_SIZE(obj);
+    int status = -1;
+
+    type = Py_TYPE(PyList_GET_ITEM(obj, 0));
+    if (Py_TYPE(type) != &StructMetaType)
+        return 0;
+    nfields = StructMeta_GET_NFIELDS(type);
+    if (nfields == 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        item = PyList_GET_ITEM(obj, i);
+        if (Py_TYPE(item) != type ||
+                (self->active_memoize && Py_REFCNT(item) != 1))
+            return 0;
+    }
+
+    column = PyMem_New(PyObject *, n);
+    if (column == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (j = 0; j < nfields; j++) {
+        if (PyList_GET_SIZE(obj) != n) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "list changed size during iteration");
+            goto done;
+        }
+        for (i = 0; i < n; i++) {
+            column[i] = Struct_get_index(PyList_GET_ITEM(obj, i), j);
+            if (column[i] == NULL)
+                goto done;
+        }
+        if (_save_struct_column(self, column, n, memoize) < 0)
+            goto done;
+    }
+    if (write_typecode(self, PyList_GET_ITEM(obj, 0), STRUCT_COLUMNS1,
+                       STRUCT_COLUMNS2, STRUCT_COLUMNS4) < 0)
+        goto done;
+    {
+        char buf[10];
+        Py_ssize_t len = _encode_uvarint(buf, (size_t)nfields);
+        if (_Encoder_Write(self, buf, len) < 0)
+            goto done;
+    }
+    status = 1;
+
+done:
+    PyMem_Free(column);
+    return status;
+}
+
+static int
+save_struct_array(EncoderObject *self, PyObject *obj, int memoize)
+{
+    StructArrayObject *arr = (StructArrayObject *)obj;
+    PyObject *column;
+    Py_ssize_t i, n, ncols;
+    char buf[10];
+    int status;
+
+    if (write_type_typecode(self, arr->type, EMPTY_STRUCT_ARRAY1,
+                            EMPTY_STRUCT_ARRAY2, EMPTY_STRUCT_ARRAY4) < 0)
+        return -1;
+    if (MEMO_PUT_MAYBE(self, obj, memoize) < 0)
+        return -1;
+
+    n = arr->len;
+    if (n == 0)
+        return 0;
+    ncols = PyTuple_GET_SIZE(arr->columns);
+    for (i = 0; i < ncols; i++) {
+        /* Saving a column may run arbitrary code, work on a snapshot */
+        column = PyList_AsTuple(PyTuple_GET_ITEM(arr->columns, i));
+        if (column == NULL)
+            return -1;
+        status = _save_struct_column(
+            self, &PyTuple_GET_ITEM(column, 0), n, memoize
+        );
+        Py_DECREF(column);
+        if (status < 0)
+            return -1;
+    }
+    if (_write_counted_op(self, STRUCT_ARRAY_EXTEND, n) < 0)
+        return -1;
+    if (_Encoder_Write(self, buf, _encode_uvarint(buf, (size_t)ncols)) < 0)
+        return -1;
+    return 0;
+}
+
+static int
+save_enum(EncoderObject *self, PyObject *obj)
+{
+    if (PyLong_Check(obj)) {
+        if (save_long(self, obj) < 0) {
+            return -1;
+        }
+    } else {
+        int status;
+        PyObject *name = NULL;
+        QuickleState *st = quickle_get_global_state();
+        name = PyObject_GetAttr(obj, st->name_str);
+        if (name == NULL)
+            return -1;
+
+        status = save(self, name, 0);
+        Py_DECREF(name);
+        if (status < 0)
+            return -1;
+    }
+
+    if (write_typecode(self, obj, ENUM1, ENUM2, ENUM4) < 0)
+        return -1;
+
+    if (MEMO_PUT(self, obj) < 0)
+        return -1;
+
+    return 0;
 }
 
 # define RETURN_RECURSIVE(call) \
@@ -2480,10 +4578,21 @@ save(EncoderObject *self, PyObject *obj, int memoize)
         return memo_get(self, obj, memo_index);
     }
 
+    if (self->dictionary_values != NULL &&
+            (type == &PyUnicode_Type || type == &PyBytes_Type)) {
+        int status = save_dictionary_value(self, obj);
+        if (status != 0)
+            return status < 0 ? -1 : 0;
+    }
+
     if (type == &PyUnicode_Type) {
+        if (self->dedupe_strings && self->active_memoize)
+            return save_deduped(self, obj, save_unicode);
         return save_unicode(self, obj);
     }
     else if (type == &PyBytes_Type) {
+        if (self->dedupe_bytes && self->active_memoize)
+            return save_deduped(self, obj, save_bytes);
         return save_bytes(self, obj);
     }
     else if (type == &PyByteArray_Type) {
@@ -2492,6 +4601,9 @@ save(EncoderObject *self, PyObject *obj, int memoize)
     else if (Py_TYPE(type) == &StructMetaType) {
         RETURN_RECURSIVE(save_struct(self, obj, memoize));
     }
+    else if (type == &StructArray_Type) {
+        RETURN_RECURSIVE(save_struct_array(self, obj, memoize));
+    }
     else if (type == &PyDict_Type) {
         RETURN_RECURSIVE(save_dict(self, obj, memoize));
     }
@@ -2510,6 +4622,9 @@ save(EncoderObject *self, PyObject *obj, int memoize)
     else if (type == &PyPickleBuffer_Type) {
         return save_picklebuffer(self, obj);
     }
+    else if (type == &PyMemoryView_Type) {
+        return save_memoryview(self, obj);
+    }
     else if (type == PyDateTimeAPI->DeltaType) {
         return save_timedelta(self, obj);
     }
@@ -2533,6 +4648,9 @@ save(EncoderObject *self, PyObject *obj, int memoize)
     else if (type == st->ZoneInfoType) {
         return save_zoneinfo(self, obj);
     }
+    else if (type == st->ArrayType) {
+        return save_array(self, obj);
+    }
     else {
         PyErr_Format(PyExc_TypeError,
                      "quickle doesn't support objects of type %.200s",
@@ -2551,60 +4669,148 @@ dump(EncoderObject *self, PyObject *obj)
     return 0;
 }
 
-static PyObject*
-Encoder_dumps_internal(EncoderObject *self, PyObject *obj)
+/* Raise a RuntimeError if a `dump*` call is already in progress. User code
+ * run mid-encode (e.g. a file's `write` method) may try to re-enter the
+ * encoder, which would clobber the state of the outer call. */
+static int
+_Encoder_CheckNotInUse(EncoderObject *self)
 {
-    int status;
-    PyObject *buffers, *temp, *res = NULL;
+    if (self->in_use) {
+        PyErr_SetString(PyExc_RuntimeError, "Encoder is already in use");
+        return -1;
+    }
+    return 0;
+}
 
+/* Prepare the encoder for a new `dump`/`dumps` call. Returns -1 on failure,
+ * 0 on success. */
+static int
+_Encoder_Setup(EncoderObject *self)
+{
     /* reset buffers */
     self->output_len = 0;
+    self->output_written = 0;
+    self->max_output_len = self->write_buffer_size;
     if (self->output_buffer == NULL) {
-        self->max_output_len = self->write_buffer_size;
         self->output_buffer = PyBytes_FromStringAndSize(NULL, self->max_output_len);
         if (self->output_buffer == NULL)
-            return NULL;
+            return -1;
     }
+    self->output_data = PyBytes_AS_STRING(self->output_buffer);
     /* Allocate a new list for buffers if needed */
     if (self->active_collect_buffers && self->buffers == NULL) {
         self->buffers = PyList_New(0);
         if (self->buffers == NULL) {
-            return NULL;
+            return -1;
         }
     }
+    self->memo_mark = LookupTable_Size(self->memo);
+    self->in_use = 1;
+    return 0;
+}
 
-    status = dump(self, obj);
-
-    /* Reset temporary state */
+/* Reset temporary state after a `dump`/`dumps` call. `call_status` is the
+ * status of the call, a session memo is kept on success and rolled back on
+ * failure. Returns -1 on failure, 0 on success. */
+static int
+_Encoder_Reset(EncoderObject *self, int call_status)
+{
+    int status = 0;
     if (self->active_memoize) {
-        if (LookupTable_Reset(self->memo) < 0)
-            status = -1;
+        if (!self->persistent_memo) {
+            if (_Encoder_MemoReset(self) < 0)
+                status = -1;
+        }
+        else if (call_status < 0) {
+            if (_Encoder_MemoRollback(self) < 0)
+                status = -1;
+        }
     }
+    _Encoder_ShapesReset(self);
     self->active_memoize = self->memoize;
+    self->in_use = 0;
+    return status;
+}
+
+/* Take the list of collected buffers, returning None if no buffers were
+ * found. Returns a new reference. */
+static PyObject*
+_Encoder_TakeBuffers(EncoderObject *self)
+{
+    PyObject *buffers;
+    if (PyList_GET_SIZE(self->buffers) > 0) {
+        buffers = self->buffers;
+        self->buffers = NULL;
+    }
+    else {
+        buffers = Py_None;
+        Py_INCREF(buffers);
+    }
+    return buffers;
+}
+
+/* Drop any collected buffers after a failed `dump`/`dumps` call */
+static void
+_Encoder_DropBuffers(EncoderObject *self)
+{
+    if (self->buffers != NULL && PyList_GET_SIZE(self->buffers)) {
+        Py_CLEAR(self->buffers);
+    }
+}
+
+/* Take the output of a successful `dumps`/`dumps_many` call as a bytes
+ * object. Returns a new reference. */
+static PyObject*
+_Encoder_TakeOutput(EncoderObject *self)
+{
+    PyObject *res;
+    if (self->max_output_len > self->write_buffer_size) {
+        /* Buffer was resized, trim to length */
+        res = self->output_buffer;
+        self->output_buffer = NULL;
+        _PyBytes_Resize(&res, self->output_len);
+    }
+    else {
+        /* Only constant buffer used, copy to output */
+        res = PyBytes_FromStringAndSize(self->output_data, self->output_len);
+    }
+    return res;
+}
+
+/* Drop the output buffer after a failed `dumps`/`dumps_many` call if it was
+ * resized. */
+static void
+_Encoder_DropOutput(EncoderObject *self)
+{
+    if (self->max_output_len > self->write_buffer_size) {
+        Py_DECREF(self->output_buffer);
+        self->output_buffer = NULL;
+    }
+}
+
+static PyObject*
+Encoder_dumps_internal(EncoderObject *self, PyObject *obj)
+{
+    int status;
+    PyObject *buffers, *temp, *res = NULL;
+
+    if (_Encoder_Setup(self) < 0)
+        return NULL;
+
+    status = dump(self, obj);
+
+    if (_Encoder_Reset(self, status) < 0)
+        status = -1;
 
     if (status == 0) {
-        if (self->max_output_len > self->write_buffer_size) {
-            /* Buffer was resized, trim to length */
-            res = self->output_buffer;
-            self->output_buffer = NULL;
-            _PyBytes_Resize(&res, self->output_len);
-        }
-        else {
-            /* Only constant buffer used, copy to output */
-            res = PyBytes_FromStringAndSize(
-                PyBytes_AS_STRING(self->output_buffer),
-                self->output_len
-            );
+        res = _Encoder_TakeOutput(self);
+        if (res == NULL) {
+            self->active_collect_buffers = self->collect_buffers;
+            _Encoder_DropBuffers(self);
+            return NULL;
         }
         if (self->active_collect_buffers) {
-            if (PyList_GET_SIZE(self->buffers) > 0) {
-                buffers = self->buffers;
-                self->buffers = NULL;
-            }
-            else {
-                buffers = Py_None;
-                Py_INCREF(buffers);
-            }
+            buffers = _Encoder_TakeBuffers(self);
             temp = PyTuple_New(2);
             if (temp == NULL) {
                 Py_DECREF(res);
@@ -2617,22 +4823,259 @@ Encoder_dumps_internal(EncoderObject *self, PyObject *obj)
         }
     } else {
         /* Error in dumps, drop buffer if necessary */
-        if (self->max_output_len > self->write_buffer_size) {
-            Py_DECREF(self->output_buffer);
-            self->output_buffer = NULL;
+        _Encoder_DropOutput(self);
+        _Encoder_DropBuffers(self);
+    }
+    self->active_collect_buffers = self->collect_buffers;
+    return res;
+}
+
+static PyObject*
+Encoder_dumps_many_internal(EncoderObject *self, PyObject *iterable)
+{
+    int status = 0;
+    Py_ssize_t i, n;
+    PyObject *seq, *offsets = NULL, *offset, *res = NULL;
+
+    /* Collect all items up front, so no user code runs mid-encode */
+    seq = PySequence_Fast(iterable, "dumps_many requires an iterable");
+    if (seq == NULL)
+        goto done;
+    n = PySequence_Fast_GET_SIZE(seq);
+    offsets = PyList_New(n + 1);
+    if (offsets == NULL)
+        goto done;
+
+    /* Out-of-band buffers are unsupported, each message is independent */
+    self->active_collect_buffers = 0;
+    if (_Encoder_Setup(self) < 0)
+        goto done;
+
+    for (i = 0; i <= n; i++) {
+        offset = PyLong_FromSsize_t(self->output_len);
+        if (offset == NULL) {
+            status = -1;
+            break;
+        }
+        PyList_SET_ITEM(offsets, i, offset);
+        if (i == n)
+            break;
+        if (dump(self, PySequence_Fast_GET_ITEM(seq, i)) < 0) {
+            status = -1;
+            break;
+        }
+        /* Reset the memo (unless it's a session memo) and dict shapes
+         * between messages */
+        if (self->active_memoize && !self->persistent_memo &&
+                _Encoder_MemoReset(self) < 0) {
+            status = -1;
+            break;
         }
-        if (self->buffers != NULL && PyList_GET_SIZE(self->buffers)) {
-            Py_CLEAR(self->buffers);
+        _Encoder_ShapesReset(self);
+    }
+
+    if (_Encoder_Reset(self, status) < 0)
+        status = -1;
+
+    if (status == 0) {
+        PyObject *data = _Encoder_TakeOutput(self);
+        if (data != NULL) {
+            res = PyTuple_Pack(2, data, offsets);
+            Py_DECREF(data);
         }
     }
+    else {
+        _Encoder_DropOutput(self);
+    }
+
+done:
+    self->active_memoize = self->memoize;
     self->active_collect_buffers = self->collect_buffers;
+    Py_XDECREF(seq);
+    Py_XDECREF(offsets);
     return res;
 }
 
+static PyObject*
+Encoder_dump_internal(EncoderObject *self, PyObject *obj, PyObject *file)
+{
+    int status = -1;
+    PyObject *res = NULL;
+    QuickleState *st = quickle_get_global_state();
 
-static char *Encoder_dumps_kws[] = {"memoize", "collect_buffers", NULL};
+    self->write = PyObject_GetAttr(file, st->write_str);
+    if (self->write == NULL) {
+        if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "file must have a 'write' attribute");
+        }
+    }
+    else if (_Encoder_Setup(self) == 0) {
+        /* The output buffer is never grown while writing to a file, it's
+         * flushed whenever it fills up. */
+        status = dump(self, obj);
+        if (status == 0)
+            status = _Encoder_FlushToFile(self);
+    }
+    Py_CLEAR(self->write);
+    self->output_len = 0;
 
-PyDoc_STRVAR(Encoder_dumps__doc__,
+    if (_Encoder_Reset(self, status) < 0)
+        status = -1;
+
+    if (status == 0) {
+        if (self->active_collect_buffers) {
+            res = _Encoder_TakeBuffers(self);
+        }
+        else {
+            res = Py_None;
+            Py_INCREF(res);
+        }
+    }
+    else {
+        _Encoder_DropBuffers(self);
+    }
+    self->active_collect_buffers = self->collect_buffers;
+    return res;
+}
+
+/* Raise a BufferTooSmallError, reporting the `needed` buffer size */
+static void
+_Encoder_BufferTooSmall(Py_ssize_t needed, Py_ssize_t available)
+{
+    PyObject *exc, *temp;
+    QuickleState *st = quickle_get_global_state();
+
+    exc = PyObject_CallFunction(
+        st->BufferTooSmallError, "s",
+        "buffer is too small to hold the serialized object"
+    );
+    if (exc == NULL)
+        return;
+    temp = PyLong_FromSsize_t(needed);
+    if (temp == NULL) {
+        Py_DECREF(exc);
+        return;
+    }
+    if (PyObject_SetAttr(exc, st->needed_str, temp) < 0) {
+        Py_DECREF(temp);
+        Py_DECREF(exc);
+        return;
+    }
+    Py_DECREF(temp);
+    PyErr_SetObject(st->BufferTooSmallError, exc);
+    Py_DECREF(exc);
+}
+
+static PyObject*
+Encoder_dumps_into_internal(EncoderObject *self, PyObject *obj,
+                            PyObject *buffer, Py_ssize_t offset)
+{
+    int status = -1;
+    Py_ssize_t size, nbytes = 0;
+    PyObject *buffers, *temp, *res = NULL;
+
+    if (offset < 0) {
+        PyErr_SetString(PyExc_ValueError, "offset must be non-negative");
+        goto done;
+    }
+    if (PyByteArray_CheckExact(buffer)) {
+        /* bytearrays are written to directly, and grown as needed */
+        size = PyByteArray_GET_SIZE(buffer);
+    }
+    else {
+        if (PyObject_GetBuffer(buffer, &self->output_view,
+                               PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+            self->output_view.buf = NULL;
+            goto done;
+        }
+        size = self->output_view.len;
+    }
+    if (offset > size) {
+        PyErr_Format(PyExc_ValueError,
+                     "offset (%zd) is out of bounds for a buffer of size %zd",
+                     offset, size);
+        goto done;
+    }
+    if (_Encoder_Setup(self) < 0)
+        goto done;
+
+    self->output_offset = offset;
+    self->output_overflow = 0;
+    self->max_output_len = size - offset;
+    if (self->output_view.buf != NULL) {
+        self->output_data = (char *)self->output_view.buf + offset;
+    }
+    else {
+        if (PyObject_GetBuffer(buffer, &self->output_target_view,
+                               PyBUF_SIMPLE) < 0) {
+            self->output_target_view.obj = NULL;
+            goto done;
+        }
+        self->output_target = buffer;
+        self->output_data = PyByteArray_AS_STRING(buffer) + offset;
+    }
+
+    status = dump(self, obj);
+    nbytes = self->output_len + self->output_overflow;
+
+    if (status == 0 && self->output_overflow > 0) {
+        _Encoder_BufferTooSmall(offset + nbytes, size);
+        status = -1;
+    }
+    if (status == 0 && self->output_target != NULL && offset + nbytes > size) {
+        /* bytearray was grown, trim to length */
+        if (_Encoder_ResizeTarget(self, offset + nbytes) < 0)
+            status = -1;
+    }
+
+done:
+    if (self->output_view.buf != NULL) {
+        PyBuffer_Release(&self->output_view);
+        self->output_view.buf = NULL;
+    }
+    if (self->output_target_view.obj != NULL)
+        PyBuffer_Release(&self->output_target_view);
+    self->output_target = NULL;
+    self->output_offset = 0;
+    self->output_len = 0;
+    if (self->output_buffer != NULL) {
+        self->output_data = PyBytes_AS_STRING(self->output_buffer);
+        self->max_output_len = self->write_buffer_size;
+    }
+
+    if (_Encoder_Reset(self, status) < 0)
+        status = -1;
+
+    if (status == 0) {
+        res = PyLong_FromSsize_t(nbytes);
+        if (res != NULL && self->active_collect_buffers) {
+            buffers = _Encoder_TakeBuffers(self);
+            temp = PyTuple_New(2);
+            if (temp == NULL) {
+                Py_DECREF(res);
+                Py_DECREF(buffers);
+                res = NULL;
+            }
+            else {
+                PyTuple_SET_ITEM(temp, 0, res);
+                PyTuple_SET_ITEM(temp, 1, buffers);
+                res = temp;
+            }
+        }
+    }
+    else {
+        _Encoder_DropBuffers(self);
+    }
+    self->active_collect_buffers = self->collect_buffers;
+    return res;
+}
+
+static char *Encoder_dumps_kws[] = {"memoize", "collect_buffers", NULL};
+static char *Encoder_dumps_into_kws[] = {"offset", "memoize", "collect_buffers", NULL};
+static char *Encoder_dumps_many_kws[] = {"memoize", NULL};
+
+PyDoc_STRVAR(Encoder_dumps__doc__,
 "dumps(obj, *, memoize=None, collect_buffers=None)\n"
 "--\n"
 "\n"
@@ -2659,24 +5102,18 @@ PyDoc_STRVAR(Encoder_dumps__doc__,
 "    also be returned (or None if no buffers are found). Not returned if\n"
 "    ``collect_buffers`` is `False`"
 );
-static PyObject*
-Encoder_dumps(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+/* Apply the `memoize` and `collect_buffers` keyword arguments shared by
+ * all `dump*` methods to the encoder. Every `dump*` method goes through here
+ * before touching any encoder state, so this also rejects re-entrant calls.
+ * Returns -1 on failure, 0 on success. */
+static int
+Encoder_apply_options(EncoderObject *self, PyObject *memoize,
+                      PyObject *collect_buffers)
 {
     int temp;
-    PyObject *obj = NULL;
-    PyObject *memoize = Py_None;
-    PyObject *collect_buffers = Py_None;
-    QuickleState *st = quickle_get_global_state();
 
-    if (!check_positional_nargs(nargs, 1, 1)) {
-        return NULL;
-    }
-    obj = args[0];
-    if (kwnames != NULL) {
-        if (!parse_keywords(kwnames, args + nargs, st->encoder_dumps_kws, &memoize, &collect_buffers)) {
-            return NULL;
-        }
-    }
+    if (_Encoder_CheckNotInUse(self) < 0)
+        return -1;
 
     if (memoize == Py_None) {
         self->active_memoize = self->memoize;
@@ -2684,7 +5121,7 @@ Encoder_dumps(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyOb
     else {
         temp = PyObject_IsTrue(memoize);
         if (temp < 0) {
-            return NULL;
+            return -1;
         }
         self->active_memoize = temp;
     }
@@ -2694,11 +5131,217 @@ Encoder_dumps(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyOb
     else {
         temp = PyObject_IsTrue(collect_buffers);
         if (temp < 0) {
-            return NULL;
+            return -1;
         }
         self->active_collect_buffers = temp;
     }
-    return Encoder_dumps_internal(self, obj);
+    return 0;
+}
+
+/* Parse the `memoize` and `collect_buffers` keyword arguments shared by
+ * `dump` and `dumps`, and apply them to the encoder. Returns -1 on failure,
+ * 0 on success. */
+static int
+Encoder_parse_options(EncoderObject *self, PyObject *const *args,
+                      Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *memoize = Py_None;
+    PyObject *collect_buffers = Py_None;
+    QuickleState *st = quickle_get_global_state();
+
+    if (kwnames != NULL) {
+        if (!parse_keywords(kwnames, args + nargs, st->encoder_dumps_kws, &memoize, &collect_buffers)) {
+            return -1;
+        }
+    }
+    return Encoder_apply_options(self, memoize, collect_buffers);
+}
+
+static PyObject*
+Encoder_dumps(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    if (!check_positional_nargs(nargs, 1, 1)) {
+        return NULL;
+    }
+    if (Encoder_parse_options(self, args, nargs, kwnames) < 0) {
+        return NULL;
+    }
+    return Encoder_dumps_internal(self, args[0]);
+}
+
+PyDoc_STRVAR(Encoder_dump__doc__,
+"dump(obj, file, *, memoize=None, collect_buffers=None)\n"
+"--\n"
+"\n"
+"Serialize an object to a file.\n"
+"\n"
+"Unlike `Encoder.dumps`, the full message is never held in memory. Output is\n"
+"written to ``file`` in chunks of up to ``write_buffer_size`` bytes as the\n"
+"internal buffer fills up. Large ``bytes``, ``bytearray``, and ``str``\n"
+"payloads are written to ``file`` directly, bypassing the buffer.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"obj : object\n"
+"    The object to serialize.\n"
+"file : file-like\n"
+"    An object with a ``write`` method accepting a bytes-like object, such as\n"
+"    a file opened in binary mode, an ``io.BytesIO``, or a socket file. Note\n"
+"    that ``write`` may be passed a temporary `memoryview` that's only valid\n"
+"    for the duration of the call.\n"
+"memoize : bool, optional\n"
+"    Whether to enable memoization. Defaults to the value set on the encoder.\n"
+"collect_buffers : bool, optional\n"
+"    Whether to collect out-of-band buffers. Defaults to the value set on the\n"
+"    encoder.\n"
+"\n"
+"Returns\n"
+"-------\n"
+"buffers : list of `PickleBuffer` or `None`\n"
+"    If ``collect_buffers`` is `True`, a list of out-of-band buffers (or None\n"
+"    if no buffers are found). Otherwise always `None`."
+);
+static PyObject*
+Encoder_dump(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    if (!check_positional_nargs(nargs, 2, 2)) {
+        return NULL;
+    }
+    if (Encoder_parse_options(self, args, nargs, kwnames) < 0) {
+        return NULL;
+    }
+    return Encoder_dump_internal(self, args[0], args[1]);
+}
+
+PyDoc_STRVAR(Encoder_dumps_into__doc__,
+"dumps_into(obj, buffer, offset=0, *, memoize=None, collect_buffers=None)\n"
+"--\n"
+"\n"
+"Serialize an object into an existing buffer.\n"
+"\n"
+"This avoids allocating a new ``bytes`` object for every message, and lets\n"
+"messages be written directly into preallocated memory (e.g. a send buffer\n"
+"or shared memory).\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"obj : object\n"
+"    The object to serialize.\n"
+"buffer : bytearray or writable buffer-like\n"
+"    The buffer to write into. A ``bytearray`` is grown as needed if the\n"
+"    serialized object doesn't fit, any other writable C-contiguous buffer\n"
+"    (e.g. a ``memoryview`` or ``mmap``) has a fixed size.\n"
+"offset : int, optional\n"
+"    The offset into ``buffer`` to start writing at. Defaults to 0.\n"
+"memoize : bool, optional\n"
+"    Whether to enable memoization. Defaults to the value set on the encoder.\n"
+"collect_buffers : bool, optional\n"
+"    Whether to collect out-of-band buffers. Defaults to the value set on the\n"
+"    encoder.\n"
+"\n"
+"Returns\n"
+"-------\n"
+"nbytes : int\n"
+"    The number of bytes written, starting at ``offset``.\n"
+"buffers : list of `PickleBuffer` or `None`, optional\n"
+"    If ``collect_buffers`` is `True`, a list of out-of-band buffers will\n"
+"    also be returned (or None if no buffers are found). Not returned if\n"
+"    ``collect_buffers`` is `False`\n"
+"\n"
+"Raises\n"
+"------\n"
+"BufferTooSmallError\n"
+"    If ``buffer`` isn't a ``bytearray`` and is too small to hold the\n"
+"    serialized object. The ``needed`` attribute of the error holds the\n"
+"    minimum buffer size required. The contents of ``buffer`` past\n"
+"    ``offset`` are unspecified."
+);
+static PyObject*
+Encoder_dumps_into(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Py_ssize_t offset = 0;
+    PyObject *offset_obj = NULL;
+    PyObject *memoize = Py_None;
+    PyObject *collect_buffers = Py_None;
+    QuickleState *st = quickle_get_global_state();
+
+    if (!check_positional_nargs(nargs, 2, 3)) {
+        return NULL;
+    }
+    if (nargs == 3) {
+        offset_obj = args[2];
+    }
+    if (kwnames != NULL) {
+        PyObject *offset_kw = NULL;
+        if (!parse_keywords(kwnames, args + nargs, st->encoder_dumps_into_kws,
+                            &offset_kw, &memoize, &collect_buffers)) {
+            return NULL;
+        }
+        if (offset_kw != NULL) {
+            if (offset_obj != NULL) {
+                PyErr_SetString(PyExc_TypeError,
+                                "Argument 'offset' given by name and position");
+                return NULL;
+            }
+            offset_obj = offset_kw;
+        }
+    }
+    if (offset_obj != NULL) {
+        offset = PyNumber_AsSsize_t(offset_obj, PyExc_OverflowError);
+        if (offset == -1 && PyErr_Occurred())
+            return NULL;
+    }
+    if (Encoder_apply_options(self, memoize, collect_buffers) < 0) {
+        return NULL;
+    }
+    return Encoder_dumps_into_internal(self, args[0], args[1], offset);
+}
+
+PyDoc_STRVAR(Encoder_dumps_many__doc__,
+"dumps_many(objs, *, memoize=None)\n"
+"--\n"
+"\n"
+"Serialize many objects into a single buffer.\n"
+"\n"
+"Each object is serialized as an independent message, written back to back\n"
+"into one ``bytes`` object. This is more efficient than calling\n"
+"`Encoder.dumps` once per object, and the result can be written out with a\n"
+"single call.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"objs : iterable\n"
+"    The objects to serialize.\n"
+"memoize : bool, optional\n"
+"    Whether to enable memoization. Defaults to the value set on the encoder.\n"
+"    The memo is reset between messages.\n"
+"\n"
+"Returns\n"
+"-------\n"
+"data : bytes\n"
+"    The serialized messages, concatenated.\n"
+"offsets : list of int\n"
+"    The start offset of each message in ``data``, followed by the total\n"
+"    length. Message ``i`` is ``data[offsets[i]:offsets[i + 1]]``."
+);
+static PyObject*
+Encoder_dumps_many(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *memoize = Py_None;
+    QuickleState *st = quickle_get_global_state();
+
+    if (!check_positional_nargs(nargs, 1, 1)) {
+        return NULL;
+    }
+    if (kwnames != NULL) {
+        if (!parse_keywords(kwnames, args + nargs, st->encoder_dumps_many_kws, &memoize)) {
+            return NULL;
+        }
+    }
+    if (Encoder_apply_options(self, memoize, Py_None) < 0) {
+        return NULL;
+    }
+    return Encoder_dumps_many_internal(self, args[0]);
 }
 
 static PyObject*
@@ -2711,6 +5354,10 @@ Encoder_sizeof(EncoderObject *self)
         res += sizeof(LookupTable);
         res += self->memo->allocated * sizeof(LookupEntry);
     }
+    if (self->dictionary_memo != NULL) {
+        res += sizeof(LookupTable);
+        res += self->dictionary_memo->allocated * sizeof(LookupEntry);
+    }
     if (self->output_buffer != NULL) {
         res += self->max_output_len;
     }
@@ -2722,6 +5369,18 @@ static struct PyMethodDef Encoder_methods[] = {
         "dumps", (PyCFunction) Encoder_dumps, METH_FASTCALL | METH_KEYWORDS,
         Encoder_dumps__doc__,
     },
+    {
+        "dump", (PyCFunction) Encoder_dump, METH_FASTCALL | METH_KEYWORDS,
+        Encoder_dump__doc__,
+    },
+    {
+        "dumps_into", (PyCFunction) Encoder_dumps_into, METH_FASTCALL | METH_KEYWORDS,
+        Encoder_dumps_into__doc__,
+    },
+    {
+        "dumps_many", (PyCFunction) Encoder_dumps_many, METH_FASTCALL | METH_KEYWORDS,
+        Encoder_dumps_many__doc__,
+    },
     {
         "__sizeof__", (PyCFunction) Encoder_sizeof, METH_NOARGS,
         PyDoc_STR("Size in bytes")
@@ -2734,6 +5393,16 @@ Encoder_clear(EncoderObject *self)
 {
     Py_CLEAR(self->output_buffer);
     Py_CLEAR(self->buffers);
+    Py_CLEAR(self->write);
+    Py_CLEAR(self->value_memo);
+    Py_CLEAR(self->shapes);
+    self->last_shape = NULL;
+    Py_CLEAR(self->dictionary);
+    Py_CLEAR(self->dictionary_values);
+    if (self->dictionary_memo != NULL) {
+        LookupTable_Del(self->dictionary_memo);
+        self->dictionary_memo = NULL;
+    }
     if (self->registry != NULL) {
         LookupTable_Del(self->registry);
         self->registry = NULL;
@@ -2758,8 +5427,16 @@ static int
 Encoder_traverse(EncoderObject *self, visitproc visit, void *arg)
 {
     Py_VISIT(self->buffers);
+    Py_VISIT(self->write);
+    Py_VISIT(self->value_memo);
+    Py_VISIT(self->shapes);
+    Py_VISIT(self->dictionary);
+    Py_VISIT(self->dictionary_values);
     if ((self->registry != NULL) && (LookupTable_Traverse(self->registry, visit, arg) < 0))
         return -1;
+    if ((self->dictionary_memo != NULL) &&
+            (LookupTable_Traverse(self->dictionary_memo, visit, arg) < 0))
+        return -1;
     if ((self->memo != NULL) && (LookupTable_Traverse(self->memo, visit, arg) < 0))
         return -1;
     return 0;
@@ -2775,10 +5452,37 @@ Encoder_init_internal(
 
     self->collect_buffers = collect_buffers;
     self->active_collect_buffers = collect_buffers;
+    self->in_use = 0;
     self->registry = NULL;
     self->memo = NULL;
     self->output_buffer = NULL;
     self->buffers = NULL;
+    self->write = NULL;
+    self->value_memo = NULL;
+    self->persistent_memo = 0;
+    self->memo_mark = 0;
+    self->dedupe_strings = 0;
+    self->dedupe_bytes = 0;
+    self->packed_lists = 0;
+    self->varints = 0;
+    self->counted_containers = 0;
+    self->dict_shapes = 0;
+    self->struct_columns = 0;
+    self->typed_structs = 0;
+    self->omit_defaults = 0;
+    self->native_strings = 0;
+    self->shapes = NULL;
+    self->last_shape = NULL;
+    self->last_shape_index = 0;
+    self->dictionary = NULL;
+    self->dictionary_memo = NULL;
+    self->dictionary_values = NULL;
+    self->output_target = NULL;
+    self->output_offset = 0;
+    self->output_target_view.obj = NULL;
+    self->output_view.buf = NULL;
+    self->output_overflow = 0;
+    self->output_written = 0;
 
     if (registry == NULL || registry == Py_None) {
         self->registry = NULL;
@@ -2832,55 +5536,305 @@ Encoder_init_internal(
     self->output_buffer = PyBytes_FromStringAndSize(NULL, self->max_output_len);
     if (self->output_buffer == NULL)
         return -1;
+    self->output_data = PyBytes_AS_STRING(self->output_buffer);
     return 0;
 }
 
-PyDoc_STRVAR(Encoder__doc__,
-"Encoder(*, memoize=True, collect_buffers=False, registry=None, write_buffer_size=4096)\n"
-"--\n"
-"\n"
-"A quickle encoder.\n"
-"\n"
-"Creating an `Encoder` and calling the `Encoder.dumps` method multiple times is more\n"
-"efficient than calling `quickle.dumps` multiple times.\n"
-"\n"
-"Parameters\n"
-"----------\n"
-"memoize : bool, optional\n"
-"    Whether to enable memoization. If True (default), any duplicate objects will\n"
-"    only be serialized once. Disabling memoization can be more efficient for\n"
-"    objects unlikely to contain duplicate values, but self-referential objects\n"
-"    will then fail to serialize.\n"
-"collect_buffers : bool, optional\n"
-"    Whether to collect out-of-band buffers. If True, the return value of\n"
-"    `Encoder.dumps` will be the serialized bytes, and a list of any\n"
-"    `PickleBuffer` objects found (or `None` if none are found).\n"
-"registry : list or dict, optional\n"
-"    A registry of user-defined types this decoder instance should support. Can\n"
-"    be either a list of types (recommended), or a dict mapping the type to a\n"
-"    unique positive integer. Note that for deserialization to be successful,\n"
-"    the registry should match that of the corresponding `Decoder`.\n"
-"write_buffer_size : int, optional\n"
-"    The size of the internal static write buffer."
-);
+/* Check that `obj` is an immutable value, so no message can modify it in
+ * place. Returns 1 if immutable, 0 if not, -1 on error. */
 static int
-Encoder_init(EncoderObject *self, PyObject *args, PyObject *kwds)
+_is_immutable_value(PyObject *obj)
 {
-    static char *kwlist[] = {"memoize", "collect_buffers", "registry", "write_buffer_size", NULL};
+    PyTypeObject *type = Py_TYPE(obj);
+    PyObject *item;
+    Py_ssize_t i, ppos = 0;
+    Py_hash_t hash;
+    int status = 1;
+
+    if (obj == Py_None || type == &PyUnicode_Type || type == &PyBytes_Type ||
+            type == &PyLong_Type || type == &PyBool_Type || type == &PyFloat_Type)
+        return 1;
+    if (type != &PyTuple_Type && type != &PyFrozenSet_Type)
+        return 0;
+    if (Py_EnterRecursiveCall(" while checking a dictionary"))
+        return -1;
+    if (type == &PyTuple_Type) {
+        for (i = 0; status == 1 && i < PyTuple_GET_SIZE(obj); i++)
+            status = _is_immutable_value(PyTuple_GET_ITEM(obj, i));
+    }
+    else {
+        while (status == 1 && _PySet_NextEntry(obj, &ppos, &item, &hash))
+            status = _is_immutable_value(item);
+    }
+    Py_LeaveRecursiveCall();
+    return status;
+}
+
+/* Validate a `dictionary` argument, returning it as a new tuple */
+static PyObject *
+_check_dictionary(PyObject *dictionary)
+{
+    PyObject *res;
+    Py_ssize_t i;
+    int status;
+
+    if (!(PyList_CheckExact(dictionary) || PyTuple_CheckExact(dictionary))) {
+        PyErr_SetString(PyExc_TypeError, "dictionary must be a list or a tuple");
+        return NULL;
+    }
+    res = PySequence_Tuple(dictionary);
+    if (res == NULL)
+        return NULL;
+    /* Messages reference the dictionary objects themselves, mutable ones
+     * could be modified by a message (e.g. an APPEND to a list entry). */
+    for (i = 0; i < PyTuple_GET_SIZE(res); i++) {
+        status = _is_immutable_value(PyTuple_GET_ITEM(res, i));
+        if (status == 0) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "dictionary entries must be str, bytes, int, float, None, or "
+                "tuples or frozensets of these, got %.200s",
+                Py_TYPE(PyTuple_GET_ITEM(res, i))->tp_name
+            );
+        }
+        if (status != 1) {
+            Py_DECREF(res);
+            return NULL;
+        }
+    }
+    return res;
+}
+
+static int
+Encoder_set_dictionary(EncoderObject *self, PyObject *dictionary)
+{
+    PyObject *obj, *index;
+    Py_ssize_t i;
+
+    self->dictionary = _check_dictionary(dictionary);
+    if (self->dictionary == NULL)
+        return -1;
+    self->dictionary_memo = LookupTable_New(PyTuple_GET_SIZE(self->dictionary));
+    if (self->dictionary_memo == NULL)
+        return -1;
+    for (i = 0; i < PyTuple_GET_SIZE(self->dictionary); i++) {
+        obj = PyTuple_GET_ITEM(self->dictionary, i);
+        if (LookupTable_Set(self->dictionary_memo, obj, i) < 0)
+            return -1;
+    }
+    if (LookupTable_Size(self->dictionary_memo) != PyTuple_GET_SIZE(self->dictionary)) {
+        PyErr_SetString(PyExc_ValueError, "dictionary contains duplicate objects");
+        return -1;
+    }
+    self->dictionary_values = PyDict_New();
+    if (self->dictionary_values == NULL)
+        return -1;
+    for (i = 0; i < PyTuple_GET_SIZE(self->dictionary); i++) {
+        obj = PyTuple_GET_ITEM(self->dictionary, i);
+        if (!(PyUnicode_CheckExact(obj) || PyBytes_CheckExact(obj)))
+            continue;
+        /* The first occurrence of a value wins */
+        if (PyDict_GetItemWithError(self->dictionary_values, obj) != NULL)
+            continue;
+        if (PyErr_Occurred())
+            return -1;
+        index = PyLong_FromSsize_t(i);
+        if (index == NULL)
+            return -1;
+        if (PyDict_SetItem(self->dictionary_values, obj, index) < 0) {
+            Py_DECREF(index);
+            return -1;
+        }
+        Py_DECREF(index);
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(Encoder__doc__,
+"Encoder(*, memoize=True, collect_buffers=False, registry=None, write_buffer_size=4096,\n"
+"        dedupe_strings=False, dedupe_bytes=False, packed_lists=False, varints=False,\n"
+"        counted_containers=False, dict_shapes=False, struct_columns=False,\n"
+"        typed_structs=False, omit_defaults=False, dictionary=None,\n"
+"        native_strings=False)\n"
+"--\n"
+"\n"
+"A quickle encoder.\n"
+"\n"
+"Creating an `Encoder` and calling the `Encoder.dumps` method multiple times is more\n"
+"efficient than calling `quickle.dumps` multiple times.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"memoize : bool, optional\n"
+"    Whether to enable memoization. If True (default), any duplicate objects will\n"
+"    only be serialized once. Disabling memoization can be more efficient for\n"
+"    objects unlikely to contain duplicate values, but self-referential objects\n"
+"    will then fail to serialize.\n"
+"collect_buffers : bool, optional\n"
+"    Whether to collect out-of-band buffers. If True, the return value of\n"
+"    `Encoder.dumps` will be the serialized bytes, and a list of any\n"
+"    `PickleBuffer` objects found (or `None` if none are found).\n"
+"registry : list or dict, optional\n"
+"    A registry of user-defined types this decoder instance should support. Can\n"
+"    be either a list of types (recommended), or a dict mapping the type to a\n"
+"    unique positive integer. Note that for deserialization to be successful,\n"
+"    the registry should match that of the corresponding `Decoder`.\n"
+"write_buffer_size : int, optional\n"
+"    The size of the internal static write buffer. This is also the chunk size\n"
+"    used when writing to a file with `Encoder.dump`.\n"
+"dedupe_strings : bool, optional\n"
+"    If True, equal ``str`` objects within a message are only serialized\n"
+"    once, even if they're different objects (memoization alone only\n"
+"    deduplicates identical objects). Useful for data with many repeated\n"
+"    keys or values, such as that produced by a JSON parser. Requires\n"
+"    memoization. Default is False.\n"
+"dedupe_bytes : bool, optional\n"
+"    Same as ``dedupe_strings``, but for ``bytes`` objects. Default is False.\n"
+"packed_lists : bool, optional\n"
+"    If True, lists made up entirely of ``int`` (fitting in 64 bits),\n"
+"    ``float``, or ``bool`` values are written as a single packed block,\n"
+"    which is smaller and much faster to serialize and deserialize. Messages\n"
+"    written with this option can't be read by ``pickle``. Default is False.\n"
+"varints : bool, optional\n"
+"    If True, ``int`` values that fit in 64 bits are written as zigzag\n"
+"    variable-length integers (or a fixed 8 byte integer) whenever that's\n"
+"    smaller than the 1, 2, 4 byte or arbitrary precision encodings used by\n"
+"    ``pickle``. This is smaller for most ids, timestamps and negative numbers,\n"
+"    and avoids the slower arbitrary precision path for values above 2**31.\n"
+"    Messages written with this option can't be read by ``pickle``. Default\n"
+"    is False.\n"
+"counted_containers : bool, optional\n"
+"    If True, the items of a ``list``, ``dict`` or ``set`` are followed by\n"
+"    their count, rather than being written in marked batches. This lets the\n"
+"    decoder allocate each container at its final size up front. The fields\n"
+"    of a `Struct` are likewise followed by their count rather than preceded\n"
+"    by a mark. Messages written with this option can't be read by\n"
+"    ``pickle``. Default is False.\n"
+"dict_shapes : bool, optional\n"
+"    If True, the string keys of a ``dict`` are written once per message as\n"
+"    a \"shape\", and every later dict with the same keys (in the same order)\n"
+"    is written as a reference to that shape followed by its values. This\n"
+"    makes lists of records much smaller and faster to deserialize. Only\n"
+"    dicts that aren't referenced elsewhere in the message are written this\n"
+"    way. Messages written with this option can't be read by ``pickle``.\n"
+"    Default is False.\n"
+"struct_columns : bool, optional\n"
+"    If True, lists of two or more instances of the same `Struct` type are\n"
+"    written column-wise: the type once, then each field's values as a\n"
+"    column. Columns of ``int``, ``float`` or ``bool`` values are packed as\n"
+"    with ``packed_lists``. Only structs that aren't referenced elsewhere in\n"
+"    the message are written this way. Messages written with this option\n"
+"    can't be read by ``pickle``. Default is False.\n"
+"typed_structs : bool, optional\n"
+"    If True, instances of `Struct` types whose fields are all annotated as\n"
+"    ``int``, ``float``, ``bool``, ``str`` or ``bytes`` are written without a\n"
+"    type tag per field, using a layout computed when the type was defined.\n"
+"    Instances with a field value not matching its annotation (or an\n"
+"    ``int`` that doesn't fit in 64 bits) are written as normal. Fields may\n"
+"    still be added (with defaults) to the end of a type, but the decoder's\n"
+"    annotations for the existing fields must match the encoder's. Messages\n"
+"    written with this option can't be read by ``pickle``. Default is False.\n"
+"omit_defaults : bool, optional\n"
+"    If True, `Struct` fields whose value is equal to (and of the same type\n"
+"    as) the field's default aren't written, and are filled in from the\n"
+"    defaults on decode. Trailing default fields are simply dropped, interior\n"
+"    ones are skipped using a bitmap of the fields present when that's\n"
+"    smaller. Note that this relies on the `Decoder` having the same defaults\n"
+"    as the `Encoder`. Default is False.\n"
+"dictionary : list or tuple, optional\n"
+"    A sequence of objects (typically strings such as field names or common\n"
+"    values) that are known to both ends ahead of time. They're preloaded\n"
+"    into the memo, so messages can refer to them without ever writing them.\n"
+"    Entries must be immutable: ``str``, ``bytes``, ``int``, ``float``,\n"
+"    ``None``, or tuples or frozensets of these.\n"
+"    ``str`` and ``bytes`` entries are matched by value, other objects by\n"
+"    identity (only when ``memoize`` is enabled). The corresponding `Decoder`\n"
+"    must be created with the same dictionary.\n"
+"native_strings : bool, optional\n"
+"    If True, non-ASCII strings whose characters are all below U+10000 are\n"
+"    written in CPython's internal 1 or 2 bytes per character representation\n"
+"    rather than as utf-8. This makes encoding and decoding a plain memory\n"
+"    copy, and is smaller than utf-8 for Latin-1 and CJK text. Other strings,\n"
+"    including mostly ASCII strings that would double in size, are written\n"
+"    as utf-8. Messages written with this option can't be read\n"
+"    by ``pickle``, or by a machine with a different byte order. Default is\n"
+"    False."
+);
+static int
+Encoder_init(EncoderObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {
+        "memoize", "collect_buffers", "registry", "write_buffer_size",
+        "dedupe_strings", "dedupe_bytes", "packed_lists", "varints",
+        "counted_containers", "dict_shapes", "struct_columns", "typed_structs",
+        "omit_defaults", "dictionary", "native_strings", NULL
+    };
 
     int memoize = 1;
     int collect_buffers = 0;
     PyObject *registry = NULL;
     Py_ssize_t write_buffer_size = 4096;
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$ppOn", kwlist,
+    int dedupe_strings = 0;
+    int dedupe_bytes = 0;
+    int packed_lists = 0;
+    int varints = 0;
+    int counted_containers = 0;
+    int dict_shapes = 0;
+    int struct_columns = 0;
+    int typed_structs = 0;
+    int omit_defaults = 0;
+    PyObject *dictionary = NULL;
+    int native_strings = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$ppOnpppppppppOp", kwlist,
                                      &memoize,
                                      &collect_buffers,
                                      &registry,
-                                     &write_buffer_size)) {
-        return -1;
+                                     &write_buffer_size,
+                                     &dedupe_strings,
+                                     &dedupe_bytes,
+                                     &packed_lists,
+                                     &varints,
+                                     &counted_containers,
+                                     &dict_shapes,
+                                     &struct_columns,
+                                     &typed_structs,
+                                     &omit_defaults,
+                                     &dictionary,
+                                     &native_strings)) {
+        return -1;
+    }
+    if (_Encoder_CheckNotInUse(self) < 0)
+        return -1;
+    /* Release any state from a previous `__init__` call */
+    Encoder_clear(self);
+    if (Encoder_init_internal(self, memoize, collect_buffers, registry, write_buffer_size) < 0)
+        return -1;
+    self->dedupe_strings = dedupe_strings;
+    self->dedupe_bytes = dedupe_bytes;
+    self->packed_lists = packed_lists;
+    self->varints = varints;
+    self->counted_containers = counted_containers;
+    self->dict_shapes = dict_shapes;
+    self->struct_columns = struct_columns;
+    self->typed_structs = typed_structs;
+    self->omit_defaults = omit_defaults;
+    self->native_strings = native_strings;
+    if (dictionary != NULL && dictionary != Py_None) {
+        if (Encoder_set_dictionary(self, dictionary) < 0)
+            return -1;
+    }
+    if (dedupe_strings || dedupe_bytes) {
+        self->value_memo = PyDict_New();
+        if (self->value_memo == NULL)
+            return -1;
+    }
+    if (dict_shapes) {
+        self->shapes = PyDict_New();
+        if (self->shapes == NULL)
+            return -1;
     }
-    return Encoder_init_internal(self, memoize, collect_buffers, registry, write_buffer_size);
+    return 0;
 }
 
 static PyObject *
@@ -2922,6 +5876,88 @@ static PyTypeObject Encoder_Type = {
     .tp_getset = Encoder_getset,
 };
 
+/*************************************************************************
+ * EncoderSession object                                                 *
+ *************************************************************************/
+
+/* An `Encoder` whose memo persists across calls. Objects written in earlier
+ * messages are referenced by later messages with a memo lookup, so the
+ * messages must be decoded in order by a single `DecoderSession`. */
+
+PyDoc_STRVAR(EncoderSession__doc__,
+"EncoderSession(**kwargs)\n"
+"--\n"
+"\n"
+"An `Encoder` for a stream of related messages.\n"
+"\n"
+"Unlike an `Encoder`, the memo isn't cleared between calls. An object that\n"
+"was written in an earlier message is written as a reference in any later\n"
+"message, so repeated strings and shared objects are only sent once per\n"
+"stream. Messages must be decoded in the order they were written by a single\n"
+"`DecoderSession`. If a call fails, anything it added to the memo is\n"
+"discarded, and the session remains usable.\n"
+"\n"
+"Objects are referenced by identity, and are kept alive by the session until\n"
+"the next `EncoderSession.reset`. Objects must not be mutated after they're\n"
+"written, mutations wouldn't be seen by the decoder.\n"
+"\n"
+"Accepts the same arguments as `Encoder`, ``memoize`` must be True."
+);
+
+static int
+EncoderSession_init(EncoderObject *self, PyObject *args, PyObject *kwds)
+{
+    if (Encoder_init(self, args, kwds) < 0)
+        return -1;
+    if (!self->memoize) {
+        PyErr_SetString(PyExc_ValueError,
+                        "EncoderSession requires memoize=True");
+        return -1;
+    }
+    self->persistent_memo = 1;
+    return 0;
+}
+
+PyDoc_STRVAR(EncoderSession_reset__doc__,
+"reset(self)\n"
+"--\n"
+"\n"
+"Clear the memo, releasing any objects written so far.\n"
+"\n"
+"The next message starts a new stream, and the corresponding\n"
+"`DecoderSession` must be reset at the same point."
+);
+static PyObject*
+EncoderSession_reset(EncoderObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (_Encoder_CheckNotInUse(self) < 0)
+        return NULL;
+    if (_Encoder_MemoReset(self) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static struct PyMethodDef EncoderSession_methods[] = {
+    {
+        "reset", (PyCFunction) EncoderSession_reset, METH_NOARGS,
+        EncoderSession_reset__doc__,
+    },
+    {NULL, NULL}                /* sentinel */
+};
+
+static PyTypeObject EncoderSession_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "quickle.EncoderSession",
+    .tp_doc = EncoderSession__doc__,
+    .tp_basicsize = sizeof(EncoderObject),
+    .tp_base = &Encoder_Type,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)Encoder_traverse,
+    .tp_clear = (inquiry)Encoder_clear,
+    .tp_init = (initproc)EncoderSession_init,
+    .tp_methods = EncoderSession_methods,
+};
+
 /*************************************************************************
  * Decoder object                                                      *
  *************************************************************************/
@@ -2934,12 +5970,25 @@ typedef struct DecoderObject {
     PyObject *registry;
 
     /*Per-loads call*/
+    int in_use;                 /* Whether a `load*` call is in progress */
     Py_buffer buffer;
     char *input_buffer;
     Py_ssize_t input_len;
     Py_ssize_t next_read_idx;
 
     PyObject *buffers;          /* iterable of out-of-band buffers, or NULL */
+    PyObject *shapes;           /* list of dict key tuples defined by
+                                   DEFINE_SHAPE, or NULL */
+
+    /* Streaming state, used by `load` */
+    Py_ssize_t read_buffer_size;    /* Default size of read_buffer */
+    char *read_buffer;              /* Window of data read from the file */
+    Py_ssize_t read_buffer_allocated;
+    Py_ssize_t read_buffer_len;     /* Unread data left in read_buffer by the
+                                       last `load` call on read_file */
+    PyObject *read_file;            /* File data in read_buffer came from */
+    PyObject *readinto;             /* `readinto` method of the file being
+                                       read from in `load`, NULL otherwise. */
 
     /* stack */
     PyObject **stack;
@@ -2957,10 +6006,38 @@ typedef struct DecoderObject {
                                    objects. */
     Py_ssize_t marks_allocated; /* Current allocated size of the mark stack. */
     Py_ssize_t marks_len;       /* Number of marks in the mark stack. */
+
+    /* string cache, persists across calls */
+    PyObject **string_cache;    /* Direct-mapped cache of short ASCII strings,
+                                   NULL if disabled. */
+    size_t string_cache_mask;   /* Number of slots - 1 */
+
+    PyObject *dictionary;       /* tuple of objects preceding the memo,
+                                   NULL if no dictionary was provided */
+    int persistent_memo;        /* Whether the memo persists across calls,
+                                   set for `DecoderSession` objects */
+    size_t memo_mark;           /* Size of the memo at the start of the call */
 } DecoderObject;
 
+/* Raise a RuntimeError if a `load*` call is already in progress. User code
+ * run mid-decode (e.g. a file's `readinto` method) may try to re-enter the
+ * decoder, which would free the stack and memo of the outer call. */
+static int
+_Decoder_CheckNotInUse(DecoderObject *self)
+{
+    if (self->in_use) {
+        PyErr_SetString(PyExc_RuntimeError, "Decoder is already in use");
+        return -1;
+    }
+    return 0;
+}
+
+/* Max size in bytes of strings stored in the string cache */
+#define STRING_CACHE_MAX_SIZE 64
+
 static int
-Decoder_init_internal(DecoderObject *self, PyObject *registry)
+Decoder_init_internal(DecoderObject *self, PyObject *registry,
+                      Py_ssize_t read_buffer_size, Py_ssize_t string_cache_size)
 {
     /* These could be made configurable later - these defaults should be good
      * for most users */
@@ -2981,8 +6058,40 @@ Decoder_init_internal(DecoderObject *self, PyObject *registry)
     self->marks_allocated = 0;
     self->marks = NULL;
 
+    self->in_use = 0;
     self->buffers = NULL;
     self->buffer.buf = NULL;
+    self->shapes = NULL;
+    self->dictionary = NULL;
+    self->persistent_memo = 0;
+    self->memo_mark = 0;
+
+    self->read_buffer_size = Py_MAX(read_buffer_size, 32);
+    self->read_buffer = NULL;
+    self->read_buffer_allocated = 0;
+    self->read_buffer_len = 0;
+    self->read_file = NULL;
+    self->readinto = NULL;
+
+    self->string_cache = NULL;
+    self->string_cache_mask = 0;
+    if (string_cache_size < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "string_cache_size must be non-negative");
+        return -1;
+    }
+    if (string_cache_size > 0) {
+        /* Round up to a power of two */
+        size_t nslots = 1;
+        while (nslots < (size_t)string_cache_size)
+            nslots <<= 1;
+        self->string_cache = PyMem_Calloc(nslots, sizeof(PyObject *));
+        if (self->string_cache == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->string_cache_mask = nslots - 1;
+    }
 
     if (registry == NULL || registry == Py_None) {
         self->registry = NULL;
@@ -2998,8 +6107,11 @@ Decoder_init_internal(DecoderObject *self, PyObject *registry)
     return 0;
 }
 
+static int Decoder_clear(DecoderObject *self);
+
 PyDoc_STRVAR(Decoder__doc__,
-"Decoder(registry=None)\n"
+"Decoder(*, registry=None, read_buffer_size=65536, string_cache_size=0,\n"
+"        dictionary=None)\n"
 "--\n"
 "\n"
 "A quickle decoder.\n"
@@ -3015,17 +6127,49 @@ PyDoc_STRVAR(Decoder__doc__,
 "    be either a list of types (recommended), or a dict mapping positive\n"
 "    integers to each type. Note that for deserialization to be successful,\n"
 "    the registry should match that of the corresponding `Encoder`.\n"
+"read_buffer_size : int, optional\n"
+"    The size of the window used for reading from a file in `Decoder.load`.\n"
+"    The window only grows beyond this if a single value (e.g. a large\n"
+"    ``str``) doesn't fit.\n"
+"string_cache_size : int, optional\n"
+"    If nonzero, short ASCII strings (e.g. dict keys) are cached by value in\n"
+"    a fixed-size table of roughly this many entries, which persists across\n"
+"    calls. Repeated strings then decode to the same ``str`` object, saving\n"
+"    allocations and rehashing, and reducing memory usage of large decoded\n"
+"    datasets. Defaults to 0 (disabled).\n"
+"dictionary : list or tuple, optional\n"
+"    A sequence of objects preloaded into the memo before every message. This\n"
+"    must match the ``dictionary`` of the corresponding `Encoder`.\n"
 );
 static int
 Decoder_init(DecoderObject *self, PyObject *args, PyObject *kwds)
 {
     PyObject *registry = NULL;
-    static char *kwlist[] = {"registry", NULL};
+    Py_ssize_t read_buffer_size = 65536;
+    Py_ssize_t string_cache_size = 0;
+    PyObject *dictionary = NULL;
+    static char *kwlist[] = {
+        "registry", "read_buffer_size", "string_cache_size", "dictionary", NULL
+    };
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$O", kwlist, &registry)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$OnnO", kwlist,
+                                     &registry, &read_buffer_size,
+                                     &string_cache_size, &dictionary)) {
         return -1;
     }
-    return Decoder_init_internal(self, registry);
+    if (_Decoder_CheckNotInUse(self) < 0)
+        return -1;
+    /* Release any state from a previous `__init__` call */
+    Decoder_clear(self);
+    if (Decoder_init_internal(self, registry, read_buffer_size,
+                              string_cache_size) < 0)
+        return -1;
+    if (dictionary != NULL && dictionary != Py_None) {
+        self->dictionary = _check_dictionary(dictionary);
+        if (self->dictionary == NULL)
+            return -1;
+    }
+    return 0;
 }
 
 static void _Decoder_memo_clear(DecoderObject *self);
@@ -3048,10 +6192,28 @@ Decoder_clear(DecoderObject *self)
     self->marks = NULL;
 
     Py_CLEAR(self->buffers);
+    Py_CLEAR(self->shapes);
+    Py_CLEAR(self->dictionary);
     if (self->buffer.buf != NULL) {
         PyBuffer_Release(&self->buffer);
         self->buffer.buf = NULL;
     }
+
+    Py_CLEAR(self->read_file);
+    Py_CLEAR(self->readinto);
+    PyMem_Free(self->read_buffer);
+    self->read_buffer = NULL;
+    self->read_buffer_allocated = 0;
+    self->read_buffer_len = 0;
+
+    if (self->string_cache != NULL) {
+        size_t i;
+        for (i = 0; i <= self->string_cache_mask; i++) {
+            Py_XDECREF(self->string_cache[i]);
+        }
+        PyMem_Free(self->string_cache);
+        self->string_cache = NULL;
+    }
     return 0;
 }
 
@@ -3072,8 +6234,16 @@ Decoder_traverse(DecoderObject *self, visitproc visit, void *arg)
     while (--i >= 0) {
         Py_VISIT(self->stack[i]);
     }
+    i = self->memo_len;
+    while (--i >= 0) {
+        Py_VISIT(self->memo[i]);
+    }
     Py_VISIT(self->buffers);
+    Py_VISIT(self->shapes);
+    Py_VISIT(self->dictionary);
     Py_VISIT(self->registry);
+    Py_VISIT(self->read_file);
+    Py_VISIT(self->readinto);
     return 0;
 }
 
@@ -3085,6 +6255,88 @@ bad_readline()
     return -1;
 }
 
+/* Read up to `n` bytes from the file being read from in `load` into `buf`.
+ * Returns the number of bytes read (0 at EOF), or -1 on failure. */
+static Py_ssize_t
+_Decoder_ReadFromFile(DecoderObject *self, char *buf, Py_ssize_t n)
+{
+    PyObject *view, *res, *temp;
+    Py_ssize_t count;
+
+    view = PyMemoryView_FromMemory(buf, n, PyBUF_WRITE);
+    if (view == NULL)
+        return -1;
+    res = CALL_ONE_ARG(self->readinto, view);
+    if (res == NULL) {
+        Py_DECREF(view);
+        return -1;
+    }
+    temp = PyObject_CallMethodObjArgs(
+        view, quickle_get_global_state()->release_str, NULL
+    );
+    Py_DECREF(view);
+    if (temp == NULL) {
+        Py_DECREF(res);
+        return -1;
+    }
+    Py_DECREF(temp);
+    if (res == Py_None) {
+        Py_DECREF(res);
+        PyErr_SetString(PyExc_ValueError,
+                        "file.readinto returned None, non-blocking "
+                        "files aren't supported");
+        return -1;
+    }
+    count = PyLong_AsSsize_t(res);
+    Py_DECREF(res);
+    if (count == -1 && PyErr_Occurred())
+        return -1;
+    if (count < 0 || count > n) {
+        PyErr_Format(PyExc_ValueError,
+                     "file.readinto returned an invalid count %zd", count);
+        return -1;
+    }
+    return count;
+}
+
+/* Refill the read window so at least `n` unread bytes are available,
+ * growing the window if needed. Returns -1 on failure, 0 on success. */
+static int
+_Decoder_Refill(DecoderObject *self, Py_ssize_t n)
+{
+    Py_ssize_t count, available = self->input_len - self->next_read_idx;
+
+    /* Move any unread data to the front of the window */
+    if (self->next_read_idx > 0) {
+        memmove(self->read_buffer, self->read_buffer + self->next_read_idx,
+                available);
+        self->next_read_idx = 0;
+        self->input_len = available;
+    }
+    if (n > self->read_buffer_allocated) {
+        char *read_buffer = self->read_buffer;
+        PyMem_Resize(read_buffer, char, n);
+        if (read_buffer == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->read_buffer = self->input_buffer = read_buffer;
+        self->read_buffer_allocated = n;
+    }
+    while (self->input_len < n) {
+        count = _Decoder_ReadFromFile(
+            self, self->read_buffer + self->input_len,
+            self->read_buffer_allocated - self->input_len
+        );
+        if (count < 0)
+            return -1;
+        if (count == 0)
+            return bad_readline();
+        self->input_len += count;
+    }
+    return 0;
+}
+
 static Py_ssize_t
 _Decoder_Read(DecoderObject *self, char **s, Py_ssize_t n)
 {
@@ -3093,19 +6345,51 @@ _Decoder_Read(DecoderObject *self, char **s, Py_ssize_t n)
         self->next_read_idx += n;
         return n;
     }
+    if (self->readinto != NULL) {
+        if (_Decoder_Refill(self, n) < 0)
+            return -1;
+        *s = self->input_buffer + self->next_read_idx;
+        self->next_read_idx += n;
+        return n;
+    }
     return bad_readline();
 }
 
 static Py_ssize_t
 _Decoder_ReadInto(DecoderObject *self, char *buf, Py_ssize_t n)
 {
-    Py_ssize_t in_buffer = self->input_len - self->next_read_idx;
-    if (in_buffer > n) {
+    Py_ssize_t count, in_buffer = self->input_len - self->next_read_idx;
+    if (in_buffer >= n) {
         memcpy(buf, self->input_buffer + self->next_read_idx, n);
         self->next_read_idx += n;
         return 0;
     }
-    return bad_readline();
+    if (self->readinto == NULL)
+        return bad_readline();
+
+    /* Copy out what's buffered, then read the remainder. Small reads go
+     * through the window, large ones are read directly into `buf`. */
+    memcpy(buf, self->input_buffer + self->next_read_idx, in_buffer);
+    self->next_read_idx += in_buffer;
+    buf += in_buffer;
+    n -= in_buffer;
+    if (n < self->read_buffer_allocated) {
+        if (_Decoder_Refill(self, n) < 0)
+            return -1;
+        memcpy(buf, self->input_buffer + self->next_read_idx, n);
+        self->next_read_idx += n;
+        return 0;
+    }
+    while (n > 0) {
+        count = _Decoder_ReadFromFile(self, buf, n);
+        if (count < 0)
+            return -1;
+        if (count == 0)
+            return bad_readline();
+        buf += count;
+        n -= count;
+    }
+    return 0;
 }
 
 /* Retain only the initial clearto items.  If clearto >= the current
@@ -3250,9 +6534,19 @@ _Decoder_memo_resize(DecoderObject *self, size_t new_size)
     return 0;
 }
 
-/* Returns NULL if idx is out of bounds. */
-#define _Decoder_memo_get(self, idx) \
-    (((size_t)(idx) >= (self)->memo_len) ? NULL : (self)->memo[(size_t)(idx)]);
+/* Returns NULL if idx is out of bounds. Indices below the size of the
+ * dictionary refer to its objects, the memo of the message follows them. */
+static PyObject *
+_Decoder_memo_get(DecoderObject *self, size_t idx)
+{
+    if (self->dictionary != NULL) {
+        size_t size = (size_t)PyTuple_GET_SIZE(self->dictionary);
+        if (idx < size)
+            return PyTuple_GET_ITEM(self->dictionary, idx);
+        idx -= size;
+    }
+    return idx >= self->memo_len ? NULL : self->memo[idx];
+}
 
 /* Returns -1 (with an exception set) on failure, 0 on success.
    This takes its own reference to `value`. */
@@ -3278,17 +6572,22 @@ _Decoder_memo_put(DecoderObject *self, size_t idx, PyObject *value)
     return 0;
 }
 
+/* Drop all memo entries at index `size` and above */
 static void
-_Decoder_memo_clear(DecoderObject *self)
+_Decoder_memo_truncate(DecoderObject *self, size_t size)
 {
-    Py_ssize_t i;
     if (self->memo == NULL)
         return;
-    i = self->memo_len;
-    while (--i >= 0) {
-        Py_CLEAR(self->memo[i]);
+    while (self->memo_len > size) {
+        self->memo_len--;
+        Py_CLEAR(self->memo[self->memo_len]);
     }
-    self->memo_len = 0;
+}
+
+static void
+_Decoder_memo_clear(DecoderObject *self)
+{
+    _Decoder_memo_truncate(self, 0);
 }
 
 static Py_ssize_t
@@ -3428,6 +6727,65 @@ load_binint2(DecoderObject *self)
     return load_binintx(self, s, 2);
 }
 
+/* Read a LEB128 encoded unsigned integer of at most 64 bits. Returns -1 on
+ * failure, 0 on success. */
+static int
+_Decoder_ReadVarint(DecoderObject *self, uint64_t *out)
+{
+    uint64_t x = 0;
+    int shift;
+    char *s;
+
+    for (shift = 0; ; shift += 7) {
+        if (_Decoder_Read(self, &s, 1) < 0)
+            return -1;
+        if (shift == 63 && (unsigned char)s[0] > 1) {
+            QuickleState *st = quickle_get_global_state();
+            PyErr_SetString(st->DecodingError, "VARINT exceeds 64 bits");
+            return -1;
+        }
+        x |= (uint64_t)(s[0] & 0x7f) << shift;
+        if (!(s[0] & 0x80))
+            break;
+    }
+    *out = x;
+    return 0;
+}
+
+static int
+load_varint(DecoderObject *self)
+{
+    PyObject *value;
+    uint64_t z;
+
+    if (_Decoder_ReadVarint(self, &z) < 0)
+        return -1;
+    value = PyLong_FromLongLong((long long)((z >> 1) ^ -(z & 1)));
+    if (value == NULL)
+        return -1;
+    STACK_PUSH(self, value);
+    return 0;
+}
+
+static int
+load_int64(DecoderObject *self)
+{
+    PyObject *value;
+    unsigned char *p;
+    uint64_t x = 0;
+    int i;
+
+    if (_Decoder_Read(self, (char **)&p, 8) < 0)
+        return -1;
+    for (i = 7; i >= 0; i--)
+        x = (x << 8) | p[i];
+    value = PyLong_FromLongLong((long long)x);
+    if (value == NULL)
+        return -1;
+    STACK_PUSH(self, value);
+    return 0;
+}
+
 /* 'size' bytes contain the # of bytes of little-endian 256's-complement
  * data following.
  */
@@ -3457,8 +6815,19 @@ load_counted_long(DecoderObject *self, int size)
         /* Read the raw little-endian bytes and convert. */
         if (_Decoder_Read(self, &pdata, size) < 0)
             return -1;
-        value = _PyLong_FromByteArray((unsigned char *)pdata, (size_t)size,
-                                      1 /* little endian */ , 1 /* signed */ );
+        if (size <= 8) {
+            /* Fits in 64 bits, skip the arbitrary precision path */
+            unsigned char *p = (unsigned char *)pdata;
+            uint64_t x = (p[size - 1] & 0x80) ? ~(uint64_t)0 : 0;
+            int i;
+            for (i = size - 1; i >= 0; i--)
+                x = (x << 8) | p[i];
+            value = PyLong_FromLongLong((long long)x);
+        }
+        else {
+            value = _PyLong_FromByteArray((unsigned char *)pdata, (size_t)size,
+                                          1 /* little endian */ , 1 /* signed */ );
+        }
     }
     if (value == NULL)
         return -1;
@@ -3794,6 +7163,95 @@ load_readonly_buffer(DecoderObject *self)
     return 0;
 }
 
+/* Returns 1 if all `size` bytes at `s` are ASCII, 0 otherwise. Checks 32
+ * bytes at a time with SSE2 where available, then 8 bytes at a time. */
+static int
+_is_ascii(const char *s, Py_ssize_t size)
+{
+    const char *end = s + size;
+#if defined(__SSE2__)
+    while (end - s >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0)
+            return 0;
+        s += 32;
+    }
+#endif
+    while (end - s >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, s, 8);
+        if (chunk & 0x8080808080808080ULL)
+            return 0;
+        s += 8;
+    }
+    while (s < end) {
+        if (*s & 0x80)
+            return 0;
+        s++;
+    }
+    return 1;
+}
+
+/* Decode a utf-8 encoded str. ASCII data (by far the common case) is copied
+ * directly into a new compact ASCII str, other data goes through the
+ * generic decoder. Returns a new reference. */
+static PyObject *
+_decode_utf8(const char *s, Py_ssize_t size)
+{
+    PyObject *str;
+
+    /* Empty and single character strings are shared singletons in CPython,
+     * leave those to the generic decoder */
+    if (size > 1 && _is_ascii(s, size)) {
+        str = PyUnicode_New(size, 127);
+        if (str == NULL)
+            return NULL;
+        memcpy(PyUnicode_DATA(str), s, size);
+        return str;
+    }
+    return PyUnicode_DecodeUTF8(s, size, "surrogatepass");
+}
+
+/* Decode a short string through the string cache. Cached strings are
+ * looked up by a hash of their raw bytes. On a miss the string is decoded,
+ * and if ASCII, hashed and stored, replacing any existing entry. Returns a
+ * new reference. */
+static PyObject *
+_Decoder_CachedString(DecoderObject *self, const char *s, Py_ssize_t size)
+{
+    Py_ssize_t i;
+    uint64_t hash = 14695981039346656037ULL;  /* FNV-1a */
+    PyObject *str, **slot;
+
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    slot = &self->string_cache[(size_t)hash & self->string_cache_mask];
+
+    str = *slot;
+    if (str != NULL &&
+        PyUnicode_GET_LENGTH(str) == size &&
+        memcmp(PyUnicode_DATA(str), s, size) == 0) {
+        Py_INCREF(str);
+        return str;
+    }
+
+    str = _decode_utf8(s, size);
+    if (str == NULL)
+        return NULL;
+    if (PyUnicode_IS_ASCII(str)) {
+        /* Compute and cache the hash up front */
+        if (PyObject_Hash(str) == -1) {
+            Py_DECREF(str);
+            return NULL;
+        }
+        Py_INCREF(str);
+        Py_XSETREF(*slot, str);
+    }
+    return str;
+}
+
 static int
 load_counted_binunicode(DecoderObject *self, int nbytes)
 {
@@ -3815,7 +7273,10 @@ load_counted_binunicode(DecoderObject *self, int nbytes)
     if (_Decoder_Read(self, &s, size) < 0)
         return -1;
 
-    str = PyUnicode_DecodeUTF8(s, size, "surrogatepass");
+    if (self->string_cache != NULL && size <= STRING_CACHE_MAX_SIZE)
+        str = _Decoder_CachedString(self, s, size);
+    else
+        str = _decode_utf8(s, size);
     if (str == NULL)
         return -1;
 
@@ -3823,6 +7284,466 @@ load_counted_binunicode(DecoderObject *self, int nbytes)
     return 0;
 }
 
+/* Read the count header of a PACKED_* op, and the packed data of `count`
+ * elements of `width` bytes each. Returns -1 on failure, 0 on success. */
+static int
+_load_packed_data(DecoderObject *self, Py_ssize_t width,
+                  Py_ssize_t *count, char **data)
+{
+    char *s;
+    Py_ssize_t n;
+
+    if (_Decoder_Read(self, &s, 8) < 0)
+        return -1;
+    n = calc_binsize(s, 8);
+    if (n < 0 || n > PY_SSIZE_T_MAX / width) {
+        PyErr_Format(PyExc_OverflowError,
+                     "packed list exceeds system's maximum size of %zd bytes",
+                     PY_SSIZE_T_MAX);
+        return -1;
+    }
+    if (_Decoder_Read(self, data, n * width) < 0)
+        return -1;
+    *count = n;
+    return 0;
+}
+
+static int
+load_packed_ints(DecoderObject *self)
+{
+    PyObject *list, *item;
+    Py_ssize_t i, n, width;
+    unsigned char *p;
+    char *s;
+    long long x;
+
+    if (_Decoder_Read(self, &s, 1) < 0)
+        return -1;
+    width = (unsigned char)s[0];
+    if (width != 1 && width != 2 && width != 4 && width != 8) {
+        QuickleState *st = quickle_get_global_state();
+        PyErr_Format(st->DecodingError, "invalid packed int width %zd", width);
+        return -1;
+    }
+    if (_load_packed_data(self, width, &n, &s) < 0)
+        return -1;
+
+    list = PyList_New(n);
+    if (list == NULL)
+        return -1;
+    p = (unsigned char *)s;
+    for (i = 0; i < n; i++, p += width) {
+        switch (width) {
+            case 1:
+                x = (signed char)p[0];
+                break;
+            case 2:
+                x = (int16_t)(p[0] | (p[1] << 8));
+                break;
+            case 4:
+                x = (int32_t)(
+                    (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24)
+                );
+                break;
+            default:
+                x = (int64_t)(
+                    (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+                    ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+                    ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+                    ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56)
+                );
+        }
+        item = PyLong_FromLongLong(x);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return -1;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    STACK_PUSH(self, list);
+    return 0;
+}
+
+static int
+load_packed_floats(DecoderObject *self)
+{
+    PyObject *list, *item;
+    Py_ssize_t i, n;
+    char *s;
+    double x;
+
+    if (_load_packed_data(self, 8, &n, &s) < 0)
+        return -1;
+
+    list = PyList_New(n);
+    if (list == NULL)
+        return -1;
+    for (i = 0; i < n; i++, s += 8) {
+        x = _PyFloat_Unpack8((unsigned char *)s, 1);
+        if (x == -1.0 && PyErr_Occurred()) {
+            Py_DECREF(list);
+            return -1;
+        }
+        item = PyFloat_FromDouble(x);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return -1;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    STACK_PUSH(self, list);
+    return 0;
+}
+
+static int
+load_packed_bools(DecoderObject *self)
+{
+    PyObject *list, *item;
+    Py_ssize_t i, n;
+    char *s;
+
+    if (_load_packed_data(self, 1, &n, &s) < 0)
+        return -1;
+
+    list = PyList_New(n);
+    if (list == NULL)
+        return -1;
+    for (i = 0; i < n; i++) {
+        item = s[i] ? Py_True : Py_False;
+        Py_INCREF(item);
+        PyList_SET_ITEM(list, i, item);
+    }
+    STACK_PUSH(self, list);
+    return 0;
+}
+
+/* Build an `array.array` of `typecode` from `size` bytes of raw item data,
+ * validating the itemsize recorded by the encoder. Returns a new reference. */
+static PyObject *
+_Decoder_MakeArray(char typecode, unsigned char itemsize, char *data,
+                   Py_ssize_t size)
+{
+    PyObject *typecode_str, *array, *view, *res;
+    QuickleState *st = quickle_get_global_state();
+    int swap = ((itemsize & ARRAY_BIG_ENDIAN) != 0) != PY_BIG_ENDIAN;
+    Py_ssize_t expected = array_typecode_itemsize(typecode);
+
+    itemsize &= ~ARRAY_BIG_ENDIAN;
+    if (expected == 0) {
+        PyErr_Format(st->DecodingError, "invalid array typecode '%c'",
+                     (unsigned char)typecode);
+        return NULL;
+    }
+    if (expected != itemsize) {
+        PyErr_Format(st->DecodingError,
+                     "array typecode '%c' has itemsize %zd on this platform, "
+                     "message has itemsize %d",
+                     typecode, expected, (int)itemsize);
+        return NULL;
+    }
+    if (size % itemsize != 0) {
+        PyErr_Format(st->DecodingError,
+                     "array data size %zd isn't a multiple of itemsize %d",
+                     size, (int)itemsize);
+        return NULL;
+    }
+
+    typecode_str = PyUnicode_FromOrdinal((unsigned char)typecode);
+    if (typecode_str == NULL)
+        return NULL;
+    array = CALL_ONE_ARG((PyObject *)(st->ArrayType), typecode_str);
+    Py_DECREF(typecode_str);
+    if (array == NULL)
+        return NULL;
+
+    /* A single bulk copy into the array */
+    view = PyMemoryView_FromMemory(data, size, PyBUF_READ);
+    if (view == NULL)
+        goto error;
+    res = PyObject_CallMethodObjArgs(array, st->frombytes_str, view, NULL);
+    Py_DECREF(view);
+    if (res == NULL)
+        goto error;
+    Py_DECREF(res);
+    if (swap && itemsize > 1) {
+        res = PyObject_CallMethodObjArgs(array, st->byteswap_str, NULL);
+        if (res == NULL)
+            goto error;
+        Py_DECREF(res);
+    }
+    return array;
+
+error:
+    Py_DECREF(array);
+    return NULL;
+}
+
+static int
+load_array(DecoderObject *self)
+{
+    PyObject *array;
+    Py_ssize_t size;
+    char *s, *data;
+    char typecode;
+    unsigned char itemsize;
+
+    if (_Decoder_Read(self, &s, 10) < 0)
+        return -1;
+    typecode = s[0];
+    itemsize = (unsigned char)s[1];
+    size = calc_binsize(s + 2, 8);
+    if (size < 0) {
+        PyErr_Format(PyExc_OverflowError,
+                     "ARRAY exceeds system's maximum size of %zd bytes",
+                     PY_SSIZE_T_MAX);
+        return -1;
+    }
+    if (_Decoder_Read(self, &data, size) < 0)
+        return -1;
+
+    array = _Decoder_MakeArray(typecode, itemsize, data, size);
+    if (array == NULL)
+        return -1;
+    STACK_PUSH(self, array);
+    return 0;
+}
+
+static int
+load_array_buffer(DecoderObject *self)
+{
+    PyObject *buffer, *array;
+    Py_buffer view;
+    char *s;
+
+    if (_Decoder_Read(self, &s, 2) < 0)
+        return -1;
+    if (self->stack_len <= self->fence)
+        return _Decoder_stack_underflow(self);
+
+    buffer = self->stack[self->stack_len - 1];
+    if (PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE) < 0)
+        return -1;
+    array = _Decoder_MakeArray(s[0], (unsigned char)s[1], view.buf, view.len);
+    PyBuffer_Release(&view);
+    if (array == NULL)
+        return -1;
+    self->stack[self->stack_len - 1] = array;
+    Py_DECREF(buffer);
+    return 0;
+}
+
+/* Read the header of a MEMORYVIEW op, storing the flags and format, and
+ * returning the shape as a tuple. The expected size of the data in bytes is
+ * stored in `nbytes`. Returns a new reference. */
+static PyObject *
+_Decoder_ReadViewHeader(DecoderObject *self, int *flags, char *format,
+                        Py_ssize_t *nbytes)
+{
+    PyObject *shape, *item;
+    Py_ssize_t i, ndim, itemsize, dim, total;
+    QuickleState *st = quickle_get_global_state();
+    char *s;
+
+    if (_Decoder_Read(self, &s, 4) < 0)
+        return NULL;
+    *flags = (unsigned char)s[0];
+    *format = s[1];
+    itemsize = (unsigned char)s[2];
+    ndim = (unsigned char)s[3];
+
+    if (buffer_format_itemsize(*format) == 0) {
+        PyErr_Format(st->DecodingError, "invalid memoryview format '%c'",
+                     (unsigned char)*format);
+        return NULL;
+    }
+    if (buffer_format_itemsize(*format) != itemsize) {
+        PyErr_Format(st->DecodingError,
+                     "memoryview format '%c' has itemsize %zd on this "
+                     "platform, message has itemsize %zd",
+                     *format, buffer_format_itemsize(*format), itemsize);
+        return NULL;
+    }
+    if (((*flags & MEMORYVIEW_BIG_ENDIAN) != 0) != PY_BIG_ENDIAN &&
+        itemsize > 1) {
+        PyErr_SetString(st->DecodingError,
+                        "memoryview was serialized on a machine with a "
+                        "different byte order");
+        return NULL;
+    }
+    if (ndim > PyBUF_MAX_NDIM) {
+        PyErr_Format(st->DecodingError,
+                     "memoryview has too many dimensions (%zd)", ndim);
+        return NULL;
+    }
+
+    if (_Decoder_Read(self, &s, 8 * ndim) < 0)
+        return NULL;
+    shape = PyTuple_New(ndim);
+    if (shape == NULL)
+        return NULL;
+    total = itemsize;
+    for (i = 0; i < ndim; i++, s += 8) {
+        dim = calc_binsize(s, 8);
+        if (dim < 0 || (dim > 0 && total > PY_SSIZE_T_MAX / dim) ||
+            (dim == 0 && ndim != 1)) {
+            Py_DECREF(shape);
+            PyErr_SetString(st->DecodingError, "invalid memoryview shape");
+            return NULL;
+        }
+        total *= dim;
+        item = PyLong_FromSsize_t(dim);
+        if (item == NULL) {
+            Py_DECREF(shape);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(shape, i, item);
+    }
+    *nbytes = total;
+    return shape;
+}
+
+/* Cast `view`, a 1-dimensional view of bytes, to the given format and shape,
+ * making it read-only if the READONLY flag is set. Steals a reference to
+ * `view`, returns a new reference. */
+static PyObject *
+_Decoder_CastView(PyObject *view, int flags, char format, PyObject *shape)
+{
+    PyObject *format_str, *res, *readonly;
+    QuickleState *st = quickle_get_global_state();
+
+    format_str = PyUnicode_FromOrdinal((unsigned char)format);
+    if (format_str == NULL) {
+        Py_DECREF(view);
+        return NULL;
+    }
+    if (PyTuple_GET_SIZE(shape) == 1) {
+        /* Casting a 1-dimensional view with a shape fails for empty views */
+        res = PyObject_CallMethodObjArgs(view, st->cast_str, format_str, NULL);
+    }
+    else {
+        res = PyObject_CallMethodObjArgs(view, st->cast_str, format_str,
+                                         shape, NULL);
+    }
+    Py_DECREF(format_str);
+    Py_DECREF(view);
+    if (res != NULL && (flags & MEMORYVIEW_READONLY) &&
+            !PyMemoryView_GET_BUFFER(res)->readonly) {
+        readonly = PyObject_CallMethodObjArgs(res, st->toreadonly_str, NULL);
+        Py_DECREF(res);
+        res = readonly;
+    }
+    return res;
+}
+
+static int
+load_memoryview(DecoderObject *self)
+{
+    PyObject *shape, *base, *view;
+    Py_ssize_t size, nbytes, offset;
+    char *s, *data;
+    char format;
+    int flags;
+
+    shape = _Decoder_ReadViewHeader(self, &flags, &format, &nbytes);
+    if (shape == NULL)
+        return -1;
+    if (_Decoder_Read(self, &s, 8) < 0)
+        goto error;
+    size = calc_binsize(s, 8);
+    if (size != nbytes) {
+        QuickleState *st = quickle_get_global_state();
+        PyErr_SetString(st->DecodingError,
+                        "memoryview size doesn't match its shape");
+        goto error;
+    }
+    if (_Decoder_Read(self, &data, size) < 0)
+        goto error;
+
+    if ((flags & MEMORYVIEW_READONLY) && self->readinto == NULL &&
+            self->buffer.obj != NULL && PyBytes_CheckExact(self->buffer.obj) &&
+            self->input_buffer == self->buffer.buf) {
+        /* Read-only view into an immutable input, share its memory */
+        offset = data - self->input_buffer;
+        base = PyMemoryView_FromObject(self->buffer.obj);
+        if (base == NULL)
+            goto error;
+        view = PySequence_GetSlice(base, offset, offset + size);
+        Py_DECREF(base);
+    }
+    else {
+        if (flags & MEMORYVIEW_READONLY)
+            base = PyBytes_FromStringAndSize(data, size);
+        else
+            base = PyByteArray_FromStringAndSize(data, size);
+        if (base == NULL)
+            goto error;
+        view = PyMemoryView_FromObject(base);
+        Py_DECREF(base);
+    }
+    if (view == NULL)
+        goto error;
+
+    view = _Decoder_CastView(view, flags, format, shape);
+    Py_DECREF(shape);
+    if (view == NULL)
+        return -1;
+    STACK_PUSH(self, view);
+    return 0;
+
+error:
+    Py_DECREF(shape);
+    return -1;
+}
+
+static int
+load_memoryview_buffer(DecoderObject *self)
+{
+    PyObject *shape, *buffer, *view, *res;
+    QuickleState *st = quickle_get_global_state();
+    Py_ssize_t nbytes;
+    char format;
+    int flags;
+
+    shape = _Decoder_ReadViewHeader(self, &flags, &format, &nbytes);
+    if (shape == NULL)
+        return -1;
+    if (self->stack_len <= self->fence) {
+        Py_DECREF(shape);
+        return _Decoder_stack_underflow(self);
+    }
+    buffer = self->stack[self->stack_len - 1];
+
+    /* Flatten the buffer to a 1-dimensional view of bytes, sharing memory */
+    view = PyMemoryView_FromObject(buffer);
+    if (view == NULL)
+        goto error;
+    if (PyMemoryView_GET_BUFFER(view)->len != nbytes) {
+        Py_DECREF(view);
+        PyErr_SetString(st->DecodingError,
+                        "out-of-band buffer size doesn't match memoryview "
+                        "shape");
+        goto error;
+    }
+    res = PyObject_CallMethodObjArgs(view, st->cast_str,
+                                     st->byte_format_str, NULL);
+    Py_DECREF(view);
+    if (res == NULL)
+        goto error;
+
+    view = _Decoder_CastView(res, flags, format, shape);
+    Py_DECREF(shape);
+    if (view == NULL)
+        return -1;
+    self->stack[self->stack_len - 1] = view;
+    Py_DECREF(buffer);
+    return 0;
+
+error:
+    Py_DECREF(shape);
+    return -1;
+}
+
 static int
 load_counted_tuple(DecoderObject *self, Py_ssize_t len)
 {
@@ -4010,7 +7931,80 @@ load_memoize(DecoderObject *self)
     PyErr_Format(quickle_get_global_state()->DecodingError, (fmt), __VA_ARGS__)
 
 static int
-do_append(DecoderObject *self, Py_ssize_t x)
+load_native_unicode(DecoderObject *self)
+{
+    PyObject *str;
+    Py_ssize_t i, len;
+    uint64_t x;
+    Py_UCS2 c, bits = 0;
+    int kind;
+    char *s;
+
+    if (_Decoder_Read(self, &s, 1) < 0)
+        return -1;
+    kind = (unsigned char)s[0] & ~NATIVE_UNICODE_BIG_ENDIAN;
+    if (kind != PyUnicode_1BYTE_KIND && kind != PyUnicode_2BYTE_KIND) {
+        raise_decoding_error("Invalid NATIVE_UNICODE kind %d", kind);
+        return -1;
+    }
+    if (kind == PyUnicode_2BYTE_KIND &&
+            (((unsigned char)s[0] & NATIVE_UNICODE_BIG_ENDIAN) != 0) != PY_BIG_ENDIAN) {
+        PyErr_SetString(quickle_get_global_state()->DecodingError,
+                        "str was serialized on a machine with a different "
+                        "byte order");
+        return -1;
+    }
+    if (_Decoder_ReadVarint(self, &x) < 0)
+        return -1;
+    if (x > (uint64_t)(PY_SSIZE_T_MAX / kind)) {
+        raise_decoding_error("Invalid NATIVE_UNICODE length %llu",
+                             (unsigned long long)x);
+        return -1;
+    }
+    len = (Py_ssize_t)x;
+    if (_Decoder_Read(self, &s, len * kind) < 0)
+        return -1;
+
+    if (kind == PyUnicode_1BYTE_KIND) {
+        str = PyUnicode_New(len, _is_ascii(s, len) ? 127 : 255);
+        if (str == NULL)
+            return -1;
+        memcpy(PyUnicode_DATA(str), s, len);
+    }
+    else {
+        /* Strings must use the narrowest kind that fits their characters.
+         * The data may be unaligned, so code units are read with memcpy. */
+        for (i = 0; i < len; i++) {
+            memcpy(&c, s + 2 * i, 2);
+            bits |= c;
+        }
+        if (bits > 0xff) {
+            str = PyUnicode_New(len, 0xffff);
+            if (str == NULL)
+                return -1;
+            memcpy(PyUnicode_DATA(str), s, len * 2);
+        }
+        else {
+            Py_UCS1 *out;
+            str = PyUnicode_New(len, bits > 0x7f ? 0xff : 0x7f);
+            if (str == NULL)
+                return -1;
+            out = PyUnicode_1BYTE_DATA(str);
+            for (i = 0; i < len; i++) {
+                memcpy(&c, s + 2 * i, 2);
+                out[i] = (Py_UCS1)c;
+            }
+        }
+    }
+    STACK_PUSH(self, str);
+    return 0;
+}
+
+/* Append the stack items above `x` to the list below them. `counted` is set
+ * for APPENDS_N, whose items are the list's whole contents; only then may an
+ * empty list have the stack slots moved straight into its item array. */
+static int
+do_append(DecoderObject *self, Py_ssize_t x, int counted)
 {
     PyObject *slice;
     PyObject *list;
@@ -4024,7 +8018,23 @@ do_append(DecoderObject *self, Py_ssize_t x)
 
     list = self->stack[x - 1];
 
-    if (PyList_CheckExact(list)) {
+    if (counted && PyList_CheckExact(list) && PyList_GET_SIZE(list) == 0) {
+        /* Move the items from the stack into an exactly sized item array */
+        PyListObject *op = (PyListObject *)list;
+        PyObject **items = PyMem_New(PyObject *, len - x);
+        if (items == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(items, self->stack + x, (len - x) * sizeof(PyObject *));
+        PyMem_Free(op->ob_item);
+        op->ob_item = items;
+        op->allocated = len - x;
+        Py_SET_SIZE(op, len - x);
+        self->stack_len = x;
+        return 0;
+    }
+    else if (PyList_CheckExact(list)) {
         Py_ssize_t list_len;
         int ret;
 
@@ -4045,7 +8055,7 @@ load_append(DecoderObject *self)
 {
     if (self->stack_len - 1 <= self->fence)
         return _Decoder_stack_underflow(self);
-    return do_append(self, self->stack_len - 1);
+    return do_append(self, self->stack_len - 1, 0);
 }
 
 static int
@@ -4054,7 +8064,7 @@ load_appends(DecoderObject *self)
     Py_ssize_t i = marker(self);
     if (i < 0)
         return -1;
-    return do_append(self, i);
+    return do_append(self, i, 0);
 }
 
 static int
@@ -4096,6 +8106,127 @@ do_setitems(DecoderObject *self, Py_ssize_t x)
     return -1;
 }
 
+/* Read the count of a counted container op, returning the stack index of
+ * the first of `count * width` items. Returns -1 on failure. */
+static Py_ssize_t
+_Decoder_CountedStart(DecoderObject *self, Py_ssize_t width)
+{
+    uint64_t count;
+    /* Items available above the container */
+    Py_ssize_t avail = self->stack_len - self->fence - 1;
+
+    if (_Decoder_ReadVarint(self, &count) < 0)
+        return -1;
+    if (avail < 0 || count > (uint64_t)(avail / width)) {
+        _Decoder_stack_underflow(self);
+        return -1;
+    }
+    return self->stack_len - count * width;
+}
+
+static int
+load_appends_n(DecoderObject *self)
+{
+    Py_ssize_t i = _Decoder_CountedStart(self, 1);
+    if (i < 0)
+        return -1;
+    return do_append(self, i, 1);
+}
+
+static int
+load_empty_dict_n(DecoderObject *self)
+{
+    PyObject *dict;
+    Py_ssize_t limit;
+    uint64_t count;
+
+    if (_Decoder_ReadVarint(self, &count) < 0)
+        return -1;
+    /* The count is only a hint, don't let a corrupt message allocate more
+     * than the remaining input could fill */
+    if (self->readinto == NULL)
+        limit = (self->input_len - self->next_read_idx) / 2;
+    else
+        limit = 1 << 16;
+    if (count > (uint64_t)limit)
+        count = limit;
+    if ((dict = _PyDict_NewPresized((Py_ssize_t)count)) == NULL)
+        return -1;
+    STACK_PUSH(self, dict);
+    return 0;
+}
+
+static int
+load_setitems_n(DecoderObject *self)
+{
+    Py_ssize_t i = _Decoder_CountedStart(self, 2);
+    if (i < 0)
+        return -1;
+    return do_setitems(self, i);
+}
+
+static int
+load_define_shape(DecoderObject *self)
+{
+    PyObject *keys;
+    uint64_t count;
+
+    if (_Decoder_ReadVarint(self, &count) < 0)
+        return -1;
+    if (count > (uint64_t)(self->stack_len - self->fence))
+        return _Decoder_stack_underflow(self);
+    if (self->shapes == NULL) {
+        self->shapes = PyList_New(0);
+        if (self->shapes == NULL)
+            return -1;
+    }
+    keys = _Decoder_stack_poptuple(self, self->stack_len - (Py_ssize_t)count);
+    if (keys == NULL)
+        return -1;
+    if (PyList_Append(self->shapes, keys) < 0) {
+        Py_DECREF(keys);
+        return -1;
+    }
+    Py_DECREF(keys);
+    return 0;
+}
+
+static int
+load_shaped_dict(DecoderObject *self)
+{
+    PyObject *keys, *dict;
+    Py_ssize_t i, n, start;
+    uint64_t index;
+
+    if (_Decoder_ReadVarint(self, &index) < 0)
+        return -1;
+    if (self->shapes == NULL ||
+            index >= (uint64_t)PyList_GET_SIZE(self->shapes)) {
+        QuickleState *st = quickle_get_global_state();
+        PyErr_SetString(st->DecodingError, "invalid dict shape reference");
+        return -1;
+    }
+    keys = PyList_GET_ITEM(self->shapes, (Py_ssize_t)index);
+    n = PyTuple_GET_SIZE(keys);
+    if (n > self->stack_len - self->fence)
+        return _Decoder_stack_underflow(self);
+    start = self->stack_len - n;
+
+    dict = _PyDict_NewPresized(n);
+    if (dict == NULL)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (PyDict_SetItem(dict, PyTuple_GET_ITEM(keys, i),
+                           self->stack[start + i]) < 0) {
+            Py_DECREF(dict);
+            return -1;
+        }
+    }
+    _Decoder_stack_clear(self, start);
+    STACK_PUSH(self, dict);
+    return 0;
+}
+
 static int
 load_setitem(DecoderObject *self)
 {
@@ -4112,27 +8243,24 @@ load_setitems(DecoderObject *self)
 }
 
 static int
-load_additems(DecoderObject *self)
+do_additems(DecoderObject *self, Py_ssize_t x)
 {
     PyObject *set;
-    Py_ssize_t mark, len;
+    Py_ssize_t len;
 
-    mark =  marker(self);
-    if (mark < 0)
-        return -1;
     len = self->stack_len;
-    if (mark > len || mark <= self->fence)
+    if (x > len || x <= self->fence)
         return _Decoder_stack_underflow(self);
-    if (len == mark)  /* nothing to do */
+    if (len == x)  /* nothing to do */
         return 0;
 
-    set = self->stack[mark - 1];
+    set = self->stack[x - 1];
 
     if (PySet_Check(set)) {
         PyObject *items;
         int status;
 
-        items = _Decoder_stack_poptuple(self, mark);
+        items = _Decoder_stack_poptuple(self, x);
         if (items == NULL)
             return -1;
 
@@ -4141,7 +8269,25 @@ load_additems(DecoderObject *self)
         return status;
     }
     raise_decoding_error("Invalid ADDITEMS opcode on object of type %.200s", Py_TYPE(set)->tp_name);
-    return 0;
+    return -1;
+}
+
+static int
+load_additems(DecoderObject *self)
+{
+    Py_ssize_t i = marker(self);
+    if (i < 0)
+        return -1;
+    return do_additems(self, i);
+}
+
+static int
+load_additems_n(DecoderObject *self)
+{
+    Py_ssize_t i = _Decoder_CountedStart(self, 1);
+    if (i < 0)
+        return -1;
+    return do_additems(self, i);
 }
 
 static int
@@ -4219,19 +8365,18 @@ load_struct(DecoderObject *self, int nbytes)
 }
 
 
+/* Set the fields of the struct at stack index `start - 1` from the items
+ * above it on the stack */
 static int
-load_buildstruct(DecoderObject *self)
+do_buildstruct(DecoderObject *self, Py_ssize_t start)
 {
     PyObject *fields, *defaults, *field, *val, *obj;
-    Py_ssize_t start, nargs, nfields, npos, i;
-    int should_untrack;
+    Py_ssize_t nargs, nfields, npos, i;
+    int is_copy, should_untrack;
 
-    start = marker(self);
-    if (start < 0)
-        return -1;
+    /* The struct sits just below the fields, above the fence */
     if (start > self->stack_len || start <= self->fence)
         return _Decoder_stack_underflow(self);
-
     obj = self->stack[start - 1];
 
     if (!(Py_TYPE(Py_TYPE(obj)) == &StructMetaType)) {
@@ -4268,9 +8413,12 @@ load_buildstruct(DecoderObject *self)
             return -1;
         }
         else {
-            val = maybe_deepcopy_default(PyTuple_GET_ITEM(defaults, i - npos), NULL);
+            is_copy = 0;
+            val = maybe_deepcopy_default(PyTuple_GET_ITEM(defaults, i - npos), &is_copy);
             if (val == NULL)
                 return -1;
+            if (!is_copy)
+                Py_INCREF(val);
         }
         Struct_set_index(obj, i, val);
         if (should_untrack) {
@@ -4283,330 +8431,2063 @@ load_buildstruct(DecoderObject *self)
 }
 
 static int
-load_enum(DecoderObject *self, int nbytes)
+load_buildstruct(DecoderObject *self)
+{
+    Py_ssize_t start = marker(self);
+    if (start < 0)
+        return -1;
+    return do_buildstruct(self, start);
+}
+
+static int
+load_buildstruct_sparse(DecoderObject *self)
+{
+    PyObject *obj, *fields, *defaults, *val;
+    Py_ssize_t n, nbitmap, npresent = 0, nfields, npos, start, i, k;
+    uint64_t count;
+    unsigned char *bitmap;
+    char *s;
+    int is_copy, present, should_untrack;
+
+    if (_Decoder_ReadVarint(self, &count) < 0)
+        return -1;
+    if (count > (uint64_t)(PY_SSIZE_T_MAX / 2)) {
+        raise_decoding_error("Invalid BUILDSTRUCT_SPARSE field count %llu",
+                             (unsigned long long)count);
+        return -1;
+    }
+    n = (Py_ssize_t)count;
+    nbitmap = (n + 7) / 8;
+    if (_Decoder_Read(self, &s, nbitmap) < 0)
+        return -1;
+    bitmap = (unsigned char *)s;
+    for (i = 0; i < n; i++) {
+        npresent += (bitmap[i / 8] >> (i % 8)) & 1;
+    }
+    if (npresent > self->stack_len - self->fence - 1)
+        return _Decoder_stack_underflow(self);
+    start = self->stack_len - npresent;
+
+    obj = self->stack[start - 1];
+    if (!(Py_TYPE(Py_TYPE(obj)) == &StructMetaType)) {
+        raise_decoding_error("Invalid BUILDSTRUCT_SPARSE opcode on object of type %.200s",
+                             Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    fields = StructMeta_GET_FIELDS(Py_TYPE(obj));
+    defaults = StructMeta_GET_DEFAULTS(Py_TYPE(obj));
+    nfields = PyTuple_GET_SIZE(fields);
+    npos = nfields - PyTuple_GET_SIZE(defaults);
+
+    should_untrack = PyObject_IS_GC(obj);
+    /* Present fields past the end of the type are dropped with the rest of
+     * the stack below */
+    for (i = 0, k = start; i < nfields; i++) {
+        present = i < n && ((bitmap[i / 8] >> (i % 8)) & 1);
+        if (present) {
+            val = self->stack[k++];
+            Py_INCREF(val);
+        }
+        else if (i < npos) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "Missing required argument '%U'",
+                PyTuple_GET_ITEM(fields, i)
+            );
+            return -1;
+        }
+        else {
+            is_copy = 0;
+            val = maybe_deepcopy_default(PyTuple_GET_ITEM(defaults, i - npos), &is_copy);
+            if (val == NULL)
+                return -1;
+            if (!is_copy)
+                Py_INCREF(val);
+        }
+        Struct_set_index(obj, i, val);
+        if (should_untrack) {
+            should_untrack = !OBJ_IS_GC(val);
+        }
+    }
+    if (should_untrack)
+        PyObject_GC_UnTrack(obj);
+    _Decoder_stack_clear(self, start);
+    return 0;
+}
+
+static int
+load_buildstruct_n(DecoderObject *self)
+{
+    Py_ssize_t start = _Decoder_CountedStart(self, 1);
+    if (start < 0)
+        return -1;
+    return do_buildstruct(self, start);
+}
+
+/* Check that the top `ncols` items on the stack are lists of equal length,
+ * returning the stack index of the first column. If `n` is non-negative the
+ * columns must have exactly `n` items, otherwise their length is stored in
+ * `n`. Returns -1 on failure. */
+static Py_ssize_t
+_Decoder_ColumnsStart(DecoderObject *self, uint64_t ncols, Py_ssize_t *n,
+                      const char *opname)
+{
+    Py_ssize_t start, i;
+    PyObject *column;
+    /* Items available above the container */
+    Py_ssize_t avail = self->stack_len - self->fence - 1;
+
+    if (avail < 0 || ncols > (uint64_t)avail) {
+        _Decoder_stack_underflow(self);
+        return -1;
+    }
+    start = self->stack_len - (Py_ssize_t)ncols;
+    for (i = start; i < self->stack_len; i++) {
+        column = self->stack[i];
+        if (!PyList_CheckExact(column) ||
+                (*n >= 0 && PyList_GET_SIZE(column) != *n)) {
+            raise_decoding_error("Invalid %s opcode on column of type %.200s, "
+                                 "columns must be lists of equal length",
+                                 opname, Py_TYPE(column)->tp_name);
+            return -1;
+        }
+        *n = PyList_GET_SIZE(column);
+    }
+    return start;
+}
+
+static PyObject *
+load_struct_type(DecoderObject *self, int nbytes)
 {
     Py_ssize_t code;
-    QuickleState *st;
-    PyObject *val = NULL, *obj = NULL, *typ, *member_table;
+    PyObject *typ;
 
     typ = load_from_registry(self, nbytes, &code);
     if (typ == NULL)
-        return -1;
-    st = quickle_get_global_state();
-    if (!(PyType_Check(typ) && PyType_IsSubtype((PyTypeObject *)typ, st->EnumType))) {
+        return NULL;
+    if (!PyType_Check(typ) || Py_TYPE(typ) != &StructMetaType) {
         PyErr_Format(PyExc_TypeError,
-                     "Value for typecode %zd isn't an Enum type",
+                     "Value for typecode %zd isn't a Struct type",
                      code);
+        return NULL;
+    }
+    return typ;
+}
+
+static int
+load_struct_columns(DecoderObject *self, int nbytes)
+{
+    PyObject *typ, *list, *items, *obj;
+    Py_ssize_t start, ncols, n = -1, i;
+    uint64_t count;
+    int status = -1;
+
+    if ((typ = load_struct_type(self, nbytes)) == NULL)
+        return -1;
+    if (_Decoder_ReadVarint(self, &count) < 0)
+        return -1;
+    if (count == 0)
+        return _Decoder_stack_underflow(self);
+    start = _Decoder_ColumnsStart(self, count, &n, "STRUCT_COLUMNS");
+    if (start < 0)
+        return -1;
+    ncols = (Py_ssize_t)count;
+    list = self->stack[start - 1];
+
+    if (!PyList_CheckExact(list)) {
+        raise_decoding_error("Invalid STRUCT_COLUMNS opcode on object of type %.200s",
+                             Py_TYPE(list)->tp_name);
         return -1;
     }
 
-    STACK_POP(self, val);
-    if (val == NULL)
+    if ((items = PyList_New(n)) == NULL)
+        return -1;
+    for (i = 0; i < n; i++) {
+        obj = Struct_from_columns((PyTypeObject *)typ, self->stack + start, ncols, i);
+        if (obj == NULL)
+            goto done;
+        PyList_SET_ITEM(items, i, obj);
+    }
+    status = PyList_SetSlice(list, PyList_GET_SIZE(list), PyList_GET_SIZE(list), items);
+
+done:
+    Py_DECREF(items);
+    _Decoder_stack_clear(self, start);
+    return status;
+}
+
+static int
+load_empty_struct_array(DecoderObject *self, int nbytes)
+{
+    PyObject *typ, *obj;
+
+    if ((typ = load_struct_type(self, nbytes)) == NULL)
+        return -1;
+    if ((obj = StructArray_New((PyTypeObject *)typ)) == NULL)
         return -1;
+    STACK_PUSH(self, obj);
+    return 0;
+}
 
-    /* IntEnums are serialized by value, all other enums are serialized by name */
-    if (PyLong_CheckExact(val)) {
-        /* Fast path for common case. This accesses a non-public member of the
-         * enum class to speedup lookups. If this fails, we clear errors and
-         * use the slower-but-more-public method instead. */
-        member_table = PyObject_GetAttr(typ, st->value2member_map_str);
-        if (member_table != NULL) {
-            obj = PyDict_GetItem(member_table, val);
-            Py_DECREF(member_table);
-            Py_XINCREF(obj);
+static int
+load_struct_array_extend(DecoderObject *self)
+{
+    StructArrayObject *arr;
+    PyObject *fields, *defaults, *column, *val;
+    Py_ssize_t start, n, ncols, nfields, npos, i, j;
+    uint64_t count;
+    int status = -1;
+
+    if (_Decoder_ReadVarint(self, &count) < 0)
+        return -1;
+    if (count > PY_SSIZE_T_MAX) {
+        raise_decoding_error("Invalid STRUCT_ARRAY_EXTEND length %llu",
+                             (unsigned long long)count);
+        return -1;
+    }
+    n = (Py_ssize_t)count;
+    if (_Decoder_ReadVarint(self, &count) < 0)
+        return -1;
+    start = _Decoder_ColumnsStart(self, count, &n, "STRUCT_ARRAY_EXTEND");
+    if (start < 0)
+        return -1;
+    ncols = (Py_ssize_t)count;
+    arr = (StructArrayObject *)self->stack[start - 1];
+    if (!StructArray_Check(arr)) {
+        raise_decoding_error("Invalid STRUCT_ARRAY_EXTEND opcode on object of type %.200s",
+                             Py_TYPE(arr)->tp_name);
+        return -1;
+    }
+
+    fields = StructMeta_GET_FIELDS(arr->type);
+    defaults = StructMeta_GET_DEFAULTS(arr->type);
+    nfields = PyTuple_GET_SIZE(fields);
+    npos = nfields - PyTuple_GET_SIZE(defaults);
+    if (ncols < npos && n > 0) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "Missing required argument '%U'",
+            PyTuple_GET_ITEM(fields, ncols)
+        );
+        goto done;
+    }
+    /* Without any columns nothing in the input backs the length, so don't
+     * build default columns from it. */
+    if (ncols == 0 && n > 0 && nfields > 0) {
+        raise_decoding_error("Invalid STRUCT_ARRAY_EXTEND length %zd without columns", n);
+        goto done;
+    }
+    if (n > PY_SSIZE_T_MAX - arr->len) {
+        raise_decoding_error("Invalid STRUCT_ARRAY_EXTEND length %zd", n);
+        goto done;
+    }
+
+    /* Build any missing columns from the field defaults. Extra trailing
+     * columns are dropped. */
+    for (j = ncols; j < nfields; j++) {
+        column = PyList_New(n);
+        if (column == NULL)
+            goto done;
+        if (_Decoder_stack_push(self, column) < 0) {
+            Py_DECREF(column);
+            goto done;
+        }
+        for (i = 0; i < n; i++) {
+            int is_copy = 0;
+            val = maybe_deepcopy_default(PyTuple_GET_ITEM(defaults, j - npos), &is_copy);
+            if (val == NULL)
+                goto done;
+            if (!is_copy)
+                Py_INCREF(val);
+            PyList_SET_ITEM(column, i, val);
+        }
+    }
+
+    for (j = 0; j < nfields; j++) {
+        PyObject *new = self->stack[start + j];
+        column = PyTuple_GET_ITEM(arr->columns, j);
+        if (arr->len == 0 && Py_REFCNT(new) == 1) {
+            /* Nothing else references the decoded column, use it directly */
+            Py_INCREF(new);
+            PyTuple_SET_ITEM(arr->columns, j, new);
+            Py_DECREF(column);
+        }
+        else if (PyList_SetSlice(column, arr->len, arr->len, new) < 0) {
+            /* Roll back any columns already extended */
+            while (--j >= 0) {
+                column = PyTuple_GET_ITEM(arr->columns, j);
+                PyList_SetSlice(column, arr->len, PyList_GET_SIZE(column), NULL);
+            }
+            goto done;
+        }
+    }
+    arr->len += n;
+    status = 0;
+
+done:
+    _Decoder_stack_clear(self, start);
+    return status;
+}
+
+/* Read a single tagless field value of the given FIELD_* kind */
+static PyObject *
+_Decoder_ReadTypedField(DecoderObject *self, char kind)
+{
+    uint64_t x;
+    double d;
+    char *s;
+
+    switch (kind) {
+        case FIELD_INT:
+            if (_Decoder_ReadVarint(self, &x) < 0)
+                return NULL;
+            return PyLong_FromLongLong((long long)(x >> 1) ^ -(long long)(x & 1));
+        case FIELD_FLOAT:
+            if (_Decoder_Read(self, &s, 8) < 0)
+                return NULL;
+            d = _PyFloat_Unpack8((unsigned char *)s, 1);
+            if (d == -1.0 && PyErr_Occurred())
+                return NULL;
+            return PyFloat_FromDouble(d);
+        case FIELD_BOOL:
+            if (_Decoder_Read(self, &s, 1) < 0)
+                return NULL;
+            return PyBool_FromLong(*s);
+        default:
+            if (_Decoder_ReadVarint(self, &x) < 0)
+                return NULL;
+            if (x > PY_SSIZE_T_MAX) {
+                raise_decoding_error("Invalid typed struct field length %llu",
+                                     (unsigned long long)x);
+                return NULL;
+            }
+            if (_Decoder_Read(self, &s, (Py_ssize_t)x) < 0)
+                return NULL;
+            if (kind == FIELD_BYTES)
+                return PyBytes_FromStringAndSize(s, (Py_ssize_t)x);
+            if (self->string_cache != NULL && x <= STRING_CACHE_MAX_SIZE)
+                return _Decoder_CachedString(self, s, (Py_ssize_t)x);
+            return _decode_utf8(s, (Py_ssize_t)x);
+    }
+}
+
+static int
+load_typed_struct(DecoderObject *self, int nbytes)
+{
+    PyObject *typ, *obj, *fields, *defaults, *val;
+    Py_ssize_t nfields, npos, count, i;
+    uint64_t n;
+    char *layout;
+    int is_copy, should_untrack;
+
+    if ((typ = load_struct_type(self, nbytes)) == NULL)
+        return -1;
+    if (_Decoder_ReadVarint(self, &n) < 0)
+        return -1;
+
+    fields = StructMeta_GET_FIELDS(typ);
+    defaults = StructMeta_GET_DEFAULTS(typ);
+    layout = StructMeta_GET_LAYOUT(typ);
+    nfields = PyTuple_GET_SIZE(fields);
+    npos = nfields - PyTuple_GET_SIZE(defaults);
+
+    /* Without type tags the fields can only be read with the decoder's
+     * layout, so extra fields can't be skipped */
+    if (n > (uint64_t)nfields) {
+        raise_decoding_error("Typed struct of type %.200s has %llu fields, expected at most %zd",
+                             ((PyTypeObject *)typ)->tp_name,
+                             (unsigned long long)n, nfields);
+        return -1;
+    }
+    count = (Py_ssize_t)n;
+    for (i = 0; i < count; i++) {
+        if (layout[i] == FIELD_UNTYPED) {
+            raise_decoding_error("Field '%U' of %.200s has no typed annotation",
+                                 PyTuple_GET_ITEM(fields, i),
+                                 ((PyTypeObject *)typ)->tp_name);
+            return -1;
+        }
+    }
+    if (count < npos) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "Missing required argument '%U'",
+            PyTuple_GET_ITEM(fields, count)
+        );
+        return -1;
+    }
+
+    obj = ((PyTypeObject *)typ)->tp_alloc((PyTypeObject *)typ, 0);
+    if (obj == NULL)
+        return -1;
+    should_untrack = PyObject_IS_GC(obj);
+    for (i = 0; i < nfields; i++) {
+        if (i < count) {
+            val = _Decoder_ReadTypedField(self, layout[i]);
+        }
+        else {
+            is_copy = 0;
+            val = maybe_deepcopy_default(PyTuple_GET_ITEM(defaults, i - npos), &is_copy);
+            if (val != NULL && !is_copy)
+                Py_INCREF(val);
+        }
+        if (val == NULL) {
+            Py_DECREF(obj);
+            return -1;
+        }
+        Struct_set_index(obj, i, val);
+        if (should_untrack) {
+            should_untrack = !OBJ_IS_GC(val);
+        }
+    }
+    if (should_untrack)
+        PyObject_GC_UnTrack(obj);
+    STACK_PUSH(self, obj);
+    return 0;
+}
+
+static int
+load_enum(DecoderObject *self, int nbytes)
+{
+    Py_ssize_t code;
+    QuickleState *st;
+    PyObject *val = NULL, *obj = NULL, *typ, *member_table;
+
+    typ = load_from_registry(self, nbytes, &code);
+    if (typ == NULL)
+        return -1;
+    st = quickle_get_global_state();
+    if (!(PyType_Check(typ) && PyType_IsSubtype((PyTypeObject *)typ, st->EnumType))) {
+        PyErr_Format(PyExc_TypeError,
+                     "Value for typecode %zd isn't an Enum type",
+                     code);
+        return -1;
+    }
+
+    STACK_POP(self, val);
+    if (val == NULL)
+        return -1;
+
+    /* IntEnums are serialized by value, all other enums are serialized by name */
+    if (PyLong_CheckExact(val)) {
+        /* Fast path for common case. This accesses a non-public member of the
+         * enum class to speedup lookups. If this fails, we clear errors and
+         * use the slower-but-more-public method instead. */
+        member_table = PyObject_GetAttr(typ, st->value2member_map_str);
+        if (member_table != NULL) {
+            obj = PyDict_GetItem(member_table, val);
+            Py_DECREF(member_table);
+            Py_XINCREF(obj);
+        }
+        if (obj == NULL) {
+            PyErr_Clear();
+            obj = CALL_ONE_ARG(typ, val);
+        }
+    }
+    else {
+        obj = PyObject_GetAttr(typ, val);
+    }
+    Py_DECREF(val);
+    if (obj == NULL)
+        return -1;
+    STACK_PUSH(self, obj);
+    return 0;
+}
+
+/* No-op, unsupported opcodes will be detected elsewhere */
+static int
+load_proto(DecoderObject *self)
+{
+    char *s;
+    if (_Decoder_Read(self, &s, 1) < 0)
+        return -1;
+    return 0;
+}
+
+/* No-op, we ignore frame markers. Buffer is already in memory */
+static int
+load_frame(DecoderObject *self)
+{
+    char *s;
+    if (_Decoder_Read(self, &s, 8) < 0)
+        return -1;
+    return 0;
+}
+
+/* Whether `load` dispatches opcodes with a table of label addresses
+ * ("computed gotos", a GCC/Clang extension) rather than a switch. This jumps
+ * straight from the end of one opcode's handler to the next, which is
+ * cheaper and easier on the branch predictor. May be set to 0 at build time
+ * to use the portable switch instead. */
+#ifndef QUICKLE_USE_COMPUTED_GOTOS
+#if defined(__GNUC__)
+#define QUICKLE_USE_COMPUTED_GOTOS 1
+#else
+#define QUICKLE_USE_COMPUTED_GOTOS 0
+#endif
+#endif
+
+/* The opcodes handled by `load`, as OP(opcode, load_func) and
+ * OP_ARG(opcode, load_func, arg) entries. STOP is handled by `load`
+ * itself. */
+#define LOAD_OPS(OP, OP_ARG) \
+    OP(NONE, load_none) \
+    OP(BININT, load_binint) \
+    OP(BININT1, load_binint1) \
+    OP(BININT2, load_binint2) \
+    OP(VARINT, load_varint) \
+    OP(INT64, load_int64) \
+    OP_ARG(LONG1, load_counted_long, 1) \
+    OP_ARG(LONG4, load_counted_long, 4) \
+    OP(BINFLOAT, load_binfloat) \
+    OP_ARG(SHORT_BINBYTES, load_counted_binbytes, 1) \
+    OP_ARG(BINBYTES, load_counted_binbytes, 4) \
+    OP_ARG(BINBYTES8, load_counted_binbytes, 8) \
+    OP(BYTEARRAY8, load_counted_bytearray) \
+    OP(NEXT_BUFFER, load_next_buffer) \
+    OP(READONLY_BUFFER, load_readonly_buffer) \
+    OP_ARG(SHORT_BINUNICODE, load_counted_binunicode, 1) \
+    OP_ARG(BINUNICODE, load_counted_binunicode, 4) \
+    OP_ARG(BINUNICODE8, load_counted_binunicode, 8) \
+    OP(NATIVE_UNICODE, load_native_unicode) \
+    OP_ARG(EMPTY_TUPLE, load_counted_tuple, 0) \
+    OP_ARG(TUPLE1, load_counted_tuple, 1) \
+    OP_ARG(TUPLE2, load_counted_tuple, 2) \
+    OP_ARG(TUPLE3, load_counted_tuple, 3) \
+    OP(TUPLE, load_tuple) \
+    OP(EMPTY_LIST, load_empty_list) \
+    OP(PACKED_INTS, load_packed_ints) \
+    OP(PACKED_FLOATS, load_packed_floats) \
+    OP(PACKED_BOOLS, load_packed_bools) \
+    OP(ARRAY, load_array) \
+    OP(ARRAY_BUFFER, load_array_buffer) \
+    OP(MEMORYVIEW, load_memoryview) \
+    OP(MEMORYVIEW_BUFFER, load_memoryview_buffer) \
+    OP(EMPTY_DICT, load_empty_dict) \
+    OP(EMPTY_DICT_N, load_empty_dict_n) \
+    OP(DEFINE_SHAPE, load_define_shape) \
+    OP(SHAPED_DICT, load_shaped_dict) \
+    OP(EMPTY_SET, load_empty_set) \
+    OP(ADDITEMS, load_additems) \
+    OP(ADDITEMS_N, load_additems_n) \
+    OP(FROZENSET, load_frozenset) \
+    OP(APPEND, load_append) \
+    OP(APPENDS, load_appends) \
+    OP(APPENDS_N, load_appends_n) \
+    OP(BINGET, load_binget) \
+    OP(LONG_BINGET, load_long_binget) \
+    OP(MARK, load_mark) \
+    OP(MEMOIZE, load_memoize) \
+    OP(POP, load_pop) \
+    OP(POP_MARK, load_pop_mark) \
+    OP(SETITEM, load_setitem) \
+    OP(SETITEMS, load_setitems) \
+    OP(SETITEMS_N, load_setitems_n) \
+    OP(BUILDSTRUCT, load_buildstruct) \
+    OP(BUILDSTRUCT_N, load_buildstruct_n) \
+    OP(BUILDSTRUCT_SPARSE, load_buildstruct_sparse) \
+    OP_ARG(STRUCT1, load_struct, 1) \
+    OP_ARG(STRUCT2, load_struct, 2) \
+    OP_ARG(STRUCT4, load_struct, 4) \
+    OP_ARG(STRUCT_COLUMNS1, load_struct_columns, 1) \
+    OP_ARG(STRUCT_COLUMNS2, load_struct_columns, 2) \
+    OP_ARG(STRUCT_COLUMNS4, load_struct_columns, 4) \
+    OP_ARG(EMPTY_STRUCT_ARRAY1, load_empty_struct_array, 1) \
+    OP_ARG(EMPTY_STRUCT_ARRAY2, load_empty_struct_array, 2) \
+    OP_ARG(EMPTY_STRUCT_ARRAY4, load_empty_struct_array, 4) \
+    OP_ARG(TYPED_STRUCT1, load_typed_struct, 1) \
+    OP_ARG(TYPED_STRUCT2, load_typed_struct, 2) \
+    OP_ARG(TYPED_STRUCT4, load_typed_struct, 4) \
+    OP(STRUCT_ARRAY_EXTEND, load_struct_array_extend) \
+    OP_ARG(ENUM1, load_enum, 1) \
+    OP_ARG(ENUM2, load_enum, 2) \
+    OP_ARG(ENUM4, load_enum, 4) \
+    OP(COMPLEX, load_complex) \
+    OP(TIMEDELTA, load_timedelta) \
+    OP(DATE, load_date) \
+    OP_ARG(TIME, load_time, 0) \
+    OP_ARG(TIME_TZ, load_time, 1) \
+    OP_ARG(DATETIME, load_datetime, 0) \
+    OP_ARG(DATETIME_TZ, load_datetime, 1) \
+    OP(TIMEZONE_UTC, load_timezone_utc) \
+    OP(TIMEZONE, load_timezone) \
+    OP(ZONEINFO, load_zoneinfo) \
+    OP(PROTO, load_proto) \
+    OP(FRAME, load_frame) \
+    OP_ARG(NEWTRUE, load_bool, Py_True) \
+    OP_ARG(NEWFALSE, load_bool, Py_False)
+
+static PyObject *
+load(DecoderObject *self)
+{
+    PyObject *value = NULL;
+    char *s = NULL;
+
+#if QUICKLE_USE_COMPUTED_GOTOS
+#define TARGET(opcode) TARGET_##opcode
+    /* Every handler ends with its own copy of the dispatch jump, reading the
+     * next opcode inline when it's already buffered. Reads that need more
+     * input share a single out of line path, to keep the copies small. */
+#define DISPATCH() \
+    do { \
+        if (self->next_read_idx >= self->input_len) \
+            goto refill; \
+        s = self->input_buffer + self->next_read_idx++; \
+        goto *dispatch_table[(unsigned char)s[0]]; \
+    } while (0)
+#define TABLE_OP(opcode, load_func) \
+    [(unsigned char)opcode] = &&TARGET(opcode),
+#define TABLE_OP_ARG(opcode, load_func, arg) \
+    [(unsigned char)opcode] = &&TARGET(opcode),
+#define OP(opcode, load_func) \
+    TARGET(opcode): if (load_func(self) < 0) goto error; DISPATCH();
+#define OP_ARG(opcode, load_func, arg) \
+    TARGET(opcode): if (load_func(self, (arg)) < 0) goto error; DISPATCH();
+
+    /* Unknown opcodes default to `invalid_opcode`, and are then overridden */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void *dispatch_table[256] = {
+        [0 ... 255] = &&invalid_opcode,
+        LOAD_OPS(TABLE_OP, TABLE_OP_ARG)
+        [(unsigned char)STOP] = &&TARGET(STOP),
+    };
+#pragma GCC diagnostic pop
+
+    DISPATCH();
+    LOAD_OPS(OP, OP_ARG)
+    TARGET(STOP):
+        goto done;
+refill:
+    if (_Decoder_Read(self, &s, 1) < 0)
+        return NULL;
+    goto *dispatch_table[(unsigned char)s[0]];
+
+#undef TARGET
+#undef DISPATCH
+#undef TABLE_OP
+#undef TABLE_OP_ARG
+#else
+#define OP(opcode, load_func) \
+    case opcode: if (load_func(self) < 0) goto error; continue;
+#define OP_ARG(opcode, load_func, arg) \
+    case opcode: if (load_func(self, (arg)) < 0) goto error; continue;
+
+    while (1) {
+        if (_Decoder_Read(self, &s, 1) < 0) {
+            return NULL;
+        }
+
+        switch ((enum opcode)s[0]) {
+        LOAD_OPS(OP, OP_ARG)
+
+        case STOP:
+            goto done;
+
+        default:
+            goto invalid_opcode;
+        }
+    }
+#endif
+#undef OP
+#undef OP_ARG
+
+invalid_opcode:
+    {
+        QuickleState *st = quickle_get_global_state();
+        unsigned char c = (unsigned char) *s;
+        if (0x20 <= c && c <= 0x7e && c != '\'' && c != '\\') {
+            PyErr_Format(st->DecodingError,
+                         "invalid load key, '%c'.", c);
+        }
+        else {
+            PyErr_Format(st->DecodingError,
+                         "invalid load key, '\\x%02x'.", c);
+        }
+        return NULL;
+    }
+
+error:
+    return NULL;
+
+done:
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    STACK_POP(self, value);
+    return value;
+}
+
+static PyObject*
+Decoder_sizeof(DecoderObject *self)
+{
+    Py_ssize_t res;
+
+    res = sizeof(DecoderObject);
+    if (self->stack != NULL)
+        res += self->stack_allocated * sizeof(PyObject *);
+    if (self->memo != NULL)
+        res += self->memo_allocated * sizeof(PyObject *);
+    if (self->marks != NULL)
+        res += self->marks_allocated * sizeof(Py_ssize_t);
+    if (self->read_buffer != NULL)
+        res += self->read_buffer_allocated;
+    if (self->string_cache != NULL)
+        res += (self->string_cache_mask + 1) * sizeof(PyObject *);
+    return PyLong_FromSsize_t(res);
+}
+
+/* Prepare the decoder for a new `load`/`loads` call. Returns -1 on failure,
+ * 0 on success. */
+static int
+_Decoder_Setup(DecoderObject *self, PyObject *buffers)
+{
+    if (buffers == NULL || buffers == Py_None) {
+        self->buffers = NULL;
+    }
+    else {
+        self->buffers = PyObject_GetIter(buffers);
+        if (self->buffers == NULL) {
+            return -1;
+        }
+    }
+
+    if (self->stack == NULL) {
+        self->stack_allocated = 8;
+        self->stack = PyMem_Malloc(self->stack_allocated * sizeof(PyObject *));
+        if (self->stack == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    if (self->memo == NULL) {
+        self->memo_allocated = 32;
+        self->memo = PyMem_Calloc(self->memo_allocated, sizeof(PyObject *));
+        if (self->memo == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    self->memo_mark = self->memo_len;
+    self->in_use = 1;
+    return 0;
+}
+
+/* Reset temporary state after a `load`/`loads` call */
+static void
+_Decoder_Reset(DecoderObject *self, int failed)
+{
+    self->in_use = 0;
+    Py_CLEAR(self->buffers);
+    Py_CLEAR(self->shapes);
+    /* Reset stack, deallocates if allocation exceeded limit */
+    _Decoder_stack_clear(self, 0);
+    if (self->stack_allocated > self->reset_stack_size) {
+        PyMem_Free(self->stack);
+        self->stack = NULL;
+    }
+    if (self->persistent_memo) {
+        /* Keep a session memo, dropping anything from a failed message */
+        if (failed)
+            _Decoder_memo_truncate(self, self->memo_mark);
+    }
+    else {
+        /* Reset memo, deallocates if allocation exceeded limit */
+        _Decoder_memo_clear(self);
+        if (self->memo_allocated > self->reset_memo_size) {
+            PyMem_Free(self->memo);
+            self->memo = NULL;
+        }
+    }
+    /* Reset marks, deallocates if allocation exceeded limit */
+    self->marks_len = 0;
+    self->fence = 0;
+    if (self->marks_allocated > self->reset_marks_size) {
+        PyMem_Free(self->marks);
+        self->marks = NULL;
+    }
+}
+
+/* Decode a single message from `data`, starting at `offset`. On success the
+ * offset just past the end of the message is stored in `end`. */
+static PyObject*
+_Decoder_LoadAt(DecoderObject *self, char *data, Py_ssize_t len,
+                Py_ssize_t offset, PyObject *buffers, Py_ssize_t *end)
+{
+    PyObject *res = NULL;
+
+    if (_Decoder_CheckNotInUse(self) < 0)
+        return NULL;
+
+    self->input_buffer = data;
+    self->input_len = len;
+    self->next_read_idx = offset;
+
+    if (_Decoder_Setup(self, buffers) == 0)
+        res = load(self);
+    *end = self->next_read_idx;
+
+    self->input_buffer = NULL;
+    self->input_len = 0;
+    self->next_read_idx = 0;
+    _Decoder_Reset(self, res == NULL);
+    return res;
+}
+
+static PyObject*
+Decoder_loads_internal(DecoderObject *self, PyObject *data, PyObject *buffers) {
+    PyObject *res = NULL;
+    Py_ssize_t end;
+
+    if (_Decoder_CheckNotInUse(self) < 0)
+        return NULL;
+    if (PyObject_GetBuffer(data, &self->buffer, PyBUF_CONTIG_RO) < 0) {
+        return NULL;
+    }
+    res = _Decoder_LoadAt(self, self->buffer.buf, self->buffer.len, 0,
+                          buffers, &end);
+    PyBuffer_Release(&self->buffer);
+    self->buffer.buf = NULL;
+    return res;
+}
+
+static PyObject*
+Decoder_loads_at_internal(DecoderObject *self, PyObject *data,
+                          Py_ssize_t offset, PyObject *buffers) {
+    PyObject *obj, *res = NULL;
+    Py_ssize_t end;
+
+    if (_Decoder_CheckNotInUse(self) < 0)
+        return NULL;
+    if (PyObject_GetBuffer(data, &self->buffer, PyBUF_CONTIG_RO) < 0) {
+        return NULL;
+    }
+    if (offset < 0 || offset > self->buffer.len) {
+        PyErr_Format(PyExc_ValueError,
+                     "offset (%zd) is out of bounds for data of size %zd",
+                     offset, self->buffer.len);
+    }
+    else {
+        obj = _Decoder_LoadAt(self, self->buffer.buf, self->buffer.len,
+                              offset, buffers, &end);
+        if (obj != NULL) {
+            res = Py_BuildValue("(Nn)", obj, end);
+        }
+    }
+    PyBuffer_Release(&self->buffer);
+    self->buffer.buf = NULL;
+    return res;
+}
+
+/* Handle any data read past the end of the message after a `load` call.
+ * Seekable files are rewound so the next read starts right after the
+ * message. For other files the excess data is kept in the read window, and
+ * consumed by the next `load` call on the same file. Returns -1 on failure,
+ * 0 on success. */
+static int
+_Decoder_HandleUnread(DecoderObject *self, PyObject *file)
+{
+    PyObject *res;
+    int seekable = 0;
+    Py_ssize_t unread = self->input_len - self->next_read_idx;
+    QuickleState *st = quickle_get_global_state();
+
+    if (unread > 0) {
+        res = PyObject_CallMethodObjArgs(file, st->seekable_str, NULL);
+        if (res == NULL) {
+            if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+                return -1;
+            PyErr_Clear();
+        }
+        else {
+            seekable = PyObject_IsTrue(res);
+            Py_DECREF(res);
+            if (seekable < 0)
+                return -1;
+        }
+    }
+    if (unread > 0 && seekable) {
+        PyObject *offset, *whence;
+        offset = PyLong_FromSsize_t(-unread);
+        if (offset == NULL)
+            return -1;
+        whence = PyLong_FromLong(1);
+        if (whence == NULL) {
+            Py_DECREF(offset);
+            return -1;
+        }
+        res = PyObject_CallMethodObjArgs(file, st->seek_str, offset, whence, NULL);
+        Py_DECREF(offset);
+        Py_DECREF(whence);
+        if (res == NULL)
+            return -1;
+        Py_DECREF(res);
+        unread = 0;
+    }
+    if (unread > 0) {
+        memmove(self->read_buffer, self->read_buffer + self->next_read_idx, unread);
+        Py_INCREF(file);
+        Py_XSETREF(self->read_file, file);
+    }
+    else {
+        Py_CLEAR(self->read_file);
+    }
+    self->read_buffer_len = unread;
+
+    /* Shrink the read window if a large value caused it to grow */
+    if (self->read_buffer_allocated > self->read_buffer_size &&
+        unread <= self->read_buffer_size)
+    {
+        char *read_buffer = self->read_buffer;
+        PyMem_Resize(read_buffer, char, self->read_buffer_size);
+        if (read_buffer != NULL) {
+            self->read_buffer = read_buffer;
+            self->read_buffer_allocated = self->read_buffer_size;
+        }
+    }
+    return 0;
+}
+
+static PyObject*
+Decoder_load_internal(DecoderObject *self, PyObject *file, PyObject *buffers) {
+    PyObject *res = NULL;
+    QuickleState *st = quickle_get_global_state();
+
+    if (_Decoder_CheckNotInUse(self) < 0)
+        return NULL;
+    self->readinto = PyObject_GetAttr(file, st->readinto_str);
+    if (self->readinto == NULL) {
+        if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "file must have a 'readinto' attribute");
+        }
+        return NULL;
+    }
+
+    if (self->read_buffer == NULL) {
+        self->read_buffer = PyMem_Malloc(self->read_buffer_size);
+        if (self->read_buffer == NULL) {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        self->read_buffer_allocated = self->read_buffer_size;
+    }
+    /* Data left over from a previous call is only valid for the same file */
+    if (self->read_file != file) {
+        Py_CLEAR(self->read_file);
+        self->read_buffer_len = 0;
+    }
+    self->input_buffer = self->read_buffer;
+    self->input_len = self->read_buffer_len;
+    self->next_read_idx = 0;
+
+    if (_Decoder_Setup(self, buffers) == 0) {
+        res = load(self);
+        if (res != NULL && _Decoder_HandleUnread(self, file) < 0)
+            Py_CLEAR(res);
+    }
+
+cleanup:
+    if (res == NULL) {
+        /* Position in the file is unknown, drop any buffered data */
+        Py_CLEAR(self->read_file);
+        self->read_buffer_len = 0;
+    }
+    Py_CLEAR(self->readinto);
+    self->input_buffer = NULL;
+    self->input_len = 0;
+    self->next_read_idx = 0;
+    _Decoder_Reset(self, res == NULL);
+    return res;
+}
+
+static char *Decoder_loads_kws[] = {"buffers", NULL};
+
+PyDoc_STRVAR(Decoder_loads__doc__,
+"loads(self, data, *, buffers=None)\n"
+"--\n"
+"\n"
+"Deserialize an object from bytes.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"data : bytes\n"
+"    The serialized data\n"
+"buffers : iterable of bytes, optional\n"
+"    An iterable of out-of-band buffers generated by passing\n"
+"    ``collect_buffers=True`` to the corresponding `Encoder.dumps` call.\n"
+"\n"
+"Returns\n"
+"-------\n"
+"obj : object\n"
+"    The deserialized object"
+);
+static PyObject*
+Decoder_loads(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *data = NULL;
+    PyObject *buffers = NULL;
+    QuickleState *st = quickle_get_global_state();
+
+    if (!check_positional_nargs(nargs, 1, 1)) {
+        return NULL;
+    }
+    data = args[0];
+    if (kwnames != NULL) {
+        if (!parse_keywords(kwnames, args + nargs, st->decoder_loads_kws, &buffers)) {
+            return NULL;
+        }
+    }
+    return Decoder_loads_internal(self, data, buffers);
+}
+
+PyDoc_STRVAR(Decoder_load__doc__,
+"load(self, file, *, buffers=None)\n"
+"--\n"
+"\n"
+"Deserialize an object from a file.\n"
+"\n"
+"Data is read incrementally into a window of ``read_buffer_size`` bytes, so\n"
+"the full message never needs to be held in memory. Large ``bytes`` and\n"
+"``bytearray`` payloads are read directly into their final destination.\n"
+"\n"
+"Any data read past the end of the message is handed back to the file if\n"
+"it's seekable. Otherwise it's retained by the decoder and used by the next\n"
+"call to `Decoder.load` with the same file, allowing a stream of messages\n"
+"(e.g. from a socket) to be read with repeated calls.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"file : file-like\n"
+"    An object with a ``readinto`` method, such as a file opened in binary\n"
+"    mode, an ``io.BytesIO``, or a socket file.\n"
+"buffers : iterable of bytes, optional\n"
+"    An iterable of out-of-band buffers generated by passing\n"
+"    ``collect_buffers=True`` to the corresponding `Encoder.dump` call.\n"
+"\n"
+"Returns\n"
+"-------\n"
+"obj : object\n"
+"    The deserialized object"
+);
+static PyObject*
+Decoder_load(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *buffers = NULL;
+    QuickleState *st = quickle_get_global_state();
+
+    if (!check_positional_nargs(nargs, 1, 1)) {
+        return NULL;
+    }
+    if (kwnames != NULL) {
+        if (!parse_keywords(kwnames, args + nargs, st->decoder_loads_kws, &buffers)) {
+            return NULL;
+        }
+    }
+    return Decoder_load_internal(self, args[0], buffers);
+}
+
+static char *Decoder_loads_at_kws[] = {"offset", "buffers", NULL};
+
+PyDoc_STRVAR(Decoder_loads_at__doc__,
+"loads_at(self, data, offset=0, *, buffers=None)\n"
+"--\n"
+"\n"
+"Deserialize a single object from ``data``, starting at ``offset``.\n"
+"\n"
+"Useful for decoding buffers holding multiple concatenated messages\n"
+"without slicing them.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"data : bytes\n"
+"    The serialized data\n"
+"offset : int, optional\n"
+"    The offset into ``data`` where the message starts. Defaults to 0.\n"
+"buffers : iterable of bytes, optional\n"
+"    An iterable of out-of-band buffers generated by passing\n"
+"    ``collect_buffers=True`` to the corresponding `Encoder.dumps` call.\n"
+"\n"
+"Returns\n"
+"-------\n"
+"obj : object\n"
+"    The deserialized object\n"
+"end : int\n"
+"    The offset just past the end of the message, where the next message\n"
+"    (if any) starts."
+);
+static PyObject*
+Decoder_loads_at(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Py_ssize_t offset = 0;
+    PyObject *offset_obj = NULL;
+    PyObject *buffers = NULL;
+    QuickleState *st = quickle_get_global_state();
+
+    if (!check_positional_nargs(nargs, 1, 2)) {
+        return NULL;
+    }
+    if (nargs == 2) {
+        offset_obj = args[1];
+    }
+    if (kwnames != NULL) {
+        PyObject *offset_kw = NULL;
+        if (!parse_keywords(kwnames, args + nargs, st->decoder_loads_at_kws,
+                            &offset_kw, &buffers)) {
+            return NULL;
+        }
+        if (offset_kw != NULL) {
+            if (offset_obj != NULL) {
+                PyErr_SetString(PyExc_TypeError,
+                                "Argument 'offset' given by name and position");
+                return NULL;
+            }
+            offset_obj = offset_kw;
+        }
+    }
+    if (offset_obj != NULL) {
+        offset = PyNumber_AsSsize_t(offset_obj, PyExc_OverflowError);
+        if (offset == -1 && PyErr_Occurred())
+            return NULL;
+    }
+    return Decoder_loads_at_internal(self, args[0], offset, buffers);
+}
+
+/*************************************************************************
+ * DecoderIter                                                           *
+ *************************************************************************/
+
+typedef struct DecoderIterObject {
+    PyObject_HEAD
+    DecoderObject *decoder;
+    Py_buffer buffer;
+    Py_ssize_t offset;
+} DecoderIterObject;
+
+static PyTypeObject DecoderIter_Type;
+
+static PyObject *
+DecoderIter_next(DecoderIterObject *self)
+{
+    PyObject *res;
+
+    if (self->buffer.buf == NULL || self->offset >= self->buffer.len) {
+        /* Exhausted, release the buffer early */
+        if (self->buffer.buf != NULL) {
+            PyBuffer_Release(&self->buffer);
+            self->buffer.buf = NULL;
+        }
+        return NULL;
+    }
+    res = _Decoder_LoadAt(self->decoder, self->buffer.buf, self->buffer.len,
+                          self->offset, NULL, &self->offset);
+    if (res == NULL) {
+        /* Can't resume after an error, stop iteration */
+        PyBuffer_Release(&self->buffer);
+        self->buffer.buf = NULL;
+    }
+    return res;
+}
+
+static int
+DecoderIter_clear(DecoderIterObject *self)
+{
+    if (self->buffer.buf != NULL) {
+        PyBuffer_Release(&self->buffer);
+        self->buffer.buf = NULL;
+    }
+    Py_CLEAR(self->decoder);
+    return 0;
+}
+
+static void
+DecoderIter_dealloc(DecoderIterObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    DecoderIter_clear(self);
+    PyObject_GC_Del(self);
+}
+
+static int
+DecoderIter_traverse(DecoderIterObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->decoder);
+    Py_VISIT(self->buffer.obj);
+    return 0;
+}
+
+static PyTypeObject DecoderIter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "quickle.DecoderIter",
+    .tp_basicsize = sizeof(DecoderIterObject),
+    .tp_dealloc = (destructor)DecoderIter_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)DecoderIter_traverse,
+    .tp_clear = (inquiry)DecoderIter_clear,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)DecoderIter_next,
+};
+
+PyDoc_STRVAR(Decoder_iter_loads__doc__,
+"iter_loads(self, data)\n"
+"--\n"
+"\n"
+"Iterate over the objects in a buffer of concatenated messages.\n"
+"\n"
+"The buffer is acquired once for the whole iteration, and messages are\n"
+"decoded in place without slicing.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"data : bytes\n"
+"    The serialized data, as produced by e.g. `Encoder.dumps_many`.\n"
+"\n"
+"Returns\n"
+"-------\n"
+"iterator\n"
+"    An iterator of the deserialized objects."
+);
+static PyObject*
+Decoder_iter_loads(DecoderObject *self, PyObject *data)
+{
+    DecoderIterObject *it;
+
+    if (_Decoder_CheckNotInUse(self) < 0)
+        return NULL;
+    it = PyObject_GC_New(DecoderIterObject, &DecoderIter_Type);
+    if (it == NULL)
+        return NULL;
+    it->decoder = NULL;
+    it->offset = 0;
+    if (PyObject_GetBuffer(data, &it->buffer, PyBUF_CONTIG_RO) < 0) {
+        it->buffer.buf = NULL;
+        Py_DECREF(it);
+        return NULL;
+    }
+    Py_INCREF(self);
+    it->decoder = self;
+    PyObject_GC_Track(it);
+    return (PyObject *)it;
+}
+
+static struct PyMethodDef Decoder_methods[] = {
+    {
+        "loads", (PyCFunction) Decoder_loads, METH_FASTCALL | METH_KEYWORDS,
+        Decoder_loads__doc__,
+    },
+    {
+        "load", (PyCFunction) Decoder_load, METH_FASTCALL | METH_KEYWORDS,
+        Decoder_load__doc__,
+    },
+    {
+        "loads_at", (PyCFunction) Decoder_loads_at, METH_FASTCALL | METH_KEYWORDS,
+        Decoder_loads_at__doc__,
+    },
+    {
+        "iter_loads", (PyCFunction) Decoder_iter_loads, METH_O,
+        Decoder_iter_loads__doc__,
+    },
+    {
+        "__sizeof__", (PyCFunction) Decoder_sizeof, METH_NOARGS,
+        PyDoc_STR("Size in bytes")
+    },
+    {NULL, NULL}                /* sentinel */
+};
+
+static PyTypeObject Decoder_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "quickle.Decoder",
+    .tp_doc = Decoder__doc__,
+    .tp_basicsize = sizeof(DecoderObject),
+    .tp_dealloc = (destructor)Decoder_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)Decoder_traverse,
+    .tp_clear = (inquiry)Decoder_clear,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Decoder_init,
+    .tp_methods = Decoder_methods,
+};
+
+/*************************************************************************
+ * DecoderSession object                                                 *
+ *************************************************************************/
+
+PyDoc_STRVAR(DecoderSession__doc__,
+"DecoderSession(**kwargs)\n"
+"--\n"
+"\n"
+"A `Decoder` for a stream of messages written by an `EncoderSession`.\n"
+"\n"
+"The memo isn't cleared between calls, so later messages may refer to\n"
+"objects decoded from earlier messages. Messages must be decoded in the\n"
+"order they were written. If decoding a message fails, anything it added to\n"
+"the memo is discarded.\n"
+"\n"
+"Accepts the same arguments as `Decoder`."
+);
+
+static int
+DecoderSession_init(DecoderObject *self, PyObject *args, PyObject *kwds)
+{
+    if (Decoder_init(self, args, kwds) < 0)
+        return -1;
+    self->persistent_memo = 1;
+    return 0;
+}
+
+PyDoc_STRVAR(DecoderSession_reset__doc__,
+"reset(self)\n"
+"--\n"
+"\n"
+"Clear the memo, releasing any objects decoded so far.\n"
+"\n"
+"This must be called at the same point in the stream as\n"
+"`EncoderSession.reset`."
+);
+static PyObject*
+DecoderSession_reset(DecoderObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (_Decoder_CheckNotInUse(self) < 0)
+        return NULL;
+    _Decoder_memo_clear(self);
+    if (self->memo_allocated > self->reset_memo_size) {
+        PyMem_Free(self->memo);
+        self->memo = NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static struct PyMethodDef DecoderSession_methods[] = {
+    {
+        "reset", (PyCFunction) DecoderSession_reset, METH_NOARGS,
+        DecoderSession_reset__doc__,
+    },
+    {NULL, NULL}                /* sentinel */
+};
+
+static PyTypeObject DecoderSession_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "quickle.DecoderSession",
+    .tp_doc = DecoderSession__doc__,
+    .tp_basicsize = sizeof(DecoderObject),
+    .tp_base = &Decoder_Type,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)Decoder_traverse,
+    .tp_clear = (inquiry)Decoder_clear,
+    .tp_init = (initproc) DecoderSession_init,
+    .tp_methods = DecoderSession_methods,
+};
+
+
+/*************************************************************************
+ * Record Log                                                            *
+ *************************************************************************/
+
+/* A log file is a sequence of quickle messages, followed by an index of the
+ * start offset of each message, followed by a fixed-size footer:
+ *
+ *     message 0 | ... | message n-1 | offset 0 | ... | offset n-1 | footer
+ *
+ * Offsets are absolute file offsets, stored as 8 byte little-endian
+ * integers. The footer holds the offset of the index (8 bytes), the number
+ * of messages (8 bytes), and LOG_MAGIC (8 bytes). */
+#define LOG_MAGIC "QUICKLOG"
+#define LOG_FOOTER_SIZE 24
+
+/* Returns 1 if `obj` should be treated as a filesystem path, 0 otherwise,
+ * and -1 on error */
+static int
+_is_path_like(PyObject *obj)
+{
+    PyObject *fspath;
+
+    if (PyUnicode_Check(obj) || PyBytes_Check(obj))
+        return 1;
+    fspath = PyObject_GetAttrString(obj, "__fspath__");
+    if (fspath == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+            return -1;
+        PyErr_Clear();
+        return 0;
+    }
+    Py_DECREF(fspath);
+    return 1;
+}
+
+/* Open the file at `path` with `io.open`. Returns a new reference. */
+static PyObject *
+_open_path(PyObject *path, const char *mode)
+{
+    PyObject *io, *res;
+    io = PyImport_ImportModule("io");
+    if (io == NULL)
+        return NULL;
+    res = PyObject_CallMethod(io, "open", "Os", path, mode);
+    Py_DECREF(io);
+    return res;
+}
+
+typedef struct LogWriterObject {
+    PyObject_HEAD
+    EncoderObject *encoder;
+    PyObject *file;
+    int owns_file;
+    int closed;
+    Py_ssize_t pos;             /* Current offset in the file */
+    uint64_t *offsets;          /* Start offset of every record written */
+    Py_ssize_t count;
+    Py_ssize_t allocated;
+} LogWriterObject;
+
+static char *LogWriter_init_kws[] = {"file", "encoder", NULL};
+
+PyDoc_STRVAR(LogWriter__doc__,
+"LogWriter(file, *, encoder=None)\n"
+"--\n"
+"\n"
+"Write a log of quickle records to a file.\n"
+"\n"
+"Records are appended with `LogWriter.append`. On `LogWriter.close` an index\n"
+"of record offsets is written to the end of the file, allowing the log to be\n"
+"read efficiently with random access by a `LogReader`. A log that was never\n"
+"closed is incomplete, and can't be read. A writer that's garbage collected\n"
+"while still open is closed, emitting a ``ResourceWarning``.\n"
+"\n"
+"``LogWriter`` objects can also be used as a context manager, closing on\n"
+"exit.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"file : str, path-like, or file-like\n"
+"    The path to write to, or a file opened in binary mode. If a path, the\n"
+"    file is opened on creation and closed on `LogWriter.close`. An open\n"
+"    file is never closed by the writer.\n"
+"encoder : Encoder, optional\n"
+"    The `Encoder` to use for serializing records. Defaults to a new\n"
+"    `Encoder` with the default options. Out-of-band buffers aren't\n"
+"    supported, ``collect_buffers`` is ignored."
+);
+static int
+LogWriter_init(LogWriterObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *file = NULL, *encoder = NULL, *temp;
+    int path_like;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|$O", LogWriter_init_kws,
+                                     &file, &encoder)) {
+        return -1;
+    }
+    if (encoder == NULL || encoder == Py_None) {
+        encoder = PyObject_CallObject((PyObject *)&Encoder_Type, NULL);
+        if (encoder == NULL)
+            return -1;
+    }
+    else if (PyObject_TypeCheck(encoder, &Encoder_Type)) {
+        Py_INCREF(encoder);
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "encoder must be an Encoder");
+        return -1;
+    }
+    Py_XSETREF(self->encoder, (EncoderObject *)encoder);
+
+    path_like = _is_path_like(file);
+    if (path_like < 0)
+        return -1;
+    if (path_like) {
+        file = _open_path(file, "wb");
+        if (file == NULL)
+            return -1;
+        self->owns_file = 1;
+        self->pos = 0;
+    }
+    else {
+        Py_INCREF(file);
+        self->owns_file = 0;
+        /* Offsets are relative to the start of the file, the log may start
+         * after existing data */
+        self->pos = 0;
+        temp = PyObject_CallMethod(file, "tell", NULL);
+        if (temp == NULL) {
+            /* Files that can't tell (io.UnsupportedOperation is an OSError)
+             * are assumed to start empty */
+            if (!PyErr_ExceptionMatches(PyExc_OSError) &&
+                    !PyErr_ExceptionMatches(PyExc_AttributeError)) {
+                Py_DECREF(file);
+                return -1;
+            }
+            PyErr_Clear();
+        }
+        else {
+            self->pos = PyLong_AsSsize_t(temp);
+            Py_DECREF(temp);
+            if (self->pos == -1 && PyErr_Occurred()) {
+                Py_DECREF(file);
+                return -1;
+            }
+        }
+    }
+    Py_XSETREF(self->file, file);
+    self->count = 0;
+    self->closed = 0;
+    return 0;
+}
+
+static int
+_LogWriter_check_open(LogWriterObject *self)
+{
+    if (self->file == NULL || self->closed) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed log");
+        return 0;
+    }
+    return 1;
+}
+
+PyDoc_STRVAR(LogWriter_append__doc__,
+"append(self, obj)\n"
+"--\n"
+"\n"
+"Append a record to the log.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"obj : object\n"
+"    The object to serialize.\n"
+"\n"
+"Returns\n"
+"-------\n"
+"index : int\n"
+"    The index of the record in the log."
+);
+static PyObject*
+LogWriter_append(LogWriterObject *self, PyObject *obj)
+{
+    PyObject *res;
+    EncoderObject *enc = self->encoder;
+
+    if (!_LogWriter_check_open(self))
+        return NULL;
+
+    if (self->count == self->allocated) {
+        Py_ssize_t allocated = self->allocated ? self->allocated * 2 : 64;
+        uint64_t *offsets = self->offsets;
+        PyMem_Resize(offsets, uint64_t, allocated);
+        if (offsets == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        self->offsets = offsets;
+        self->allocated = allocated;
+    }
+
+    if (_Encoder_CheckNotInUse(enc) < 0)
+        return NULL;
+    enc->active_collect_buffers = 0;
+    enc->output_written = 0;
+    res = Encoder_dump_internal(enc, obj, self->file);
+    if (res == NULL) {
+        /* Part of the record may already have been flushed to the file. It's
+         * left unindexed, but later offsets must still account for it. */
+        self->pos += enc->output_written;
+        return NULL;
+    }
+    Py_DECREF(res);
+
+    self->offsets[self->count] = (uint64_t)self->pos;
+    self->pos += enc->output_written;
+    return PyLong_FromSsize_t(self->count++);
+}
+
+PyDoc_STRVAR(LogWriter_close__doc__,
+"close(self)\n"
+"--\n"
+"\n"
+"Write the log index and close the log.\n"
+"\n"
+"Calling ``close`` more than once is allowed, and has no effect."
+);
+static PyObject*
+LogWriter_close(LogWriterObject *self, PyObject *unused)
+{
+    char *data;
+    Py_ssize_t i, size;
+    PyObject *index, *res;
+    int status = 0;
+
+    if (self->file == NULL || self->closed)
+        Py_RETURN_NONE;
+    self->closed = 1;
+
+    size = self->count * 8 + LOG_FOOTER_SIZE;
+    index = PyBytes_FromStringAndSize(NULL, size);
+    if (index == NULL) {
+        status = -1;
+    }
+    else {
+        data = PyBytes_AS_STRING(index);
+        for (i = 0; i < self->count; i++) {
+            _write_size64(data + i * 8, self->offsets[i]);
+        }
+        data += self->count * 8;
+        _write_size64(data, self->pos);
+        _write_size64(data + 8, self->count);
+        memcpy(data + 16, LOG_MAGIC, 8);
+
+        res = PyObject_CallMethod(self->file, "write", "O", index);
+        Py_DECREF(index);
+        if (res == NULL)
+            status = -1;
+        Py_XDECREF(res);
+    }
+
+    PyMem_Free(self->offsets);
+    self->offsets = NULL;
+    self->allocated = 0;
+
+    if (self->owns_file) {
+        res = PyObject_CallMethod(self->file, "close", NULL);
+        if (res == NULL)
+            status = -1;
+        Py_XDECREF(res);
+    }
+    if (status < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+LogWriter_enter(LogWriterObject *self, PyObject *unused)
+{
+    if (!_LogWriter_check_open(self))
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject*
+LogWriter_exit(LogWriterObject *self, PyObject *args)
+{
+    return LogWriter_close(self, NULL);
+}
+
+static Py_ssize_t
+LogWriter_len(LogWriterObject *self)
+{
+    return self->count;
+}
+
+static PyObject*
+LogWriter_get_closed(LogWriterObject *self, void *closure)
+{
+    return PyBool_FromLong(self->file == NULL || self->closed);
+}
+
+static int
+LogWriter_clear(LogWriterObject *self)
+{
+    Py_CLEAR(self->encoder);
+    Py_CLEAR(self->file);
+    if (self->offsets != NULL) {
+        PyMem_Free(self->offsets);
+        self->offsets = NULL;
+    }
+    return 0;
+}
+
+/* Close a log that's garbage collected while still open, writing its index
+ * so the records aren't lost. Like `io` files, a ResourceWarning is emitted. */
+static void
+LogWriter_finalize(LogWriterObject *self)
+{
+    PyObject *error_type, *error_value, *error_traceback, *res;
+
+    if (self->file == NULL || self->closed)
+        return;
+
+    PyErr_Fetch(&error_type, &error_value, &error_traceback);
+    if (PyErr_ResourceWarning((PyObject *)self, 1, "unclosed log %R", self) < 0)
+        PyErr_WriteUnraisable((PyObject *)self);
+    res = LogWriter_close(self, NULL);
+    if (res == NULL)
+        PyErr_WriteUnraisable((PyObject *)self);
+    else
+        Py_DECREF(res);
+    PyErr_Restore(error_type, error_value, error_traceback);
+}
+
+static void
+LogWriter_dealloc(LogWriterObject *self)
+{
+    if (PyObject_CallFinalizerFromDealloc((PyObject *)self) < 0)
+        return;
+    PyObject_GC_UnTrack(self);
+    LogWriter_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+LogWriter_traverse(LogWriterObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->encoder);
+    Py_VISIT(self->file);
+    return 0;
+}
+
+static struct PyMethodDef LogWriter_methods[] = {
+    {
+        "append", (PyCFunction) LogWriter_append, METH_O,
+        LogWriter_append__doc__,
+    },
+    {
+        "close", (PyCFunction) LogWriter_close, METH_NOARGS,
+        LogWriter_close__doc__,
+    },
+    {"__enter__", (PyCFunction) LogWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) LogWriter_exit, METH_VARARGS, NULL},
+    {NULL, NULL}                /* sentinel */
+};
+
+static PyGetSetDef LogWriter_getset[] = {
+    {"closed", (getter) LogWriter_get_closed, NULL, "Whether the log is closed", NULL},
+    {NULL},
+};
+
+static PySequenceMethods LogWriter_as_sequence = {
+    .sq_length = (lenfunc)LogWriter_len,
+};
+
+static PyTypeObject LogWriter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "quickle.LogWriter",
+    .tp_doc = LogWriter__doc__,
+    .tp_basicsize = sizeof(LogWriterObject),
+    .tp_dealloc = (destructor)LogWriter_dealloc,
+    .tp_finalize = (destructor)LogWriter_finalize,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_traverse = (traverseproc)LogWriter_traverse,
+    .tp_clear = (inquiry)LogWriter_clear,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) LogWriter_init,
+    .tp_methods = LogWriter_methods,
+    .tp_getset = LogWriter_getset,
+    .tp_as_sequence = &LogWriter_as_sequence,
+};
+
+typedef struct LogReaderObject {
+    PyObject_HEAD
+    DecoderObject *decoder;
+    PyObject *mmap;
+    Py_buffer buffer;           /* The mapped file, buf is NULL if closed */
+    const char *index;          /* Start of the index in buffer */
+    Py_ssize_t index_offset;
+    Py_ssize_t count;
+} LogReaderObject;
+
+static char *LogReader_init_kws[] = {"file", "decoder", NULL};
+
+PyDoc_STRVAR(LogReader__doc__,
+"LogReader(file, *, decoder=None)\n"
+"--\n"
+"\n"
+"Read a log of quickle records written by a `LogWriter`.\n"
+"\n"
+"The file is memory-mapped, and records are decoded directly from the\n"
+"mapping without copying. ``LogReader`` objects support ``len``, indexing\n"
+"(including negative indices), and iteration. They can also be used as a\n"
+"context manager, closing on exit.\n"
+"\n"
+"Parameters\n"
+"----------\n"
+"file : str, path-like, or file-like\n"
+"    The path to read from, or a file opened in binary mode with a\n"
+"    ``fileno`` method.\n"
+"decoder : Decoder, optional\n"
+"    The `Decoder` to use for deserializing records. Defaults to a new\n"
+"    `Decoder` with the default options."
+);
+static int
+LogReader_init(LogReaderObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *file = NULL, *decoder = NULL, *opened = NULL;
+    PyObject *fileno = NULL, *mmap_mod = NULL, *access = NULL, *mm = NULL;
+    PyObject *mmap_type = NULL, *mmap_args = NULL, *mmap_kwargs = NULL;
+    int path_like, status = -1;
+    char *data;
+    Py_ssize_t index_offset, count;
+    QuickleState *st = quickle_get_global_state();
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|$O", LogReader_init_kws,
+                                     &file, &decoder)) {
+        return -1;
+    }
+    if (decoder == NULL || decoder == Py_None) {
+        decoder = PyObject_CallObject((PyObject *)&Decoder_Type, NULL);
+        if (decoder == NULL)
+            return -1;
+    }
+    else if (PyObject_TypeCheck(decoder, &Decoder_Type)) {
+        Py_INCREF(decoder);
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "decoder must be a Decoder");
+        return -1;
+    }
+    Py_XSETREF(self->decoder, (DecoderObject *)decoder);
+
+    path_like = _is_path_like(file);
+    if (path_like < 0)
+        goto done;
+    if (path_like) {
+        opened = _open_path(file, "rb");
+        if (opened == NULL)
+            goto done;
+        file = opened;
+    }
+    fileno = PyObject_CallMethod(file, "fileno", NULL);
+    if (fileno == NULL)
+        goto done;
+    mmap_mod = PyImport_ImportModule("mmap");
+    if (mmap_mod == NULL)
+        goto done;
+    access = PyObject_GetAttrString(mmap_mod, "ACCESS_READ");
+    if (access == NULL)
+        goto done;
+    mmap_type = PyObject_GetAttrString(mmap_mod, "mmap");
+    if (mmap_type == NULL)
+        goto done;
+    mmap_args = Py_BuildValue("(Oi)", fileno, 0);
+    mmap_kwargs = Py_BuildValue("{sO}", "access", access);
+    if (mmap_args == NULL || mmap_kwargs == NULL)
+        goto done;
+    mm = PyObject_Call(mmap_type, mmap_args, mmap_kwargs);
+    if (mm == NULL) {
+        if (PyErr_ExceptionMatches(PyExc_ValueError)) {
+            /* Empty files can't be mapped */
+            PyErr_SetString(st->DecodingError, "Invalid quickle log");
+        }
+        goto done;
+    }
+    if (PyObject_GetBuffer(mm, &self->buffer, PyBUF_SIMPLE) < 0) {
+        self->buffer.buf = NULL;
+        goto done;
+    }
+
+    /* Validate the footer and index */
+    data = self->buffer.buf;
+    if (self->buffer.len < LOG_FOOTER_SIZE ||
+        memcmp(data + self->buffer.len - 8, LOG_MAGIC, 8) != 0) {
+        PyErr_SetString(st->DecodingError, "Invalid quickle log");
+        goto done;
+    }
+    index_offset = calc_binsize(data + self->buffer.len - LOG_FOOTER_SIZE, 8);
+    count = calc_binsize(data + self->buffer.len - LOG_FOOTER_SIZE + 8, 8);
+    if (index_offset < 0 || count < 0 ||
+        count > (self->buffer.len - LOG_FOOTER_SIZE) / 8 ||
+        index_offset != self->buffer.len - LOG_FOOTER_SIZE - count * 8) {
+        PyErr_SetString(st->DecodingError, "Invalid quickle log");
+        goto done;
+    }
+    self->index = data + index_offset;
+    self->index_offset = index_offset;
+    self->count = count;
+    Py_INCREF(mm);
+    Py_XSETREF(self->mmap, mm);
+    status = 0;
+
+done:
+    if (status < 0 && self->buffer.buf != NULL) {
+        PyBuffer_Release(&self->buffer);
+        self->buffer.buf = NULL;
+    }
+    if (status < 0) {
+        PyObject *exc_type, *exc_value, *exc_tb, *res;
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        if (mm != NULL) {
+            res = PyObject_CallMethod(mm, "close", NULL);
+            Py_XDECREF(res);
         }
-        if (obj == NULL) {
-            PyErr_Clear();
-            obj = CALL_ONE_ARG(typ, val);
+        if (opened != NULL) {
+            res = PyObject_CallMethod(opened, "close", NULL);
+            Py_XDECREF(res);
         }
+        PyErr_Restore(exc_type, exc_value, exc_tb);
     }
-    else {
-        obj = PyObject_GetAttr(typ, val);
-    }
-    Py_DECREF(val);
-    if (obj == NULL)
-        return -1;
-    STACK_PUSH(self, obj);
-    return 0;
+    else if (opened != NULL) {
+        /* The mapping remains valid after the file is closed */
+        PyObject *res = PyObject_CallMethod(opened, "close", NULL);
+        if (res == NULL)
+            status = -1;
+        Py_XDECREF(res);
+    }
+    Py_XDECREF(opened);
+    Py_XDECREF(fileno);
+    Py_XDECREF(mmap_mod);
+    Py_XDECREF(access);
+    Py_XDECREF(mmap_type);
+    Py_XDECREF(mmap_args);
+    Py_XDECREF(mmap_kwargs);
+    Py_XDECREF(mm);
+    return status;
 }
 
-/* No-op, unsupported opcodes will be detected elsewhere */
 static int
-load_proto(DecoderObject *self)
+_LogReader_check_open(LogReaderObject *self)
 {
-    char *s;
-    if (_Decoder_Read(self, &s, 1) < 0)
-        return -1;
-    return 0;
+    if (self->buffer.buf == NULL) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed log");
+        return 0;
+    }
+    return 1;
 }
 
-/* No-op, we ignore frame markers. Buffer is already in memory */
-static int
-load_frame(DecoderObject *self)
+static Py_ssize_t
+LogReader_len(LogReaderObject *self)
 {
-    char *s;
-    if (_Decoder_Read(self, &s, 8) < 0)
+    if (!_LogReader_check_open(self))
         return -1;
-    return 0;
+    return self->count;
 }
 
-static PyObject *
-load(DecoderObject *self)
+static PyObject*
+LogReader_item(LogReaderObject *self, Py_ssize_t i)
 {
-    PyObject *value = NULL;
-    char *s = NULL;
-
-    /* Convenient macros for the dispatch while-switch loop just below. */
-#define OP(opcode, load_func) \
-    case opcode: if (load_func(self) < 0) break; continue;
-
-#define OP_ARG(opcode, load_func, arg) \
-    case opcode: if (load_func(self, (arg)) < 0) break; continue;
-
-    while (1) {
-        if (_Decoder_Read(self, &s, 1) < 0) {
-            return NULL;
-        }
-
-        switch ((enum opcode)s[0]) {
-        OP(NONE, load_none)
-        OP(BININT, load_binint)
-        OP(BININT1, load_binint1)
-        OP(BININT2, load_binint2)
-        OP_ARG(LONG1, load_counted_long, 1)
-        OP_ARG(LONG4, load_counted_long, 4)
-        OP(BINFLOAT, load_binfloat)
-        OP_ARG(SHORT_BINBYTES, load_counted_binbytes, 1)
-        OP_ARG(BINBYTES, load_counted_binbytes, 4)
-        OP_ARG(BINBYTES8, load_counted_binbytes, 8)
-        OP(BYTEARRAY8, load_counted_bytearray)
-        OP(NEXT_BUFFER, load_next_buffer)
-        OP(READONLY_BUFFER, load_readonly_buffer)
-        OP_ARG(SHORT_BINUNICODE, load_counted_binunicode, 1)
-        OP_ARG(BINUNICODE, load_counted_binunicode, 4)
-        OP_ARG(BINUNICODE8, load_counted_binunicode, 8)
-        OP_ARG(EMPTY_TUPLE, load_counted_tuple, 0)
-        OP_ARG(TUPLE1, load_counted_tuple, 1)
-        OP_ARG(TUPLE2, load_counted_tuple, 2)
-        OP_ARG(TUPLE3, load_counted_tuple, 3)
-        OP(TUPLE, load_tuple)
-        OP(EMPTY_LIST, load_empty_list)
-        OP(EMPTY_DICT, load_empty_dict)
-        OP(EMPTY_SET, load_empty_set)
-        OP(ADDITEMS, load_additems)
-        OP(FROZENSET, load_frozenset)
-        OP(APPEND, load_append)
-        OP(APPENDS, load_appends)
-        OP(BINGET, load_binget)
-        OP(LONG_BINGET, load_long_binget)
-        OP(MARK, load_mark)
-        OP(MEMOIZE, load_memoize)
-        OP(POP, load_pop)
-        OP(POP_MARK, load_pop_mark)
-        OP(SETITEM, load_setitem)
-        OP(SETITEMS, load_setitems)
-        OP(BUILDSTRUCT, load_buildstruct)
-        OP_ARG(STRUCT1, load_struct, 1)
-        OP_ARG(STRUCT2, load_struct, 2)
-        OP_ARG(STRUCT4, load_struct, 4)
-        OP_ARG(ENUM1, load_enum, 1)
-        OP_ARG(ENUM2, load_enum, 2)
-        OP_ARG(ENUM4, load_enum, 4)
-        OP(COMPLEX, load_complex)
-        OP(TIMEDELTA, load_timedelta)
-        OP(DATE, load_date)
-        OP_ARG(TIME, load_time, 0)
-        OP_ARG(TIME_TZ, load_time, 1)
-        OP_ARG(DATETIME, load_datetime, 0)
-        OP_ARG(DATETIME_TZ, load_datetime, 1)
-        OP(TIMEZONE_UTC, load_timezone_utc)
-        OP(TIMEZONE, load_timezone)
-        OP(ZONEINFO, load_zoneinfo)
-        OP(PROTO, load_proto)
-        OP(FRAME, load_frame)
-        OP_ARG(NEWTRUE, load_bool, Py_True)
-        OP_ARG(NEWFALSE, load_bool, Py_False)
+    Py_ssize_t start, end, unused;
 
-        case STOP:
-            break;
-
-        default:
-            {
-                QuickleState *st = quickle_get_global_state();
-                unsigned char c = (unsigned char) *s;
-                if (0x20 <= c && c <= 0x7e && c != '\'' && c != '\\') {
-                    PyErr_Format(st->DecodingError,
-                                 "invalid load key, '%c'.", c);
-                }
-                else {
-                    PyErr_Format(st->DecodingError,
-                                 "invalid load key, '\\x%02x'.", c);
-                }
-                return NULL;
-            }
-        }
-
-        break;                  /* and we are done! */
+    if (!_LogReader_check_open(self))
+        return NULL;
+    if (i < 0 || i >= self->count) {
+        PyErr_SetString(PyExc_IndexError, "log index out of range");
+        return NULL;
     }
-
-    if (PyErr_Occurred()) {
+    start = calc_binsize((char *)self->index + i * 8, 8);
+    end = (
+        (i + 1 < self->count) ?
+        calc_binsize((char *)self->index + (i + 1) * 8, 8) :
+        self->index_offset
+    );
+    if (start < 0 || end < start || end > self->index_offset) {
+        QuickleState *st = quickle_get_global_state();
+        PyErr_SetString(st->DecodingError, "Invalid quickle log index");
         return NULL;
     }
-
-    STACK_POP(self, value);
-    return value;
+    /* Decoding is bounded by the end of the record */
+    return _Decoder_LoadAt(self->decoder, self->buffer.buf, end, start,
+                           NULL, &unused);
 }
 
+PyDoc_STRVAR(LogReader_close__doc__,
+"close(self)\n"
+"--\n"
+"\n"
+"Close the log, unmapping the file.\n"
+"\n"
+"Calling ``close`` more than once is allowed, and has no effect."
+);
 static PyObject*
-Decoder_sizeof(DecoderObject *self)
+LogReader_close(LogReaderObject *self, PyObject *unused)
 {
-    Py_ssize_t res;
+    PyObject *res;
 
-    res = sizeof(DecoderObject);
-    if (self->stack != NULL)
-        res += self->stack_allocated * sizeof(PyObject *);
-    if (self->memo != NULL)
-        res += self->memo_allocated * sizeof(PyObject *);
-    if (self->marks != NULL)
-        res += self->marks_allocated * sizeof(Py_ssize_t);
-    return PyLong_FromSsize_t(res);
+    if (self->buffer.buf == NULL)
+        Py_RETURN_NONE;
+    PyBuffer_Release(&self->buffer);
+    self->buffer.buf = NULL;
+    self->index = NULL;
+    self->count = 0;
+    res = PyObject_CallMethod(self->mmap, "close", NULL);
+    Py_CLEAR(self->mmap);
+    if (res == NULL)
+        return NULL;
+    Py_DECREF(res);
+    Py_RETURN_NONE;
 }
 
 static PyObject*
-Decoder_loads_internal(DecoderObject *self, PyObject *data, PyObject *buffers) {
-    PyObject *res = NULL;
-
-    if (PyObject_GetBuffer(data, &self->buffer, PyBUF_CONTIG_RO) < 0) {
-        goto cleanup;
-    }
-    self->input_buffer = self->buffer.buf;
-    self->input_len = self->buffer.len;
-    self->next_read_idx = 0;
-
-    if (buffers == NULL || buffers == Py_None) {
-        self->buffers = NULL;
-    }
-    else {
-        self->buffers = PyObject_GetIter(buffers);
-        if (self->buffers == NULL) {
-            goto cleanup;
-        }
-    }
+LogReader_enter(LogReaderObject *self, PyObject *unused)
+{
+    if (!_LogReader_check_open(self))
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
 
-    if (self->stack == NULL) {
-        self->stack_allocated = 8;
-        self->stack = PyMem_Malloc(self->stack_allocated * sizeof(PyObject *));
-        if (self->stack == NULL) {
-            PyErr_NoMemory();
-            goto cleanup;
-        }
-    }
-    if (self->memo == NULL) {
-        self->memo_allocated = 32;
-        self->memo = PyMem_Calloc(self->memo_allocated, sizeof(PyObject *));
-        if (self->memo == NULL) {
-            PyErr_NoMemory();
-            goto cleanup;
-        }
-    }
+static PyObject*
+LogReader_exit(LogReaderObject *self, PyObject *args)
+{
+    return LogReader_close(self, NULL);
+}
 
-    res = load(self);
+static PyObject*
+LogReader_get_closed(LogReaderObject *self, void *closure)
+{
+    return PyBool_FromLong(self->buffer.buf == NULL);
+}
 
-cleanup:
+static int
+LogReader_clear(LogReaderObject *self)
+{
     if (self->buffer.buf != NULL) {
         PyBuffer_Release(&self->buffer);
         self->buffer.buf = NULL;
-        self->input_buffer = NULL;
-    }
-    Py_CLEAR(self->buffers);
-    /* Reset stack, deallocates if allocation exceeded limit */
-    _Decoder_stack_clear(self, 0);
-    if (self->stack_allocated > self->reset_stack_size) {
-        PyMem_Free(self->stack);
-        self->stack = NULL;
-    }
-    /* Reset memo, deallocates if allocation exceeded limit */
-    _Decoder_memo_clear(self);
-    if (self->memo_allocated > self->reset_memo_size) {
-        PyMem_Free(self->memo);
-        self->memo = NULL;
-    }
-    /* Reset marks, deallocates if allocation exceeded limit */
-    self->marks_len = 0;
-    if (self->marks_allocated > self->reset_marks_size) {
-        PyMem_Free(self->marks);
-        self->marks = NULL;
     }
-    return res;
+    Py_CLEAR(self->mmap);
+    Py_CLEAR(self->decoder);
+    return 0;
 }
 
-static char *Decoder_loads_kws[] = {"buffers", NULL};
-
-PyDoc_STRVAR(Decoder_loads__doc__,
-"loads(self, data, *, buffers=None)\n"
-"--\n"
-"\n"
-"Deserialize an object from bytes.\n"
-"\n"
-"Parameters\n"
-"----------\n"
-"data : bytes\n"
-"    The serialized data\n"
-"buffers : iterable of bytes, optional\n"
-"    An iterable of out-of-band buffers generated by passing\n"
-"    ``collect_buffers=True`` to the corresponding `Encoder.dumps` call.\n"
-"\n"
-"Returns\n"
-"-------\n"
-"obj : object\n"
-"    The deserialized object"
-);
-static PyObject*
-Decoder_loads(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+static void
+LogReader_dealloc(LogReaderObject *self)
 {
-    PyObject *data = NULL;
-    PyObject *buffers = NULL;
-    QuickleState *st = quickle_get_global_state();
+    PyObject_GC_UnTrack(self);
+    LogReader_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
 
-    if (!check_positional_nargs(nargs, 1, 1)) {
-        return NULL;
-    }
-    data = args[0];
-    if (kwnames != NULL) {
-        if (!parse_keywords(kwnames, args + nargs, st->decoder_loads_kws, &buffers)) {
-            return NULL;
-        }
-    }
-    return Decoder_loads_internal(self, data, buffers);
+static int
+LogReader_traverse(LogReaderObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->decoder);
+    Py_VISIT(self->mmap);
+    return 0;
 }
 
-static struct PyMethodDef Decoder_methods[] = {
-    {
-        "loads", (PyCFunction) Decoder_loads, METH_FASTCALL | METH_KEYWORDS,
-        Decoder_loads__doc__,
-    },
+static struct PyMethodDef LogReader_methods[] = {
     {
-        "__sizeof__", (PyCFunction) Decoder_sizeof, METH_NOARGS,
-        PyDoc_STR("Size in bytes")
+        "close", (PyCFunction) LogReader_close, METH_NOARGS,
+        LogReader_close__doc__,
     },
+    {"__enter__", (PyCFunction) LogReader_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) LogReader_exit, METH_VARARGS, NULL},
     {NULL, NULL}                /* sentinel */
 };
 
-static PyTypeObject Decoder_Type = {
+static PyGetSetDef LogReader_getset[] = {
+    {"closed", (getter) LogReader_get_closed, NULL, "Whether the log is closed", NULL},
+    {NULL},
+};
+
+static PySequenceMethods LogReader_as_sequence = {
+    .sq_length = (lenfunc)LogReader_len,
+    .sq_item = (ssizeargfunc)LogReader_item,
+};
+
+static PyTypeObject LogReader_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "quickle.Decoder",
-    .tp_doc = Decoder__doc__,
-    .tp_basicsize = sizeof(DecoderObject),
-    .tp_dealloc = (destructor)Decoder_dealloc,
+    .tp_name = "quickle.LogReader",
+    .tp_doc = LogReader__doc__,
+    .tp_basicsize = sizeof(LogReaderObject),
+    .tp_dealloc = (destructor)LogReader_dealloc,
     .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
-    .tp_traverse = (traverseproc)Decoder_traverse,
-    .tp_clear = (inquiry)Decoder_clear,
+    .tp_traverse = (traverseproc)LogReader_traverse,
+    .tp_clear = (inquiry)LogReader_clear,
     .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Decoder_init,
-    .tp_methods = Decoder_methods,
+    .tp_init = (initproc) LogReader_init,
+    .tp_methods = LogReader_methods,
+    .tp_getset = LogReader_getset,
+    .tp_as_sequence = &LogReader_as_sequence,
 };
 
-
 /*************************************************************************
  * Module-level definitions                                              *
  *************************************************************************/
@@ -4725,7 +10606,7 @@ quickle_loads(PyObject *self, PyObject *args, PyObject *kwds)
     if (decoder == NULL) {
         return NULL;
     }
-    if (Decoder_init_internal(decoder, registry) == 0) {
+    if (Decoder_init_internal(decoder, registry, 0, 0) == 0) {
         res = Decoder_loads_internal(decoder, data, buffers);
     }
 
@@ -4752,14 +10633,31 @@ quickle_clear(PyObject *m)
     Py_CLEAR(st->QuickleError);
     Py_CLEAR(st->EncodingError);
     Py_CLEAR(st->DecodingError);
+    Py_CLEAR(st->BufferTooSmallError);
     Py_CLEAR(st->StructType);
     Py_CLEAR(st->EnumType);
     Py_CLEAR(st->TimeZoneType);
     Py_CLEAR(st->ZoneInfoType);
+    Py_CLEAR(st->ArrayType);
     Py_CLEAR(st->encoder_dumps_kws);
+    Py_CLEAR(st->encoder_dumps_into_kws);
+    Py_CLEAR(st->encoder_dumps_many_kws);
     Py_CLEAR(st->decoder_loads_kws);
+    Py_CLEAR(st->decoder_loads_at_kws);
     Py_CLEAR(st->value2member_map_str);
     Py_CLEAR(st->name_str);
+    Py_CLEAR(st->write_str);
+    Py_CLEAR(st->release_str);
+    Py_CLEAR(st->readinto_str);
+    Py_CLEAR(st->seek_str);
+    Py_CLEAR(st->seekable_str);
+    Py_CLEAR(st->needed_str);
+    Py_CLEAR(st->frombytes_str);
+    Py_CLEAR(st->byteswap_str);
+    Py_CLEAR(st->typecode_str);
+    Py_CLEAR(st->cast_str);
+    Py_CLEAR(st->toreadonly_str);
+    Py_CLEAR(st->byte_format_str);
     return 0;
 }
 
@@ -4776,10 +10674,12 @@ quickle_traverse(PyObject *m, visitproc visit, void *arg)
     Py_VISIT(st->QuickleError);
     Py_VISIT(st->EncodingError);
     Py_VISIT(st->DecodingError);
+    Py_VISIT(st->BufferTooSmallError);
     Py_VISIT(st->StructType);
     Py_VISIT(st->EnumType);
     Py_VISIT(st->TimeZoneType);
     Py_VISIT(st->ZoneInfoType);
+    Py_VISIT(st->ArrayType);
     return 0;
 }
 
@@ -4810,8 +10710,20 @@ PyInit_quickle(void)
 
     if (PyType_Ready(&Decoder_Type) < 0)
         return NULL;
+    if (PyType_Ready(&DecoderSession_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&DecoderIter_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&LogWriter_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&LogReader_Type) < 0)
+        return NULL;
     if (PyType_Ready(&Encoder_Type) < 0)
         return NULL;
+    if (PyType_Ready(&EncoderSession_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&StructArray_Type) < 0)
+        return NULL;
     StructMetaType.tp_base = &PyType_Type;
     if (PyType_Ready(&StructMetaType) < 0)
         return NULL;
@@ -4834,6 +10746,21 @@ PyInit_quickle(void)
     Py_INCREF(&Decoder_Type);
     if (PyModule_AddObject(m, "Decoder", (PyObject *)&Decoder_Type) < 0)
         return NULL;
+    Py_INCREF(&EncoderSession_Type);
+    if (PyModule_AddObject(m, "EncoderSession", (PyObject *)&EncoderSession_Type) < 0)
+        return NULL;
+    Py_INCREF(&DecoderSession_Type);
+    if (PyModule_AddObject(m, "DecoderSession", (PyObject *)&DecoderSession_Type) < 0)
+        return NULL;
+    Py_INCREF(&LogWriter_Type);
+    if (PyModule_AddObject(m, "LogWriter", (PyObject *)&LogWriter_Type) < 0)
+        return NULL;
+    Py_INCREF(&LogReader_Type);
+    if (PyModule_AddObject(m, "LogReader", (PyObject *)&LogReader_Type) < 0)
+        return NULL;
+    Py_INCREF(&StructArray_Type);
+    if (PyModule_AddObject(m, "StructArray", (PyObject *)&StructArray_Type) < 0)
+        return NULL;
     Py_INCREF(&PyPickleBuffer_Type);
     if (PyModule_AddObject(m, "PickleBuffer", (PyObject *)&PyPickleBuffer_Type) < 0)
         return NULL;
@@ -4900,6 +10827,21 @@ PyInit_quickle(void)
     st->ZoneInfoType = NULL;
 #endif
 
+    /* Get the array type */
+    temp_module = PyImport_ImportModule("array");
+    if (temp_module == NULL)
+        return NULL;
+    temp_type = PyObject_GetAttrString(temp_module, "array");
+    Py_DECREF(temp_module);
+    if (temp_type == NULL)
+        return NULL;
+    if (!PyType_Check(temp_type)) {
+        Py_DECREF(temp_type);
+        PyErr_SetString(PyExc_TypeError, "array.array should be a type");
+        return NULL;
+    }
+    st->ArrayType = (PyTypeObject *)temp_type;
+
     /* Initialize the exceptions. */
     st->QuickleError = PyErr_NewExceptionWithDoc(
         "quickle.QuickleError",
@@ -4924,6 +10866,16 @@ PyInit_quickle(void)
         );
     if (st->DecodingError == NULL)
         return NULL;
+    st->BufferTooSmallError = \
+        PyErr_NewExceptionWithDoc(
+            "quickle.BufferTooSmallError",
+            "The buffer passed to `Encoder.dumps_into` was too small to hold the\n"
+            "serialized object. The ``needed`` attribute holds the minimum buffer\n"
+            "size required.",
+            st->EncodingError, NULL
+        );
+    if (st->BufferTooSmallError == NULL)
+        return NULL;
 
     Py_INCREF(st->QuickleError);
     if (PyModule_AddObject(m, "QuickleError", st->QuickleError) < 0)
@@ -4934,20 +10886,68 @@ PyInit_quickle(void)
     Py_INCREF(st->DecodingError);
     if (PyModule_AddObject(m, "DecodingError", st->DecodingError) < 0)
         return NULL;
+    Py_INCREF(st->BufferTooSmallError);
+    if (PyModule_AddObject(m, "BufferTooSmallError", st->BufferTooSmallError) < 0)
+        return NULL;
 
     /* Initialize cached constant strings and tuples */
     st->encoder_dumps_kws = make_keyword_tuple(Encoder_dumps_kws);
     if (st->encoder_dumps_kws == NULL)
         return NULL;
+    st->encoder_dumps_into_kws = make_keyword_tuple(Encoder_dumps_into_kws);
+    if (st->encoder_dumps_into_kws == NULL)
+        return NULL;
+    st->encoder_dumps_many_kws = make_keyword_tuple(Encoder_dumps_many_kws);
+    if (st->encoder_dumps_many_kws == NULL)
+        return NULL;
     st->decoder_loads_kws = make_keyword_tuple(Decoder_loads_kws);
     if (st->decoder_loads_kws == NULL)
         return NULL;
+    st->decoder_loads_at_kws = make_keyword_tuple(Decoder_loads_at_kws);
+    if (st->decoder_loads_at_kws == NULL)
+        return NULL;
     st->value2member_map_str = PyUnicode_InternFromString("_value2member_map_");
     if (st->value2member_map_str == NULL)
         return NULL;
     st->name_str = PyUnicode_InternFromString("name");
     if (st->name_str == NULL)
         return NULL;
+    st->write_str = PyUnicode_InternFromString("write");
+    if (st->write_str == NULL)
+        return NULL;
+    st->release_str = PyUnicode_InternFromString("release");
+    if (st->release_str == NULL)
+        return NULL;
+    st->readinto_str = PyUnicode_InternFromString("readinto");
+    if (st->readinto_str == NULL)
+        return NULL;
+    st->seek_str = PyUnicode_InternFromString("seek");
+    if (st->seek_str == NULL)
+        return NULL;
+    st->seekable_str = PyUnicode_InternFromString("seekable");
+    if (st->seekable_str == NULL)
+        return NULL;
+    st->needed_str = PyUnicode_InternFromString("needed");
+    if (st->needed_str == NULL)
+        return NULL;
+    st->frombytes_str = PyUnicode_InternFromString("frombytes");
+    if (st->frombytes_str == NULL)
+        return NULL;
+    st->byteswap_str = PyUnicode_InternFromString("byteswap");
+    if (st->byteswap_str == NULL)
+        return NULL;
+    st->typecode_str = PyUnicode_InternFromString("typecode");
+    if (st->typecode_str == NULL)
+        return NULL;
+    st->cast_str = PyUnicode_InternFromString("cast");
+    if (st->cast_str == NULL)
+        return NULL;
+    st->toreadonly_str = PyUnicode_InternFromString("toreadonly");
+    if (st->toreadonly_str == NULL)
+        return NULL;
+    st->byte_format_str = PyUnicode_InternFromString("B");
+    if (st->byte_format_str == NULL)
+        return NULL;
 
     return m;
 }
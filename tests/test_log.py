@@ -0,0 +1,203 @@
+import io
+import struct
+
+import pytest
+
+import quickle
+
+
+class Point(quickle.Struct):
+    x: int
+    y: int
+
+
+RECORDS = [
+    1,
+    "two",
+    [3, 3.0],
+    {"four": b"4" * 10000},
+    None,
+    Point(1, 2),
+]
+
+
+def write_log(path, records, **kwargs):
+    with quickle.LogWriter(path, **kwargs) as writer:
+        for i, rec in enumerate(records):
+            assert writer.append(rec) == i
+        assert len(writer) == len(records)
+
+
+@pytest.mark.parametrize("n", [0, 1, len(RECORDS)])
+def test_log_roundtrip(tmp_path, n):
+    path = str(tmp_path / "test.log")
+    records = RECORDS[:n]
+    write_log(path, records, encoder=quickle.Encoder(registry=[Point]))
+
+    with quickle.LogReader(path, decoder=quickle.Decoder(registry=[Point])) as reader:
+        assert len(reader) == n
+        assert list(reader) == records
+        for i in range(n):
+            assert reader[i] == records[i]
+            assert reader[i - n] == records[i]
+        with pytest.raises(IndexError):
+            reader[n]
+        with pytest.raises(IndexError):
+            reader[-n - 1]
+
+
+def test_log_file_objects(tmp_path):
+    path = str(tmp_path / "test.log")
+    with open(path, "wb") as f:
+        f.write(b"header")
+        writer = quickle.LogWriter(f)
+        for rec in RECORDS[:5]:
+            writer.append(rec)
+        writer.close()
+        assert writer.closed
+        # Writer doesn't close files it didn't open
+        assert not f.closed
+
+    with open(path, "rb") as f:
+        reader = quickle.LogReader(f)
+    # Reader remains valid after the file is closed
+    assert list(reader) == RECORDS[:5]
+    reader.close()
+
+
+def test_log_format(tmp_path):
+    path = str(tmp_path / "test.log")
+    write_log(path, RECORDS[:3])
+    with open(path, "rb") as f:
+        data = f.read()
+    index_offset, count, magic = struct.unpack("<QQ8s", data[-24:])
+    assert magic == b"QUICKLOG"
+    assert count == 3
+    offsets = struct.unpack("<3Q", data[index_offset:-24])
+    assert offsets[0] == 0
+    for i, rec in enumerate(RECORDS[:3]):
+        end = offsets[i + 1] if i < 2 else index_offset
+        assert quickle.loads(data[offsets[i] : end]) == rec
+
+
+def test_log_writer_errors(tmp_path):
+    path = str(tmp_path / "test.log")
+
+    with pytest.raises(TypeError):
+        quickle.LogWriter(path, encoder=1)
+
+    writer = quickle.LogWriter(path)
+    writer.append(1)
+    with pytest.raises(TypeError):
+        writer.append(object())
+    # Failed appends don't corrupt the log
+    writer.append(2)
+    writer.close()
+    writer.close()
+    assert writer.closed
+
+    with pytest.raises(ValueError, match="closed"):
+        writer.append(3)
+
+    with pytest.raises(ValueError, match="closed"):
+        with writer:
+            pass
+
+    with quickle.LogReader(path) as reader:
+        assert list(reader) == [1, 2]
+
+
+def test_log_writer_failed_append_after_flush(tmp_path):
+    path = str(tmp_path / "test.log")
+    writer = quickle.LogWriter(path, encoder=quickle.Encoder(write_buffer_size=64))
+    writer.append([1, 2, 3])
+    # Part of this record is flushed to the file before the failure
+    with pytest.raises(TypeError):
+        writer.append(["x" * 10 for _ in range(100)] + [object()])
+    writer.append({"a": 1})
+    writer.close()
+
+    with quickle.LogReader(path) as reader:
+        assert list(reader) == [[1, 2, 3], {"a": 1}]
+
+
+def test_log_writer_unclosed_warns(tmp_path):
+    path = str(tmp_path / "test.log")
+    writer = quickle.LogWriter(path)
+    writer.append(1)
+    # An unclosed writer is closed when collected, and the log is complete
+    with pytest.warns(ResourceWarning, match="unclosed"):
+        del writer
+    with quickle.LogReader(path) as reader:
+        assert list(reader) == [1]
+
+
+def test_log_writer_tell_errors():
+    class NoTell(io.BytesIO):
+        def tell(self):
+            raise io.UnsupportedOperation("tell")
+
+    # Files that can't tell are assumed to start empty
+    f = NoTell()
+    with quickle.LogWriter(f) as writer:
+        writer.append(1)
+    data = f.getvalue()
+    assert struct.unpack("<QQ8s", data[-24:])[1] == 1
+
+    class BadTell(io.BytesIO):
+        def tell(self):
+            raise ValueError("Oh no")
+
+    with pytest.raises(ValueError, match="Oh no"):
+        quickle.LogWriter(BadTell())
+
+
+def test_log_path_like_errors():
+    class BadPath:
+        @property
+        def __fspath__(self):
+            raise ValueError("Oh no")
+
+    with pytest.raises(ValueError, match="Oh no"):
+        quickle.LogWriter(BadPath())
+    with pytest.raises(ValueError, match="Oh no"):
+        quickle.LogReader(BadPath())
+
+
+def test_log_reader_errors(tmp_path):
+    path = str(tmp_path / "test.log")
+
+    with pytest.raises(TypeError):
+        quickle.LogReader(path, decoder=1)
+
+    with pytest.raises(FileNotFoundError):
+        quickle.LogReader(path)
+
+    with pytest.raises(io.UnsupportedOperation):
+        quickle.LogReader(io.BytesIO(b"data"))
+
+    # Invalid logs
+    for data in [b"", b"short", b"not a log" * 10]:
+        with open(path, "wb") as f:
+            f.write(data)
+        with pytest.raises(quickle.DecodingError, match="Invalid"):
+            quickle.LogReader(path)
+
+    # Unclosed log has no index
+    with open(path, "wb") as f:
+        writer = quickle.LogWriter(f)
+        writer.append(1)
+        f.flush()
+        with pytest.raises(quickle.DecodingError, match="Invalid"):
+            quickle.LogReader(path)
+        writer.close()
+
+    write_log(path, [1, 2])
+    reader = quickle.LogReader(path)
+    reader.close()
+    reader.close()
+    assert reader.closed
+    with pytest.raises(ValueError, match="closed"):
+        reader[0]
+    with pytest.raises(ValueError, match="closed"):
+        len(reader)
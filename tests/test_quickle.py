@@ -1,7 +1,11 @@
+import array
+import ctypes
 import datetime
 import enum
 import gc
+import io
 import itertools
+import math
 import pickle
 import pickletools
 import string
@@ -113,6 +117,112 @@ def test_pickle_unicode_edgecases(value):
     check(value)
 
 
+@pytest.mark.parametrize("n", [2, 7, 8, 9, 31, 32, 33, 100])
+def test_loads_unicode_ascii_fast_path(n):
+    value = "".join(string.ascii_letters[i % 52] for i in range(n))
+    res = quickle.loads(quickle.dumps(value))
+    assert res == value
+    assert res.isascii()
+    # A single non-ascii character at any position takes the slow path
+    for i in range(n):
+        value2 = value[:i] + "\xe9" + value[i + 1 :]
+        assert quickle.loads(quickle.dumps(value2)) == value2
+
+
+@pytest.mark.parametrize("char", ["\xe9", "\u1234", "\ud800", "\U0001f600"])
+@pytest.mark.parametrize("n", [1, 15, 16, 17, 100, 5000])
+def test_dumps_unicode_non_ascii(char, n):
+    value = "".join(char if i % 3 == 0 else "x" for i in range(n))
+    expected = value.encode("utf-8", "surrogatepass")
+    for enc in [quickle.Encoder(), quickle.Encoder(write_buffer_size=32)]:
+        data = enc.dumps(value)
+        assert expected in data
+        assert quickle.loads(data) == value
+        f = io.BytesIO()
+        enc.dump(value, f)
+        assert f.getvalue() == data
+        buf = bytearray(len(data))
+        assert enc.dumps_into(value, memoryview(buf)) == len(data)
+        assert buf == data
+        with pytest.raises(quickle.BufferTooSmallError):
+            enc.dumps_into(value, memoryview(bytearray(len(data) - 1)))
+
+
+@pytest.mark.parametrize(
+    "value",
+    ["caf\xe9", "\xe9" * 1000, "\u4e2d\u6587" * 100, "\ud800", "a\u1234\xe9"],
+)
+def test_encoder_native_strings(value):
+    enc = quickle.Encoder(native_strings=True)
+    data = enc.dumps(value)
+    assert data[0] == 0xDC
+    if len(value) > 100:
+        assert len(data) < len(quickle.dumps(value))
+    res = quickle.loads(data)
+    assert res == value
+    assert hash(res) == hash(value)
+
+
+def test_encoder_native_strings_fallback():
+    enc = quickle.Encoder(native_strings=True)
+    # ASCII and UCS-4 strings are still written as utf-8
+    for value in ["", "ascii", "\U0001f600", "caf\xe9\U0001f600"]:
+        assert enc.dumps(value) == quickle.dumps(value)
+    # As are UCS-2 strings that are smaller as utf-8
+    for value in ["a" * 1000 + "\u4e2d", "ab\u4e2d"]:
+        assert enc.dumps(value) == quickle.dumps(value)
+
+
+def test_encoder_native_strings_shared():
+    enc = quickle.Encoder(native_strings=True, dedupe_strings=True)
+    a = "caf\xe9"
+    b = "".join(["caf", "\xe9"])
+    obj = [a, a, b, {"\u4e2d": a}]
+    data = enc.dumps(obj)
+    res = quickle.loads(data)
+    assert res == obj
+    assert res[0] is res[1] is res[2]
+    assert data.count("caf\xe9".encode("latin-1")) == 1
+
+
+def test_loads_native_strings():
+    little = sys.byteorder == "little"
+    # UCS-2 data is narrowed if all characters fit in UCS-1
+    for value in ["abc", "ab\xe9"]:
+        data = b"\xdc" + (b"\x02" if little else b"\x82") + bytes([len(value)])
+        data += value.encode("utf-16-le" if little else "utf-16-be") + b"."
+        res = quickle.loads(data)
+        assert res == value
+        assert hash(res) == hash(value)
+    # UCS-1 ASCII data
+    res = quickle.loads(b"\xdc\x01\x03abc.")
+    assert res == "abc"
+    assert res.isascii()
+
+
+def test_loads_native_strings_errors():
+    with pytest.raises(quickle.DecodingError, match="kind"):
+        quickle.loads(b"\xdc\x04\x01abcd.")
+    other = b"\x82" if sys.byteorder == "little" else b"\x02"
+    with pytest.raises(quickle.DecodingError, match="byte order"):
+        quickle.loads(b"\xdc" + other + b"\x01\x00\x01.")
+    with pytest.raises(quickle.DecodingError, match="truncated"):
+        quickle.loads(b"\xdc\x02\x05ab.")
+
+
+def test_dumps_unicode_doesnt_cache_utf8():
+    value = "caf\xe9 \u1234 \U0001f600" * 10
+    size = sys.getsizeof(value)
+    quickle.dumps(value)
+    assert sys.getsizeof(value) == size
+    # Strings with an existing utf-8 copy use it
+    as_utf8 = ctypes.pythonapi.PyUnicode_AsUTF8
+    as_utf8.restype = ctypes.c_char_p
+    as_utf8(ctypes.py_object(value))
+    assert sys.getsizeof(value) > size
+    assert quickle.loads(quickle.dumps(value)) == value
+
+
 @pytest.mark.parametrize("n", [0, 1, 5, 100, BATCHSIZE + 10])
 def test_pickle_set(n):
     check(set(range(n)))
@@ -432,6 +542,1345 @@ def test_loads_buffers_errors():
         quickle.loads(res, buffers=[])
 
 
+class ChunkRecorder:
+    """A file-like object that records every chunk passed to ``write``"""
+
+    def __init__(self):
+        self.chunks = []
+
+    def write(self, data):
+        self.chunks.append(bytes(data))
+
+    def getvalue(self):
+        return b"".join(self.chunks)
+
+
+@pytest.mark.parametrize("size", [0, 10, 1000, 100000])
+def test_encoder_dump(size):
+    obj = [{"x": i, "y": str(i), "z": b"a" * (i % 10)} for i in range(size)]
+    enc = quickle.Encoder(write_buffer_size=64)
+    f = ChunkRecorder()
+    assert enc.dump(obj, f) is None
+    assert f.getvalue() == enc.dumps(obj)
+    assert quickle.loads(f.getvalue()) == obj
+    # Output is written in chunks bounded by the buffer size
+    assert all(len(c) <= 64 for c in f.chunks)
+
+
+def test_encoder_dump_large_payloads_bypass_buffer():
+    obj = [b"x" * 1000, "y" * 1000, bytearray(b"z" * 1000), 1]
+    enc = quickle.Encoder(write_buffer_size=64)
+    f = ChunkRecorder()
+    enc.dump(obj, f)
+    assert f.getvalue() == enc.dumps(obj)
+    assert [len(c) for c in f.chunks if len(c) > 64] == [1000, 1000, 1000]
+
+
+def test_encoder_dump_to_file(tmp_path):
+    obj = {"a": list(range(10000)), "b": "hello" * 1000}
+    enc = quickle.Encoder()
+    path = str(tmp_path / "test.qkl")
+    with open(path, "wb") as f:
+        enc.dump(obj, f)
+        enc.dump(obj, f)
+    with open(path, "rb") as f:
+        data = f.read()
+    msg = enc.dumps(obj)
+    assert data == msg + msg
+
+
+def test_encoder_dump_collect_buffers():
+    pbuf = quickle.PickleBuffer(b"hello")
+    enc = quickle.Encoder()
+    f = io.BytesIO()
+    buffers = enc.dump([1, pbuf], f, collect_buffers=True)
+    assert buffers == [pbuf]
+    assert quickle.loads(f.getvalue(), buffers=buffers) == [1, pbuf]
+
+    f = io.BytesIO()
+    assert enc.dump("no buffers", f, collect_buffers=True) is None
+
+
+def test_encoder_dump_errors():
+    enc = quickle.Encoder(write_buffer_size=64)
+
+    with pytest.raises(TypeError, match="write"):
+        enc.dump(1, object())
+
+    with pytest.raises(TypeError):
+        enc.dump(1)
+
+    class BadFile:
+        def write(self, data):
+            raise ValueError("Oh no")
+
+    with pytest.raises(ValueError, match="Oh no"):
+        enc.dump(list(range(1000)), BadFile())
+
+    # A write that holds on to the temporary view can't observe the buffer
+    # being reused
+    class RetainingFile:
+        def __init__(self):
+            self.views = []
+
+        def write(self, data):
+            self.views.append(data)
+
+    f = RetainingFile()
+    enc.dump(list(range(1000)), f)
+    with pytest.raises(ValueError):
+        bytes(f.views[0])
+
+    # Encoder still works after errors
+    assert quickle.loads(enc.dumps([1, 2, 3])) == [1, 2, 3]
+
+
+def test_encoder_reentrant_calls_error():
+    enc = quickle.Encoder(write_buffer_size=64)
+    errors = []
+
+    class ReentrantFile:
+        def write(self, data):
+            for call in [
+                lambda: enc.dump(1, io.BytesIO()),
+                lambda: enc.dumps(1),
+                lambda: enc.dumps_into(1, bytearray()),
+                lambda: enc.dumps_many([1]),
+                lambda: enc.__init__(),
+            ]:
+                with pytest.raises(RuntimeError, match="already in use") as rec:
+                    call()
+                errors.append(rec.value)
+
+    msg = list(range(1000))
+    enc.dump(msg, ReentrantFile())
+    assert len(errors) > 0
+
+    # Encoder still works after errors
+    assert quickle.loads(enc.dumps(msg)) == msg
+    f = io.BytesIO()
+    enc.dump(msg, f)
+    assert quickle.loads(f.getvalue()) == msg
+
+
+@pytest.mark.parametrize("offset", [0, 5])
+@pytest.mark.parametrize("size", [0, 10, 1000])
+def test_encoder_dumps_into_bytearray(size, offset):
+    obj = [{"x": i, "y": str(i), "z": b"a" * (i % 10)} for i in range(size)]
+    enc = quickle.Encoder(write_buffer_size=64)
+    expected = enc.dumps(obj)
+
+    # Buffer is grown as needed
+    buf = bytearray(b"-" * offset)
+    n = enc.dumps_into(obj, buf, offset)
+    assert n == len(expected)
+    assert buf == b"-" * offset + expected
+
+    # Larger buffers are left as is
+    buf = bytearray(b"-" * (offset + len(expected) + 10))
+    n = enc.dumps_into(obj, buf, offset=offset)
+    assert n == len(expected)
+    assert buf[:offset] == b"-" * offset
+    assert buf[offset : offset + n] == expected
+    assert buf[offset + n :] == b"-" * 10
+
+
+@pytest.mark.parametrize("offset", [0, 5])
+def test_encoder_dumps_into_fixed_buffer(offset):
+    obj = {"x": list(range(100)), "y": b"a" * 100}
+    enc = quickle.Encoder()
+    expected = enc.dumps(obj)
+    needed = offset + len(expected)
+
+    buf = bytearray(needed + 10)
+    view = memoryview(buf)
+    n = enc.dumps_into(obj, view, offset)
+    assert n == len(expected)
+    assert buf[offset : offset + n] == expected
+
+    # Exact fit
+    buf = bytearray(needed)
+    assert enc.dumps_into(obj, memoryview(buf), offset) == len(expected)
+    assert buf[offset:] == expected
+
+    # Too small
+    for size in [offset, offset + 1, needed - 1]:
+        with pytest.raises(quickle.BufferTooSmallError) as rec:
+            enc.dumps_into(obj, memoryview(bytearray(size)), offset)
+        assert rec.value.needed == needed
+        assert isinstance(rec.value, quickle.EncodingError)
+
+    # Encoder still works after errors
+    assert enc.dumps(obj) == expected
+
+
+def test_encoder_dumps_into_collect_buffers():
+    enc = quickle.Encoder(collect_buffers=True)
+    pbuf = quickle.PickleBuffer(b"hello")
+    buf = bytearray()
+    n, buffers = enc.dumps_into([1, pbuf], buf)
+    assert n == len(buf)
+    assert buffers == [pbuf]
+    assert quickle.loads(buf, buffers=[b"hello"]) == [1, b"hello"]
+
+    n, buffers = enc.dumps_into(1, buf)
+    assert buffers is None
+
+    n = enc.dumps_into([1, pbuf], buf, collect_buffers=False)
+    assert quickle.loads(buf[:n]) == [1, b"hello"]
+
+
+def test_encoder_dumps_into_errors():
+    enc = quickle.Encoder()
+
+    with pytest.raises(BufferError):
+        enc.dumps_into(1, b"readonly bytes")
+
+    with pytest.raises(TypeError):
+        enc.dumps_into(1, object())
+
+    with pytest.raises(TypeError):
+        enc.dumps_into(1)
+
+    with pytest.raises(TypeError):
+        enc.dumps_into(1, bytearray(), 0, offset=0)
+
+    with pytest.raises(ValueError):
+        enc.dumps_into(1, bytearray(), -1)
+
+    with pytest.raises(ValueError):
+        enc.dumps_into(1, bytearray(10), 11)
+
+    with pytest.raises(ValueError, match="bytearray"):
+        buf = bytearray(10)
+        enc.dumps_into([buf], buf)
+
+    # Can't resize a bytearray with an active export
+    buf = bytearray()
+    view = memoryview(buf)  # noqa
+    with pytest.raises(BufferError):
+        enc.dumps_into(list(range(100)), buf)
+
+    # User code run mid-encode can't resize the bytearray being written to
+    buf = bytearray(4)
+
+    class Resizer:
+        def __eq__(self, other):
+            buf.extend(b"x" * 100000)
+            return False
+
+    class Resizing(quickle.Struct):
+        x: object = Resizer()
+
+    enc2 = quickle.Encoder(registry=[Resizing], omit_defaults=True, memoize=False)
+    with pytest.raises(BufferError):
+        enc2.dumps_into([list(range(100)), Resizing(Resizer())], buf)
+    assert enc2.dumps_into(list(range(100)), buf) > 4
+
+    # Encoder still works after errors
+    assert quickle.loads(enc.dumps([1, 2, 3])) == [1, 2, 3]
+
+
+@pytest.mark.parametrize("memoize", [True, False])
+def test_encoder_dumps_many(memoize):
+    shared = ["shared"]
+    objs = [1, "two", [shared, shared], {"x": [1, 2, 3]}, b"a" * 10000, None]
+    enc = quickle.Encoder(memoize=memoize)
+    data, offsets = enc.dumps_many(objs)
+    assert len(offsets) == len(objs) + 1
+    assert offsets[0] == 0
+    assert offsets[-1] == len(data)
+    for i, obj in enumerate(objs):
+        msg = data[offsets[i] : offsets[i + 1]]
+        # Each message is independent
+        assert quickle.loads(msg) == obj
+
+    # Accepts any iterable
+    data2, offsets2 = enc.dumps_many(iter(objs))
+    assert len(offsets2) == len(objs) + 1
+    for i, obj in enumerate(objs):
+        assert quickle.loads(data2[offsets2[i] : offsets2[i + 1]]) == obj
+
+    # Empty
+    assert enc.dumps_many([]) == (b"", [0])
+
+
+def test_encoder_dumps_many_memo_reset():
+    enc = quickle.Encoder()
+    shared = ["shared"]
+    data, offsets = enc.dumps_many([[shared, shared], [shared, shared]])
+    assert data[: offsets[1]] == data[offsets[1] :]
+
+
+def test_encoder_dumps_many_errors():
+    enc = quickle.Encoder()
+
+    with pytest.raises(TypeError):
+        enc.dumps_many(1)
+
+    with pytest.raises(TypeError):
+        enc.dumps_many([1], collect_buffers=True)
+
+    with pytest.raises(TypeError, match="doesn't support"):
+        enc.dumps_many([1, object(), 3])
+
+    # Encoder still works after errors
+    assert enc.dumps_many([1]) == (enc.dumps(1), [0, len(enc.dumps(1))])
+
+
+def test_decoder_loads_at():
+    objs = [1, "two", [3, 3.0], {"four": b"4" * 1000}, None]
+    data, offsets = quickle.Encoder().dumps_many(objs)
+    data = b"prefix" + data
+    dec = quickle.Decoder()
+
+    offset = 6
+    for i, obj in enumerate(objs):
+        res, offset = dec.loads_at(data, offset)
+        assert res == obj
+        assert offset == offsets[i + 1] + 6
+
+    # offset as a keyword, and other buffer types
+    assert dec.loads_at(memoryview(data), offset=6) == (1, offsets[1] + 6)
+    assert dec.loads_at(bytearray(data[6:])) == (1, offsets[1])
+
+
+def test_decoder_loads_at_errors():
+    dec = quickle.Decoder()
+    data = quickle.dumps([1, 2, 3])
+
+    for offset in [-1, len(data) + 1]:
+        with pytest.raises(ValueError, match="out of bounds"):
+            dec.loads_at(data, offset)
+
+    with pytest.raises(quickle.DecodingError):
+        dec.loads_at(data, len(data))
+
+    with pytest.raises(quickle.DecodingError):
+        dec.loads_at(data[:-2])
+
+    with pytest.raises(TypeError):
+        dec.loads_at(data, 0, offset=0)
+
+    with pytest.raises(TypeError):
+        dec.loads_at(data, "bad")
+
+    # Decoder still works after errors
+    assert dec.loads_at(data) == ([1, 2, 3], len(data))
+
+
+def test_decoder_iter_loads():
+    objs = [1, "two", [3, 3.0], {"four": b"4" * 1000}, None]
+    data, _ = quickle.Encoder().dumps_many(objs)
+    dec = quickle.Decoder()
+
+    it = dec.iter_loads(data)
+    assert iter(it) is it
+    assert list(it) == objs
+    assert list(it) == []
+
+    assert list(dec.iter_loads(b"")) == []
+    assert list(dec.iter_loads(bytearray(data))) == objs
+
+    # The buffer is released once the iterator is exhausted or deleted
+    buf = bytearray(data)
+    it = dec.iter_loads(buf)
+    next(it)
+    with pytest.raises(BufferError):
+        buf.append(0)
+    del it
+    buf.append(0)
+
+
+def test_decoder_iter_loads_errors():
+    dec = quickle.Decoder()
+
+    with pytest.raises(TypeError):
+        dec.iter_loads(1)
+
+    data = quickle.dumps(1) + quickle.dumps([1, 2, 3])[:-2]
+    it = dec.iter_loads(data)
+    assert next(it) == 1
+    with pytest.raises(quickle.DecodingError):
+        next(it)
+    # Iteration stops after an error
+    assert list(it) == []
+
+
+def test_decoder_string_cache():
+    dec = quickle.Decoder(string_cache_size=64)
+    msgs = [{"name": "alice", "x" * 64: 1, "x" * 65: 2, "éé": 3} for _ in range(2)]
+    data = [quickle.dumps(m) for m in msgs]
+    a = dec.loads(data[0])
+    b = dec.loads(data[1])
+    assert a == b == msgs[0]
+    ka = {k: k for k in a}
+    kb = {k: k for k in b}
+    # Short ASCII strings are shared across calls
+    assert ka["name"] is kb["name"]
+    assert a["name"] is not None and a["name"] == "alice"
+    assert ka["x" * 64] is kb["x" * 64]
+    # Long and non-ASCII strings aren't cached
+    assert ka["x" * 65] is not kb["x" * 65]
+    assert ka["éé"] is not kb["éé"]
+
+    # Collisions and empty strings are handled
+    dec = quickle.Decoder(string_cache_size=1)
+    strs = ["", "a", "b", "ab", "ba", "a", ""]
+    assert dec.loads(quickle.dumps(strs)) == strs
+    assert dec.loads(quickle.dumps(strs)) == strs
+
+    # Disabled by default
+    dec = quickle.Decoder()
+    a = dec.loads(quickle.dumps("hello"))
+    b = dec.loads(quickle.dumps("hello"))
+    assert a == b and a is not b
+
+
+def test_decoder_string_cache_errors():
+    with pytest.raises(ValueError):
+        quickle.Decoder(string_cache_size=-1)
+
+    with pytest.raises(TypeError):
+        quickle.Decoder(string_cache_size="bad")
+
+    a = sys.getsizeof(quickle.Decoder())
+    b = sys.getsizeof(quickle.Decoder(string_cache_size=1024))
+    assert b > a
+
+
+def test_decoder_reinit_releases_state():
+    dec = quickle.Decoder(string_cache_size=64)
+    s = dec.loads(quickle.dumps("".join(["hel", "lo"])))
+    before = sys.getrefcount(s)
+    dec.__init__(string_cache_size=64)
+    # The old string cache is released
+    assert sys.getrefcount(s) == before - 1
+    assert dec.loads(quickle.dumps("hello")) == "hello"
+
+
+def test_encoder_reinit_releases_state():
+    key = "".join(["dictionary", "-key"])
+    before = sys.getrefcount(key)
+    enc = quickle.Encoder(dedupe_strings=True, dictionary=[key])
+    for _ in range(10):
+        enc.__init__(dedupe_strings=True, dictionary=[key])
+    del enc
+    assert sys.getrefcount(key) == before
+    enc = quickle.Encoder(dedupe_strings=True)
+    enc.__init__(dedupe_strings=True)
+    assert quickle.loads(enc.dumps([key, key])) == [key, key]
+
+
+def test_encoder_dedupe_strings():
+    # Build equal but distinct strings, as a JSON parser would
+    def make(s):
+        return "".join(list(s))
+
+    msg = [{make("key"): make("value"), make("other"): make("key")} for _ in range(50)]
+    assert msg[0]["key"] is not msg[1]["key"]
+
+    plain = quickle.Encoder().dumps(msg)
+    enc = quickle.Encoder(dedupe_strings=True)
+    deduped = enc.dumps(msg)
+    assert len(deduped) < len(plain) / 2
+    res = quickle.loads(deduped)
+    assert res == msg
+    # Repeated values decode to the same object
+    assert res[0]["key"] is res[1]["key"]
+    # Compatible with pickle
+    assert pickle.loads(deduped) == msg
+
+    # Bytes aren't deduped unless requested
+    bmsg = [b"x" * 100 + str(i % 2).encode() for i in range(10)]
+    assert len(enc.dumps(bmsg)) > 1000
+    enc2 = quickle.Encoder(dedupe_bytes=True)
+    out = enc2.dumps(bmsg)
+    assert len(out) < 300
+    assert quickle.loads(out) == bmsg
+
+    # Strings and bytes with equal contents are kept distinct
+    enc3 = quickle.Encoder(dedupe_strings=True, dedupe_bytes=True)
+    assert quickle.loads(enc3.dumps(["ab", b"ab", make("ab"), b"a" + b"b"])) == [
+        "ab",
+        b"ab",
+        "ab",
+        b"ab",
+    ]
+
+    # Only applies within a message
+    assert quickle.loads(enc.dumps(msg)) == msg
+    out, offsets = enc.dumps_many([msg[:1], msg[:1]])
+    assert out[: offsets[1]] == out[offsets[1] :]
+
+    # No effect if memoization is disabled
+    assert enc.dumps(msg, memoize=False) == quickle.dumps(msg, memoize=False)
+
+
+@pytest.mark.parametrize(
+    "values",
+    [
+        list(range(-100, 100)),
+        list(range(-30000, 30000, 7)),
+        [-(2 ** 31), 2 ** 31 - 1] * 5,
+        [-(2 ** 63), 2 ** 63 - 1] * 5,
+        [0, 1, 2, 3, 4, 5, 6, 2 ** 40],
+        [i / 3 for i in range(1000)],
+        [float("inf"), float("-inf"), -0.0, 1e300, 5e-324, 0.5, 1.5, 2.5],
+        [True, False, False, True] * 100,
+    ],
+)
+def test_encoder_packed_lists(values):
+    enc = quickle.Encoder(packed_lists=True)
+    data = enc.dumps(values)
+    res = quickle.loads(data)
+    assert res == values
+    assert [type(x) for x in res] == [type(x) for x in values]
+
+
+def test_encoder_packed_lists_size():
+    enc = quickle.Encoder(packed_lists=True)
+    values = [i / 3 for i in range(1000)]
+    assert len(enc.dumps(values)) < 8100
+    assert len(quickle.dumps(values)) > 9000
+    # Small ints are packed in a single byte each
+    assert len(enc.dumps([i % 100 for i in range(1000)])) < 1100
+
+
+def test_encoder_packed_lists_nan():
+    values = [float("nan")] * 10
+    res = quickle.loads(quickle.Encoder(packed_lists=True).dumps(values))
+    assert all(math.isnan(x) for x in res)
+
+
+@pytest.mark.parametrize(
+    "values",
+    [
+        [1, 2, 3, 4, 5, 6, 7, 2 ** 64],
+        [1, 2, 3, 4, 5, 6, 7, 8.0],
+        [1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8],
+        [True, False, True, False, True, False, True, 1],
+        [1, 2, 3, 4, 5, 6, 7, True],
+        [1, 2, 3, 4, 5, 6, 7, "eight"],
+        [1, 2, 3],
+    ],
+)
+def test_encoder_packed_lists_fallback(values):
+    enc = quickle.Encoder(packed_lists=True)
+    res = quickle.loads(enc.dumps(values))
+    assert res == values
+    assert [type(x) for x in res] == [type(x) for x in values]
+
+
+def test_loads_packed_lists_errors():
+    with pytest.raises(quickle.DecodingError, match="width"):
+        quickle.loads(b"\xc1\x03" + b"\x01" + b"\x00" * 7 + b"abc.")
+    # Truncated
+    for op in [b"\xc1\x08", b"\xc2", b"\xc3"]:
+        with pytest.raises(quickle.DecodingError):
+            quickle.loads(op + b"\x10" + b"\x00" * 7 + b"abc.")
+    # Overflow
+    with pytest.raises((OverflowError, quickle.DecodingError)):
+        quickle.loads(b"\xc2" + b"\xff" * 8 + b".")
+
+
+def test_encoder_packed_lists_memoized():
+    x = list(range(100))
+    enc = quickle.Encoder(packed_lists=True)
+    a, b = quickle.loads(enc.dumps([x, x]))
+    assert a == x and a is b
+
+    # Works when streaming and writing into a fixed buffer
+    f = io.BytesIO()
+    enc.dump([x, x], f)
+    assert quickle.loads(f.getvalue()) == [x, x]
+    buf = bytearray(10)
+    n = enc.dumps_into([x, x], buf)
+    assert quickle.loads(buf[:n]) == [x, x]
+
+
+@pytest.mark.parametrize("typecode", array.typecodes)
+@pytest.mark.parametrize("size", [0, 1, 1000])
+def test_pickle_array(typecode, size):
+    if typecode == "u":
+        x = array.array("u", "abc" * 1000)[:size]
+    else:
+        x = array.array(typecode, [i % 100 for i in range(size)])
+    res = quickle.loads(quickle.dumps(x))
+    assert type(res) is array.array
+    assert res.typecode == typecode
+    assert res == x
+
+
+def test_pickle_array_memoized():
+    x = array.array("d", [1.5, 2.5])
+    a, b = quickle.loads(quickle.dumps([x, x]))
+    assert a == x and a is b
+
+
+def test_encoder_array_streaming():
+    x = array.array("q", range(10000))
+    enc = quickle.Encoder(write_buffer_size=64)
+    f = io.BytesIO()
+    enc.dump([x, 1], f)
+    assert quickle.loads(f.getvalue()) == [x, 1]
+    f.seek(0)
+    dec = quickle.Decoder(read_buffer_size=64)
+    assert dec.load(ChunkedReader(f.getvalue(), 100)) == [x, 1]
+
+
+def test_encoder_array_collect_buffers():
+    x = array.array("i", range(100))
+    y = array.array("f", [1.0, 2.0])
+    enc = quickle.Encoder(collect_buffers=True)
+    data, buffers = enc.dumps([x, y, x])
+    assert len(buffers) == 2
+    assert bytes(buffers[0]) == x.tobytes()
+    res = quickle.loads(data, buffers=buffers)
+    assert res == [x, y, x]
+    assert res[0] is res[2]
+    assert res[0].typecode == "i"
+    # The decoded array owns its data
+    x[0] = 100
+    assert res[0][0] == 0
+
+    # Buffers may be passed as any bytes-like object
+    res = quickle.loads(data, buffers=[x.tobytes(), bytearray(y.tobytes())])
+    assert res == [x, y, x]
+
+    with pytest.raises(quickle.DecodingError, match="buffers"):
+        quickle.loads(data)
+
+
+def test_loads_array_byteswapped():
+    x = array.array("i", [1, 2, 3])
+    data = bytearray(quickle.dumps(x))
+    assert data[:2] == b"\xc4i"
+    # Flip the endianness flag, data is byteswapped on decode
+    data[2] ^= 0x80
+    res = quickle.loads(data)
+    x.byteswap()
+    assert res == x
+
+
+def test_loads_array_errors():
+    x = array.array("i", [1, 2, 3])
+    data = quickle.dumps(x)
+    assert data[:2] == b"\xc4i"
+    # Unknown typecode
+    with pytest.raises(quickle.DecodingError, match="typecode"):
+        quickle.loads(data[:1] + b"z" + data[2:])
+    # Mismatched itemsize
+    with pytest.raises(quickle.DecodingError, match="itemsize"):
+        quickle.loads(data[:2] + b"\x03" + data[3:])
+    # Truncated
+    with pytest.raises(quickle.DecodingError):
+        quickle.loads(data[:-3])
+    # Size not a multiple of itemsize
+    with pytest.raises(quickle.DecodingError, match="multiple of itemsize"):
+        quickle.loads(b"\xc4i\x04\x03" + b"\x00" * 7 + b"abc.")
+    with pytest.raises(quickle.DecodingError, match="multiple of itemsize"):
+        quickle.loads(b"\x97\xc5i\x04.", buffers=[b"abc"])
+    # Out-of-band array with nothing on the stack
+    with pytest.raises(quickle.DecodingError):
+        quickle.loads(b"\xc5i\x04.")
+
+
+def check_memoryview(res, x):
+    assert type(res) is memoryview
+    assert res.format == x.format.lstrip("@")
+    assert res.shape == x.shape
+    assert res.readonly == x.readonly
+    assert res.tolist() == x.tolist()
+
+
+@pytest.mark.parametrize(
+    "format, shape",
+    [
+        ("B", (10,)),
+        ("d", (2, 3)),
+        ("f", (2, 3, 4)),
+        ("i", ()),
+        ("q", (0,)),
+        ("?", (4,)),
+        ("@h", (2, 2)),
+    ],
+)
+@pytest.mark.parametrize("readonly", [False, True])
+def test_pickle_memoryview(format, shape, readonly):
+    itemsize = memoryview(bytes(8)).cast(format.lstrip("@")).itemsize
+    n = math.prod(shape) * itemsize
+    base = bytearray(i % 2 for i in range(n))
+    if readonly:
+        base = bytes(base)
+    x = memoryview(base).cast(format)
+    if len(shape) != 1:
+        x = x.cast("B").cast(format, shape)
+    res = quickle.loads(quickle.dumps(x))
+    check_memoryview(res, x)
+
+    # Out-of-band
+    data, buffers = quickle.dumps(x, collect_buffers=True)
+    res = quickle.loads(data, buffers=buffers)
+    check_memoryview(res, x)
+
+
+@pytest.mark.parametrize("shape", [(24,), (4, 6)])
+def test_pickle_memoryview_non_contiguous(shape):
+    x = memoryview(bytearray(range(24))).cast("B", shape)[::2]
+    assert not x.c_contiguous
+    res = quickle.loads(quickle.dumps(x))
+    check_memoryview(res, x)
+    data, buffers = quickle.dumps(x, collect_buffers=True)
+    check_memoryview(quickle.loads(data, buffers=buffers), x)
+
+
+def test_loads_memoryview_zero_copy():
+    x = memoryview(bytes(range(24))).cast("i", (2, 3))
+    data = quickle.dumps(x)
+    res = quickle.loads(data)
+    check_memoryview(res, x)
+    assert res.obj is data
+
+    # Mutable inputs are copied
+    res = quickle.loads(bytearray(data))
+    check_memoryview(res, x)
+    assert res.obj is not data
+
+    # Out-of-band data shares memory with the passed buffer
+    y = memoryview(bytearray(range(24))).cast("i", (2, 3))
+    data, buffers = quickle.dumps(y, collect_buffers=True)
+    buf = bytearray(bytes(buffers[0]))
+    res = quickle.loads(data, buffers=[buf])
+    check_memoryview(res, y)
+    buf[:4] = b"\xff\xff\xff\xff"
+    assert res[0, 0] == -1
+
+    # Read-only views of writable out-of-band buffers are read-only
+    z = memoryview(bytes(range(24))).cast("i", (2, 3))
+    data, buffers = quickle.dumps(z, collect_buffers=True)
+    buf = bytearray(bytes(buffers[0]))
+    res = quickle.loads(data, buffers=[buf])
+    check_memoryview(res, z)
+    assert res.readonly
+    with pytest.raises(TypeError):
+        res[0, 0] = 1
+    buf[:4] = b"\xff\xff\xff\xff"
+    assert res[0, 0] == -1
+    assert not memoryview(buf).readonly
+
+
+def test_pickle_memoryview_memoized():
+    x = memoryview(bytes(8)).cast("d")
+    a, b = quickle.loads(quickle.dumps([x, x]))
+    assert a is b
+
+
+def test_pickle_memoryview_errors():
+    # Only native single character formats are supported
+    x = memoryview((ctypes.c_int * 3)())
+    assert x.format == "<i"
+    with pytest.raises(quickle.EncodingError, match="format"):
+        quickle.dumps(x)
+
+    # Multi-dimensional empty views can't be rebuilt on decode
+    x = memoryview(bytes(24)).cast("B", (4, 6))[:0]
+    with pytest.raises(quickle.EncodingError, match="shape"):
+        quickle.dumps(x)
+
+    x = memoryview(bytearray(8))
+    x.release()
+    with pytest.raises(ValueError):
+        quickle.dumps(x)
+
+    x = memoryview(bytes(range(24))).cast("i", (2, 3))
+    data = quickle.dumps(x)
+    # Mismatched itemsize
+    with pytest.raises(quickle.DecodingError, match="itemsize"):
+        quickle.loads(data[:3] + b"\x08" + data[4:])
+    # Invalid format
+    with pytest.raises(quickle.DecodingError, match="format"):
+        quickle.loads(data[:2] + b"z" + data[3:])
+    # Size doesn't match shape
+    with pytest.raises(quickle.DecodingError, match="size"):
+        quickle.loads(data[:5] + b"\x03" + data[6:])
+    # Truncated
+    with pytest.raises(quickle.DecodingError):
+        quickle.loads(data[:-3])
+
+    data, buffers = quickle.dumps(x, collect_buffers=True)
+    with pytest.raises(quickle.DecodingError, match="size"):
+        quickle.loads(data, buffers=[bytes(8)])
+
+
+INT64_VALUES = [
+    0,
+    1,
+    -1,
+    63,
+    -64,
+    255,
+    256,
+    -129,
+    60000,
+    65535,
+    2 ** 30,
+    -(2 ** 30),
+    2 ** 31 - 1,
+    2 ** 31,
+    -(2 ** 31) - 1,
+    2 ** 55 - 1,
+    2 ** 55,
+    -(2 ** 55) - 1,
+    2 ** 63 - 1,
+    -(2 ** 63),
+    1_600_000_000_000_000_000,
+]
+
+
+@pytest.mark.parametrize("x", INT64_VALUES)
+def test_encoder_varints(x):
+    enc = quickle.Encoder(varints=True)
+    data = enc.dumps(x)
+    res = quickle.loads(data)
+    assert res == x
+    assert type(res) is int
+    # Never larger than the pickle compatible encoding
+    assert len(data) <= len(quickle.dumps(x))
+    # The BININT ops are kept on ties
+    if -(2 ** 31) <= x < 2 ** 31 and len(data) == len(quickle.dumps(x)):
+        assert data == quickle.dumps(x)
+
+
+@pytest.mark.parametrize("x", [2 ** 63, -(2 ** 63) - 1, 2 ** 100, -(2 ** 100)])
+def test_encoder_varints_fallback(x):
+    enc = quickle.Encoder(varints=True)
+    assert quickle.loads(enc.dumps(x)) == x
+
+
+def test_encoder_varints_size():
+    enc = quickle.Encoder(varints=True)
+    assert len(enc.dumps(-1)) == 3
+    assert len(enc.dumps(1000)) == 4
+    assert len(enc.dumps(2 ** 40)) == 8
+    assert len(enc.dumps(2 ** 62)) == 10
+    ids = [2 ** 40 + i for i in range(100)]
+    assert len(enc.dumps(ids)) < len(quickle.dumps(ids))
+
+
+@pytest.mark.parametrize("x", INT64_VALUES + [2 ** 63, -(2 ** 63) - 1])
+def test_loads_long1_fast_path(x):
+    assert quickle.loads(pickle.dumps(x, protocol=5)) == x
+
+
+def test_loads_varint_errors():
+    # Truncated
+    with pytest.raises(quickle.DecodingError):
+        quickle.loads(b"\xc8\x80\x80")
+    with pytest.raises(quickle.DecodingError):
+        quickle.loads(b"\xc9\x00\x00")
+    # Too long
+    with pytest.raises(quickle.DecodingError, match="64 bits"):
+        quickle.loads(b"\xc8" + b"\xff" * 9 + b"\x02.")
+    assert quickle.loads(b"\xc8" + b"\xff" * 9 + b"\x01.") == -(2 ** 63)
+
+
+@pytest.mark.parametrize("n", [0, 1, 2, 100, BATCHSIZE + 10])
+def test_encoder_counted_containers(n):
+    enc = quickle.Encoder(counted_containers=True)
+    for obj in [
+        list(range(n)),
+        {str(i): i for i in range(n)},
+        set(range(n)),
+        [list(range(n)), {"a": list(range(n))}],
+    ]:
+        assert quickle.loads(enc.dumps(obj)) == obj
+
+    # Counts are variable length, lists and sets are no larger than when
+    # written with MARK ... APPENDS/ADDITEMS
+    for obj in [list(range(n)), set(range(n))]:
+        assert len(enc.dumps(obj)) <= len(quickle.dumps(obj))
+
+
+def test_encoder_counted_containers_recursive():
+    enc = quickle.Encoder(counted_containers=True)
+    x = [1, 2]
+    x.append(x)
+    res = quickle.loads(enc.dumps(x))
+    assert res[:2] == [1, 2] and res[2] is res
+
+    d = {"a": 1, "b": 2}
+    d["c"] = d
+    res = quickle.loads(enc.dumps(d))
+    assert res["c"] is res
+
+
+def test_encoder_counted_containers_streaming():
+    obj = [list(range(1000)), {i: str(i) for i in range(1000)}]
+    enc = quickle.Encoder(counted_containers=True, write_buffer_size=64)
+    f = io.BytesIO()
+    enc.dump(obj, f)
+    dec = quickle.Decoder(read_buffer_size=64)
+    assert dec.load(ChunkedReader(f.getvalue(), 100)) == obj
+
+
+def test_loads_counted_containers_errors():
+    # Count larger than the stack
+    for op in [b"\xca", b"\xcc", b"\xcd"]:
+        with pytest.raises(quickle.DecodingError, match="stack"):
+            quickle.loads(b"]K\x01" + op + b"\x05.")
+        with pytest.raises(quickle.DecodingError, match="stack"):
+            quickle.loads(b"]K\x01" + op + b"\xff" * 8 + b"\x7f.")
+    # Empty stack, or empty above a mark
+    for op in [b"\xca", b"\xcc", b"\xcd"]:
+        for count in [b"\x00", b"\x01", b"\x03", b"\x05"]:
+            with pytest.raises(quickle.DecodingError, match="stack"):
+                quickle.loads(op + count + b".")
+            with pytest.raises(quickle.DecodingError, match="MARK"):
+                quickle.loads(b"](" + op + count + b".")
+    # Invalid target
+    with pytest.raises(quickle.DecodingError, match="APPEND"):
+        quickle.loads(b"}K\x01\xca\x01.")
+    with pytest.raises(quickle.DecodingError, match="SETITEM"):
+        quickle.loads(b"]K\x01K\x02\xcc\x01.")
+    with pytest.raises(quickle.DecodingError, match="ADDITEMS"):
+        quickle.loads(b"]K\x01\xcd\x01.")
+    # A huge dict size hint is clamped
+    assert quickle.loads(b"\xcb" + b"\xff" * 8 + b"\x7f.") == {}
+
+
+def make_records(n):
+    return [
+        {"id": i, "name": "name-%d" % i, "tags": ["a", "b"], "score": i / 2}
+        for i in range(n)
+    ]
+
+
+@pytest.mark.parametrize("memoize", [True, False])
+def test_encoder_dict_shapes(memoize):
+    enc = quickle.Encoder(dict_shapes=True, memoize=memoize)
+    records = make_records(100)
+    data = enc.dumps(records)
+    res = quickle.loads(data)
+    assert res == records
+    assert [list(r) for r in res] == [list(r) for r in records]
+    assert len(data) < len(quickle.Encoder(memoize=memoize).dumps(records))
+
+
+def test_encoder_dict_shapes_mixed():
+    enc = quickle.Encoder(dict_shapes=True)
+    a = {"x": 1, "y": 2}
+    obj = [
+        {"x": 1, "y": 2},
+        {"y": 2, "x": 1},  # Order matters
+        {"x": 1},
+        {1: "x", 2: "y"},  # Non-str keys
+        {True: "a"},
+        {1.0: "b"},
+        {},
+        {"x": {"x": 1, "y": 2}, "y": [{"x": 3, "y": 4}]},
+        a,  # Referenced elsewhere, memoized as normal
+        a,
+        {str(i): i for i in range(100)},  # Too many keys
+    ]
+    res = quickle.loads(enc.dumps(obj))
+    assert res == obj
+    assert [list(r) for r in res] == [list(r) for r in obj]
+    assert type(list(res[4])[0]) is bool
+    assert type(list(res[5])[0]) is float
+    assert res[8] is res[9]
+
+
+@pytest.mark.parametrize("memoize", [True, False])
+def test_encoder_dict_shapes_records_in_variable(memoize):
+    SHAPED_DICT = b"\xcf"
+    enc = quickle.Encoder(dict_shapes=True, memoize=memoize)
+    records = [{"a": i, "b": i} for i in range(10)]
+    data = enc.dumps(records)
+    assert data.count(SHAPED_DICT) == 10
+    assert quickle.loads(data) == records
+
+    # A record referenced elsewhere is only shaped if it isn't memoized
+    first = records[0]
+    data = enc.dumps(records)
+    assert data.count(SHAPED_DICT) == (9 if memoize else 10)
+    assert quickle.loads(data) == records
+    del first
+
+
+def test_encoder_dict_shapes_recursive():
+    enc = quickle.Encoder(dict_shapes=True)
+    records = make_records(3)
+    for r in records:
+        r["all"] = records
+    res = quickle.loads(enc.dumps(records))
+    assert [r["id"] for r in res] == [0, 1, 2]
+    assert all(r["all"] is res for r in res)
+
+
+def test_encoder_dict_shapes_reset_between_messages():
+    enc = quickle.Encoder(dict_shapes=True)
+    records = make_records(3)
+    for _ in range(2):
+        assert quickle.loads(enc.dumps(records)) == records
+    data, offsets = enc.dumps_many([records, records])
+    dec = quickle.Decoder()
+    assert dec.loads(data[offsets[1] :]) == records
+    f = io.BytesIO()
+    enc.dump(records, f)
+    assert quickle.loads(f.getvalue()) == records
+
+
+def test_encoder_dict_shapes_many_shapes():
+    enc = quickle.Encoder(dict_shapes=True)
+    obj = [{"k%d" % i: i} for i in range(2000)]
+    assert quickle.loads(enc.dumps(obj)) == obj
+
+
+def test_loads_dict_shapes_errors():
+    with pytest.raises(quickle.DecodingError, match="shape"):
+        quickle.loads(b"K\x01\xcf\x00.")
+    with pytest.raises(quickle.DecodingError, match="stack"):
+        quickle.loads(b"X\x01\x00\x00\x00a\xce\x02.")
+    with pytest.raises(quickle.DecodingError, match="stack"):
+        quickle.loads(b"X\x01\x00\x00\x00a\xce\x01\xcf\x00.")
+
+
+DICTIONARY = ["name", "address", "email", b"bytes", (1, 2, 3)]
+
+
+@pytest.mark.parametrize("memoize", [True, False])
+def test_dictionary(memoize):
+    enc = quickle.Encoder(memoize=memoize, dictionary=DICTIONARY)
+    dec = quickle.Decoder(dictionary=DICTIONARY)
+    obj = [{"name": "alice", "email": "a@example.com", "data": b"bytes"}] * 3
+    buf = enc.dumps(obj)
+    assert b"email" not in buf
+    assert b"bytes" not in buf
+    assert len(buf) < len(quickle.dumps(obj, memoize=memoize))
+    assert dec.loads(buf) == obj
+    # Decoded values are the dictionary objects themselves
+    assert dec.loads(enc.dumps("address")) is DICTIONARY[1]
+
+
+def test_dictionary_objects_matched_by_identity():
+    enc = quickle.Encoder(dictionary=DICTIONARY)
+    dec = quickle.Decoder(dictionary=DICTIONARY)
+    buf = enc.dumps([DICTIONARY[4], (1, 2, 3)])
+    assert dec.loads(buf) == [(1, 2, 3), (1, 2, 3)]
+    assert len(buf) < len(enc.dumps([(1, 2, 3), (1, 2, 3)]))
+
+
+def test_dictionary_memo_indices_follow_dictionary():
+    enc = quickle.Encoder(dictionary=DICTIONARY)
+    dec = quickle.Decoder(dictionary=DICTIONARY)
+    shared = ["not", "in", "dictionary"]
+    obj = [shared, "name", shared]
+    assert dec.loads(enc.dumps(obj)) == obj
+
+
+def test_dictionary_with_dedupe():
+    enc = quickle.Encoder(dictionary=DICTIONARY, dedupe_strings=True)
+    dec = quickle.Decoder(dictionary=DICTIONARY)
+    a = "".join(["not-", "in-dictionary"])
+    b = "".join(["not-in-", "dictionary"])
+    obj = ["name", a, b, "email", a]
+    for _ in range(2):
+        res = dec.loads(enc.dumps(obj))
+        assert res == obj
+        assert res[1] is res[2]
+
+
+def test_dictionary_persists_across_messages():
+    enc = quickle.Encoder(dictionary=DICTIONARY)
+    dec = quickle.Decoder(dictionary=DICTIONARY)
+    objs = [["name", "x"], ["email", "name"], "address"]
+    for obj in objs:
+        assert dec.loads(enc.dumps(obj)) == obj
+    data, offsets = enc.dumps_many(objs)
+    for i, obj in enumerate(objs):
+        assert dec.loads(data[offsets[i] : offsets[i + 1]]) == obj
+    f = io.BytesIO()
+    for obj in objs:
+        enc.dump(obj, f)
+    f.seek(0)
+    for obj in objs:
+        assert dec.load(f) == obj
+
+
+def test_dictionary_mismatch():
+    buf = quickle.Encoder(dictionary=DICTIONARY).dumps(["email", "name"])
+    with pytest.raises(KeyError):
+        quickle.loads(buf)
+    other = quickle.Decoder(dictionary=["a", "b", "c"])
+    assert other.loads(buf) == ["c", "a"]
+
+
+def test_dictionary_first_occurrence_wins():
+    key = "".join(["na", "me"])
+    dictionary = ["name", key]
+    enc = quickle.Encoder(dictionary=dictionary)
+    dec = quickle.Decoder(dictionary=dictionary)
+    assert dec.loads(enc.dumps("name")) is dictionary[0]
+
+
+def test_dictionary_errors():
+    for cls in [quickle.Encoder, quickle.Decoder]:
+        with pytest.raises(TypeError, match="dictionary"):
+            cls(dictionary="abc")
+        with pytest.raises(TypeError, match="dictionary"):
+            cls(dictionary={"a": 1})
+        cls(dictionary=None)
+        cls(dictionary=[])
+        # Mutable entries could be modified by a message
+        for entry in [[], {}, set(), bytearray(), MyStruct(1, 2), (1, [2])]:
+            with pytest.raises(TypeError, match="dictionary entries"):
+                cls(dictionary=["a", entry])
+        cls(dictionary=[None, True, 1, 1.5, b"a", (1, ("b",)), frozenset([2])])
+
+    # A message can't mutate a dictionary entry
+    with pytest.raises(quickle.DecodingError, match="APPEND"):
+        quickle.Decoder(dictionary=[(1, 2)]).loads(b"h\x00K\x01a.")
+
+    with pytest.raises(ValueError, match="duplicate"):
+        quickle.Encoder(dictionary=["a", "b", "a"])
+
+
+def test_session_memo_persists_across_messages():
+    enc = quickle.EncoderSession()
+    dec = quickle.DecoderSession()
+    shared = ["a" * 100, ("x", "y")]
+    msgs = [[shared, "first"], [shared, "second"], shared]
+    bufs = [enc.dumps(m) for m in msgs]
+    # Later messages refer back to objects from earlier messages
+    assert len(bufs[1]) < len(quickle.dumps(msgs[1]))
+    assert b"a" * 100 not in bufs[1]
+    res = [dec.loads(b) for b in bufs]
+    assert res == msgs
+    assert res[1][0] is res[0][0]
+    assert res[2] is res[0][0]
+    # A plain decoder can't decode later messages on their own
+    with pytest.raises(KeyError):
+        quickle.loads(bufs[1])
+
+
+def test_session_reset():
+    enc = quickle.EncoderSession()
+    dec = quickle.DecoderSession()
+    shared = ["shared"]
+    assert dec.loads(enc.dumps(shared)) == shared
+    enc.reset()
+    dec.reset()
+    buf = enc.dumps(shared)
+    assert buf == quickle.dumps(shared)
+    assert dec.loads(buf) == shared
+
+
+def test_session_dumps_many_and_dump():
+    enc = quickle.EncoderSession()
+    dec = quickle.DecoderSession()
+    shared = {"key": "value"}
+    data, offsets = enc.dumps_many([[shared], [shared]])
+    f = io.BytesIO()
+    enc.dump([shared, 1], f)
+    f.seek(0)
+    assert list(dec.iter_loads(data)) == [[shared], [shared]]
+    assert dec.load(f) == [shared, 1]
+    assert offsets[2] - offsets[1] < offsets[1] - offsets[0]
+
+
+def test_session_with_dictionary():
+    dictionary = ["name", "email"]
+    enc = quickle.EncoderSession(dictionary=dictionary)
+    dec = quickle.DecoderSession(dictionary=dictionary)
+    msgs = [["name", ["x"]], ["email", "name"]]
+    for m in msgs:
+        assert dec.loads(enc.dumps(m)) == m
+    enc.reset()
+    dec.reset()
+    for m in msgs:
+        assert dec.loads(enc.dumps(m)) == m
+
+
+def test_session_encode_failure_rolls_back_memo():
+    enc = quickle.EncoderSession()
+    dec = quickle.DecoderSession()
+    first = ["first"]
+    assert dec.loads(enc.dumps(first)) == first
+    unused = ["unused"]
+    with pytest.raises(TypeError):
+        enc.dumps([unused, object()])
+    with pytest.raises(quickle.BufferTooSmallError):
+        enc.dumps_into([unused, "x" * 100], memoryview(bytearray(10)))
+    msg = [unused, first]
+    assert dec.loads(enc.dumps(msg)) == msg
+
+
+def test_session_decode_failure_rolls_back_memo():
+    enc = quickle.EncoderSession()
+    dec = quickle.DecoderSession()
+    first = ["first"]
+    assert dec.loads(enc.dumps(first)) == first
+    buf = enc.dumps([["second"], first])
+    with pytest.raises(quickle.DecodingError):
+        dec.loads(buf[:-3])
+    assert dec.loads(buf) == [["second"], first]
+
+
+def test_session_gc():
+    enc = quickle.EncoderSession()
+    dec = quickle.DecoderSession()
+    obj = [1, 2]
+    obj.append(obj)
+    res = dec.loads(enc.dumps(obj))
+    # The session memos keep the objects alive, and are visible to the gc
+    del obj, res
+    gc.collect()
+    assert dec.loads(enc.dumps([3])) == [3]
+    del enc, dec
+    gc.collect()
+
+
+def test_session_errors():
+    assert isinstance(quickle.EncoderSession(), quickle.Encoder)
+    assert isinstance(quickle.DecoderSession(), quickle.Decoder)
+    with pytest.raises(ValueError, match="memoize"):
+        quickle.EncoderSession(memoize=False)
+    with pytest.raises(TypeError):
+        quickle.EncoderSession(bad=1)
+    with pytest.raises(TypeError):
+        quickle.DecoderSession(bad=1)
+
+
+class ChunkedReader(io.RawIOBase):
+    """A non-seekable stream that returns at most ``chunk_size`` bytes per
+    read, like a pipe or socket."""
+
+    def __init__(self, data, chunk_size=7):
+        self.data = data
+        self.chunk_size = chunk_size
+        self.pos = 0
+
+    def readable(self):
+        return True
+
+    def readinto(self, buf):
+        n = min(len(buf), self.chunk_size, len(self.data) - self.pos)
+        buf[:n] = self.data[self.pos : self.pos + n]
+        self.pos += n
+        return n
+
+
+@pytest.mark.parametrize("read_buffer_size", [32, 64, 65536])
+def test_decoder_load(read_buffer_size):
+    obj = [{"x": i, "y": str(i) * 50, "z": b"a" * (i * 10)} for i in range(100)]
+    data = quickle.dumps(obj)
+    dec = quickle.Decoder(read_buffer_size=read_buffer_size)
+    assert dec.load(io.BytesIO(data)) == obj
+    assert dec.load(ChunkedReader(data)) == obj
+    # Decoder still works with loads
+    assert dec.loads(data) == obj
+
+
+def test_decoder_load_from_file(tmp_path):
+    enc = quickle.Encoder()
+    dec = quickle.Decoder(read_buffer_size=64)
+    msgs = [list(range(i * 10)) for i in range(20)]
+    path = str(tmp_path / "test.quickle")
+    with open(path, "wb") as f:
+        for msg in msgs:
+            enc.dump(msg, f)
+        f.write(b"trailing")
+    with open(path, "rb") as f:
+        for msg in msgs:
+            assert dec.load(f) == msg
+        # Seekable files are left positioned at the end of each message
+        assert f.read() == b"trailing"
+
+
+def test_decoder_load_non_seekable_stream():
+    enc = quickle.Encoder()
+    msgs = [{"x": "a" * i, "y": b"b" * (i * 7)} for i in range(50)]
+    data = b"".join(enc.dumps(msg) for msg in msgs)
+    dec = quickle.Decoder(read_buffer_size=32)
+    f = ChunkedReader(data, chunk_size=100)
+    # Data read past the end of a message is retained for the next call
+    for msg in msgs:
+        assert dec.load(f) == msg
+    with pytest.raises(quickle.DecodingError, match="truncated"):
+        dec.load(f)
+
+
+def test_decoder_load_buffers():
+    data = bytearray(b"x" * 100)
+    enc = quickle.Encoder(collect_buffers=True)
+    f = io.BytesIO()
+    buffers = enc.dump([quickle.PickleBuffer(data), 1], f)
+    f.seek(0)
+    res = quickle.Decoder().load(f, buffers=buffers)
+    assert res[1] == 1
+    assert bytes(res[0]) == bytes(data)
+
+
+def test_decoder_load_errors():
+    dec = quickle.Decoder(read_buffer_size=32)
+
+    with pytest.raises(TypeError, match="readinto"):
+        dec.load(object())
+
+    with pytest.raises(TypeError):
+        dec.load()
+
+    data = quickle.dumps(list(range(1000)))
+    for n in [0, 1, 10, len(data) // 2, len(data) - 1]:
+        with pytest.raises(quickle.DecodingError):
+            dec.load(io.BytesIO(data[:n]))
+
+    class BadFile:
+        def readinto(self, buf):
+            raise ValueError("Oh no")
+
+    with pytest.raises(ValueError, match="Oh no"):
+        dec.load(BadFile())
+
+    class NonBlocking:
+        def readinto(self, buf):
+            return None
+
+    with pytest.raises(ValueError, match="non-blocking"):
+        dec.load(NonBlocking())
+
+    # Decoder still works after errors
+    assert dec.load(io.BytesIO(data)) == list(range(1000))
+
+
+def test_decoder_reentrant_calls_error():
+    dec = quickle.Decoder(read_buffer_size=32)
+    data = quickle.dumps(list(range(1000)))
+    errors = []
+
+    class ReentrantReader(ChunkedReader):
+        def readinto(self, buf):
+            for call in [
+                lambda: dec.loads(data),
+                lambda: dec.load(io.BytesIO(data)),
+                lambda: dec.loads_at(data, 0),
+                lambda: dec.iter_loads(data),
+                lambda: dec.__init__(),
+            ]:
+                with pytest.raises(RuntimeError, match="already in use") as rec:
+                    call()
+                errors.append(rec.value)
+            return super().readinto(buf)
+
+    assert dec.load(ReentrantReader(data)) == list(range(1000))
+    assert len(errors) > 0
+
+    # Decoder still works after errors
+    assert dec.loads(data) == list(range(1000))
+    assert dec.load(io.BytesIO(data)) == list(range(1000))
+
+
 @pytest.mark.parametrize("value", [object(), object, sum, itertools.count])
 def test_dumps_and_loads_unpickleable_types(value):
     with pytest.raises(TypeError):
@@ -454,6 +1903,15 @@ def test_loads_bad_pickle():
         quickle.loads(b"this isn't valid at all")
 
 
+@pytest.mark.parametrize("op", [b"\xff", b"\x00", b"!"])
+def test_loads_invalid_opcode(op):
+    with pytest.raises(quickle.DecodingError, match="invalid load key"):
+        quickle.loads(op + b".")
+    # After another opcode
+    with pytest.raises(quickle.DecodingError, match="invalid load key"):
+        quickle.loads(b"N" + op + b".")
+
+
 def test_getsizeof():
     a = sys.getsizeof(quickle.Encoder(write_buffer_size=64))
     b = sys.getsizeof(quickle.Encoder(write_buffer_size=128))
@@ -717,6 +2175,15 @@ def test_struct_registry_mismatch_fewer_args_default_parameters_respected():
     assert x2.z2 == 3
 
 
+def test_struct_registry_mismatch_defaults_reference_counting():
+    default = MyStruct2.__struct_defaults__[-1]
+    count = sys.getrefcount(default)
+    s = quickle.dumps(MyStruct(1, 2), registry=[MyStruct])
+    for _ in range(10):
+        quickle.loads(s, registry=[MyStruct2])
+    assert sys.getrefcount(default) == count
+
+
 def test_struct_registry_mismatch_extra_args_are_ignored():
     """Unpickling a struct with an older version that has fewer parameters
     works (the extra args are ignored)."""
@@ -727,6 +2194,366 @@ def test_struct_registry_mismatch_extra_args_are_ignored():
     assert x2.y == 2
 
 
+@pytest.mark.parametrize("memoize", [True, False])
+@pytest.mark.parametrize("n", [2, 3, 100])
+def test_encoder_struct_columns(memoize, n):
+    enc = quickle.Encoder(registry=[MyStruct], struct_columns=True, memoize=memoize)
+    obj = [MyStruct(i, "s%d" % (i % 3)) for i in range(n)]
+    data = enc.dumps(obj)
+    assert b"\xd0\x00\x02" in data
+    res = quickle.loads(data, registry=[MyStruct])
+    assert res == obj
+    # Numeric columns are packed
+    if n >= 16:
+        assert b"\xc1" in data
+        default = quickle.dumps(obj, registry=[MyStruct], memoize=memoize)
+        assert len(data) < len(default)
+
+
+def test_encoder_struct_columns_fallback():
+    enc = quickle.Encoder(registry=[MyStruct, MyStruct3], struct_columns=True)
+    shared = MyStruct(1, 2)
+    cases = [
+        [MyStruct(1, 2)],  # Too short
+        [MyStruct(1, 2), MyStruct3(1, 2, 3)],  # Mixed types
+        [MyStruct(1, 2), (1, 2)],
+        [shared, shared],  # Shared items are memoized as normal
+    ]
+    for obj in cases:
+        data = enc.dumps(obj)
+        assert b"\xd0" not in data
+        res = quickle.loads(data, registry=[MyStruct, MyStruct3])
+        assert res == obj
+    res = quickle.loads(enc.dumps(cases[-1]), registry=[MyStruct])
+    assert res[0] is res[1]
+
+
+def test_encoder_struct_columns_nested():
+    enc = quickle.Encoder(registry=[MyStruct], struct_columns=True)
+    inner = [MyStruct(i, None) for i in range(20)]
+    obj = [MyStruct(inner, [1.5] * 20), MyStruct(inner, [True, False] * 10)]
+    res = quickle.loads(enc.dumps(obj), registry=[MyStruct])
+    assert res == obj
+    assert res[0].x is res[1].x
+
+
+def test_encoder_struct_columns_registry_mismatch():
+    enc = quickle.Encoder(registry=[MyStruct2], struct_columns=True)
+    data = enc.dumps([MyStruct2(1, 2, [3]), MyStruct2(4)])
+    res = quickle.loads(data, registry=[MyStruct])
+    assert res == [MyStruct(1, 2), MyStruct(4, 1)]
+
+    enc = quickle.Encoder(registry=[MyStruct], struct_columns=True)
+    data = enc.dumps([MyStruct(1, 2), MyStruct(3, 4)])
+    res = quickle.loads(data, registry=[MyStruct2])
+    assert res == [MyStruct2(1, 2), MyStruct2(3, 4)]
+    assert res[0].z is not res[1].z
+
+    with pytest.raises(TypeError, match="Missing required argument 'y'"):
+        quickle.loads(data.replace(b"\xd0\x00\x02", b"\xd0\x00\x01"), registry=[MyStruct3])
+
+    with pytest.raises(TypeError, match="isn't in type registry"):
+        quickle.Encoder(struct_columns=True).dumps([MyStruct(1, 2), MyStruct(3, 4)])
+    with pytest.raises(ValueError, match="isn't in type registry"):
+        quickle.loads(data)
+    with pytest.raises(TypeError, match="isn't a Struct type"):
+        quickle.loads(data, registry=[Fruit])
+
+
+def test_encoder_struct_columns_streaming():
+    enc = quickle.Encoder(registry=[MyStruct], struct_columns=True)
+    obj = [MyStruct(i, str(i)) for i in range(1000)]
+    data = enc.dumps(obj)
+    dec = quickle.Decoder(registry=[MyStruct])
+    assert dec.load(ChunkedReader(data, 7)) == obj
+
+
+class Typed(quickle.Struct):
+    a: int
+    b: float
+    c: bool
+    d: str
+    e: bytes
+
+
+class TypedV2(quickle.Struct):
+    a: int
+    b: float
+    c: bool
+    d: str
+    e: bytes
+    f: int = 1
+    g: list = []
+
+
+class TypedStringAnnotations(quickle.Struct):
+    a: "int"
+    b: "str"
+
+
+class TypedSubclass(Typed):
+    f: float = 1.5
+
+
+@pytest.mark.parametrize("memoize", [True, False])
+def test_encoder_typed_structs(memoize):
+    registry = [Typed, TypedStringAnnotations, TypedSubclass]
+    enc = quickle.Encoder(registry=registry, typed_structs=True, memoize=memoize)
+    dec = quickle.Decoder(registry=registry)
+    cases = [
+        Typed(1, 2.5, True, "hello", b"world"),
+        Typed(-(2 ** 63), -0.0, False, "", b""),
+        Typed(2 ** 63 - 1, float("inf"), True, "\u1234" * 1000, b"x" * 100000),
+        TypedStringAnnotations(-5, "five"),
+        TypedSubclass(1, 2.0, False, "a", b"b"),
+    ]
+    for x in cases:
+        data = enc.dumps(x)
+        assert data[0] == 0xD7
+        assert dec.loads(data) == x
+        assert len(data) < len(quickle.dumps(x, registry=registry))
+    res = dec.loads(enc.dumps(cases))
+    assert res == cases
+    assert not any(gc.is_tracked(x) for x in res)
+
+
+def test_encoder_typed_structs_fallback():
+    registry = [Typed, MyStruct]
+    enc = quickle.Encoder(registry=registry, typed_structs=True)
+    cases = [
+        Typed(2 ** 63, 1.0, True, "a", b"b"),  # int too big
+        Typed(True, 1.0, True, "a", b"b"),  # bool isn't an int
+        Typed(1, 1, True, "a", b"b"),  # int isn't a float
+        Typed(1, 1.0, 1, "a", b"b"),
+        Typed(1, 1.0, True, b"a", "b"),
+        MyStruct(1, 2),  # untyped
+    ]
+    for x in cases:
+        data = enc.dumps(x)
+        assert data[0] != 0xD7
+        res = quickle.loads(data, registry=registry)
+        assert res == x
+
+    # Lone surrogates don't need a fallback
+    x = Typed(1, 1.0, True, "\ud800", b"b")
+    data = enc.dumps(x)
+    assert data[0] == 0xD7
+    assert quickle.loads(data, registry=registry) == x
+
+
+def test_encoder_typed_structs_shared():
+    enc = quickle.Encoder(registry=[Typed], typed_structs=True)
+    x = Typed(1, 2.5, True, "hello", b"world")
+    res = quickle.loads(enc.dumps([x, x]), registry=[Typed])
+    assert res == [x, x]
+    assert res[0] is res[1]
+
+
+def test_typed_structs_registry_mismatch():
+    x = Typed(1, 2.5, True, "hello", b"world")
+    data = quickle.Encoder(registry=[Typed], typed_structs=True).dumps(x)
+    res = quickle.loads(data, registry=[TypedV2])
+    assert res == TypedV2(1, 2.5, True, "hello", b"world")
+    assert res.g == [] and res.g is not TypedV2.__struct_defaults__[-1]
+
+    with pytest.raises(TypeError, match="Missing required argument 'b'"):
+        quickle.loads(data.replace(b"\xd7\x00\x05", b"\xd7\x00\x01"), registry=[Typed])
+
+    # Extra fields can't be skipped without type tags
+    data = quickle.Encoder(registry=[TypedSubclass], typed_structs=True).dumps(
+        TypedSubclass(1, 2.5, True, "hello", b"world")
+    )
+    with pytest.raises(quickle.DecodingError, match="expected at most 5"):
+        quickle.loads(data, registry=[Typed])
+    # Decoding type isn't fully typed
+    data2 = quickle.Encoder(registry=[TypedStringAnnotations], typed_structs=True).dumps(
+        TypedStringAnnotations(1, "two")
+    )
+    with pytest.raises(quickle.DecodingError, match="no typed annotation"):
+        quickle.loads(data2, registry=[MyStruct])
+    with pytest.raises(TypeError, match="isn't a Struct type"):
+        quickle.loads(data, registry=[Fruit])
+
+
+def test_loads_typed_struct_truncated():
+    x = Typed(1, 2.5, True, "hello", b"world")
+    data = quickle.Encoder(registry=[Typed], typed_structs=True).dumps(x)
+    for i in range(1, len(data) - 1):
+        with pytest.raises(quickle.DecodingError):
+            quickle.loads(data[:i], registry=[Typed])
+
+
+def test_loads_struct_columns_errors():
+    registry = [MyStruct]
+    # Too few items on the stack
+    with pytest.raises(quickle.DecodingError, match="stack"):
+        quickle.loads(b"]]\xd0\x00\x02.", registry=registry)
+    with pytest.raises(quickle.DecodingError, match="stack"):
+        quickle.loads(b"]\xd0\x00\x00.", registry=registry)
+    # Empty stack, or empty above a mark
+    for count in [b"\x00", b"\x01", b"\x02"]:
+        with pytest.raises(quickle.DecodingError, match="stack"):
+            quickle.loads(b"\xd0\x00" + count + b".", registry=registry)
+        with pytest.raises(quickle.DecodingError, match="MARK"):
+            quickle.loads(b"](\xd0\x00" + count + b".", registry=registry)
+    # Columns of different lengths
+    with pytest.raises(quickle.DecodingError, match="equal length"):
+        quickle.loads(b"]]K\x01a]\xd0\x00\x02.", registry=registry)
+    # Columns aren't lists
+    with pytest.raises(quickle.DecodingError, match="equal length"):
+        quickle.loads(b"]K\x01K\x02\xd0\x00\x02.", registry=registry)
+    # Target isn't a list
+    with pytest.raises(quickle.DecodingError, match="STRUCT_COLUMNS"):
+        quickle.loads(b"K\x01]]\xd0\x00\x02.", registry=registry)
+
+
+@pytest.mark.parametrize("memoize", [True, False])
+def test_encoder_counted_structs(memoize):
+    registry = [MyStruct, MyStruct2]
+    enc = quickle.Encoder(registry=registry, counted_containers=True, memoize=memoize)
+    x = MyStruct(1, [MyStruct2(2), MyStruct(3, 4)])
+    data = enc.dumps(x)
+    assert b"\xda\x02" in data
+    assert b"(" not in data and b"\xb0" not in data
+    assert quickle.loads(data, registry=registry) == x
+
+
+def test_encoder_counted_structs_recursive():
+    enc = quickle.Encoder(registry=[MyStruct], counted_containers=True)
+    x = MyStruct(1, None)
+    x.y = x
+    res = quickle.loads(enc.dumps([x, x]), registry=[MyStruct])
+    assert res[0] is res[1]
+    assert res[0].y is res[0]
+
+
+def test_counted_structs_registry_mismatch():
+    enc = quickle.Encoder(registry=[MyStruct], counted_containers=True)
+    res = quickle.loads(enc.dumps(MyStruct(1, 2)), registry=[MyStruct2])
+    assert res == MyStruct2(1, 2)
+
+    enc = quickle.Encoder(registry=[MyStruct2], counted_containers=True)
+    data = enc.dumps(MyStruct2(1, 2, [3], 4))
+    assert quickle.loads(data, registry=[MyStruct]) == MyStruct(1, 2)
+    with pytest.raises(TypeError, match="Missing required argument 'z'"):
+        quickle.loads(b"\xb1\x00K\x01K\x02\xda\x02.", registry=[MyStruct3])
+
+
+def test_loads_buildstruct_n_errors():
+    with pytest.raises(quickle.DecodingError, match="stack"):
+        quickle.loads(b"\xb1\x00K\x01\xda\x02.", registry=[MyStruct])
+    with pytest.raises(quickle.DecodingError, match="BUILDSTRUCT"):
+        quickle.loads(b"]K\x01K\x02\xda\x02.", registry=[MyStruct])
+    # BUILDSTRUCT_N as the first opcode, or first after a mark
+    for count in [b"\x00", b"\x01", b"\x03"]:
+        with pytest.raises(quickle.DecodingError, match="stack"):
+            quickle.loads(b"\xda" + count + b".", registry=[MyStruct])
+        with pytest.raises(quickle.DecodingError, match="MARK"):
+            quickle.loads(b"\xb1\x00(\xda" + count + b".", registry=[MyStruct])
+
+
+class Sparse(quickle.Struct):
+    a: object
+    b: object = None
+    c: object = None
+    d: object = None
+    e: object = 1
+    f: object = ""
+    g: object = []
+    h: object = None
+
+
+@pytest.mark.parametrize("counted", [False, True])
+@pytest.mark.parametrize(
+    "kwargs, sparse",
+    [
+        ({}, False),
+        ({"b": 1}, False),  # Only trailing defaults
+        ({"h": 1}, True),  # Interior defaults skipped with a bitmap
+        ({"b": 1, "h": 1}, True),
+        ({"b": 1, "c": 2, "d": 3, "e": 4, "f": 5, "g": 6, "h": 7}, False),
+        ({"e": True, "f": b"", "g": (), "h": 0}, True),  # Same value, different type
+        ({"e": 1.0, "g": [1]}, True),
+        ({"b": 1, "c": 1, "d": 1, "e": 2, "h": 1}, False),  # Bitmap isn't smaller
+    ],
+)
+def test_encoder_omit_defaults(counted, kwargs, sparse):
+    x = Sparse(0, **kwargs)
+    enc = quickle.Encoder(registry=[Sparse], omit_defaults=True, counted_containers=counted)
+    data = enc.dumps(x)
+    assert (b"\xdb" in data) == sparse
+    res = quickle.loads(data, registry=[Sparse])
+    assert res == x
+    for f in Sparse.__struct_fields__:
+        assert type(getattr(res, f)) is type(getattr(x, f))
+    default = quickle.Encoder(registry=[Sparse], counted_containers=counted).dumps(x)
+    assert len(data) <= len(default)
+
+
+@pytest.mark.parametrize("memoize", [True, False])
+def test_encoder_omit_defaults_shared_values(memoize):
+    enc = quickle.Encoder(registry=[Sparse], omit_defaults=True, memoize=memoize)
+    x = Sparse(0)
+    res = quickle.loads(enc.dumps([x, x.g]), registry=[Sparse])
+    assert res == [x, x.g]
+    if memoize:
+        # Copied defaults that are referenced elsewhere are still written
+        assert res[0].g is res[1]
+    # Unshared values are omitted
+    data = enc.dumps(x)
+    assert b"]" not in data
+    assert quickle.loads(data, registry=[Sparse]) == x
+
+
+def test_encoder_omit_defaults_many_fields():
+    ns = {"__annotations__": {"f%d" % i: object for i in range(300)}}
+    ns.update({"f%d" % i: None for i in range(1, 300)})
+    Big = type("Big", (quickle.Struct,), ns)
+    x = Big(0, f150=1, f299=2)
+    enc = quickle.Encoder(registry=[Big], omit_defaults=True)
+    res = quickle.loads(enc.dumps(x), registry=[Big])
+    assert res == x
+
+
+def test_encoder_omit_defaults_compare_errors():
+    class Bad:
+        def __eq__(self, other):
+            raise ValueError("Oh no!")
+
+    class BadStruct(quickle.Struct):
+        x: object = Bad()
+
+    enc = quickle.Encoder(registry=[BadStruct], omit_defaults=True)
+    with pytest.raises(ValueError, match="Oh no!"):
+        enc.dumps(BadStruct(Bad()))
+
+
+def test_omit_defaults_registry_mismatch():
+    enc = quickle.Encoder(registry=[Sparse], omit_defaults=True)
+    data = enc.dumps(Sparse(0, h=1))
+
+    class Fewer(quickle.Struct):
+        a: object
+        b: object = None
+
+    class Required(quickle.Struct):
+        a: object
+        b: object
+
+    assert quickle.loads(data, registry=[Fewer]) == Fewer(0)
+    with pytest.raises(TypeError, match="Missing required argument 'b'"):
+        quickle.loads(data, registry=[Required])
+
+
+def test_loads_buildstruct_sparse_errors():
+    with pytest.raises(quickle.DecodingError, match="stack"):
+        quickle.loads(b"\xb1\x00K\x01\xdb\x02\x03.", registry=[Sparse])
+    with pytest.raises(quickle.DecodingError, match="BUILDSTRUCT_SPARSE"):
+        quickle.loads(b"]K\x01\xdb\x01\x01.", registry=[Sparse])
+    with pytest.raises(quickle.DecodingError):
+        quickle.loads(b"\xb1\x00K\x01\xdb\x10\x01", registry=[Sparse])
+
+
 class Fruit(enum.IntEnum):
     APPLE = 1
     BANANA = 2
@@ -671,3 +671,188 @@ def test_struct_handles_missing_attributes():
 
     with pytest.raises(AttributeError, match=match):
         quickle.dumps(t, registry=[MyStruct])
+
+
+def test_struct_array():
+    arr = quickle.StructArray(MyStruct)
+    assert len(arr) == 0
+    assert arr.type is MyStruct
+    assert arr.columns == {"x": [], "y": [], "z": []}
+    assert list(arr) == []
+
+    items = [MyStruct(i, -i, str(i)) for i in range(5)]
+    for x in items:
+        arr.append(x)
+    assert len(arr) == 5
+    assert arr[0] == items[0]
+    assert arr[-1] == items[-1]
+    assert arr[1] is not items[1]
+    assert list(arr) == items
+    assert arr.tolist() == items
+    assert arr.columns == {
+        "x": [0, 1, 2, 3, 4],
+        "y": [0, -1, -2, -3, -4],
+        "z": ["0", "1", "2", "3", "4"],
+    }
+    # columns are copies
+    arr.columns["x"].append(1)
+    assert len(arr.columns["x"]) == 5
+    assert repr(arr) == "quickle.StructArray(%s, len=5)" % MyStruct.__qualname__
+
+    with pytest.raises(IndexError):
+        arr[5]
+    with pytest.raises(IndexError):
+        arr[-6]
+
+
+def test_struct_array_init():
+    items = [MyStruct(i, i) for i in range(3)]
+    arr = quickle.StructArray(MyStruct, items)
+    assert arr.tolist() == items
+    assert quickle.StructArray(MyStruct, iter(items)) == arr
+    assert quickle.StructArray(MyStruct, None) == quickle.StructArray(MyStruct)
+    assert quickle.StructArray(type=MyStruct, items=items) == arr
+
+    with pytest.raises(TypeError, match="must be a Struct type"):
+        quickle.StructArray(int)
+    with pytest.raises(TypeError, match="must be a Struct type"):
+        quickle.StructArray(Struct())
+    with pytest.raises(TypeError):
+        quickle.StructArray(MyStruct, 1)
+    with pytest.raises(TypeError, match="Expected an instance of"):
+        quickle.StructArray(MyStruct, [MyStruct(1, 2), Point(1, 2)])
+
+
+def test_struct_array_append_errors():
+    arr = quickle.StructArray(MyStruct, [MyStruct(1, 2)])
+    with pytest.raises(TypeError, match="Expected an instance of"):
+        arr.append(Point(1, 2))
+    t = MyStruct(1, 2)
+    del t.z
+    with pytest.raises(AttributeError, match="Struct field 'z' is unset"):
+        arr.append(t)
+    # Failed appends leave the array unchanged
+    assert len(arr) == 1
+    assert arr.columns == {"x": [1], "y": [2], "z": ["default"]}
+
+
+def test_struct_array_compare():
+    a = quickle.StructArray(MyStruct, [MyStruct(1, 2)])
+    assert a == quickle.StructArray(MyStruct, [MyStruct(1, 2)])
+    assert a != quickle.StructArray(MyStruct, [MyStruct(1, 3)])
+    assert a != quickle.StructArray(MyStruct)
+    assert a != quickle.StructArray(Point, [Point(1, 2)])
+    assert a != [MyStruct(1, 2)]
+
+
+def test_struct_array_gc():
+    arr = quickle.StructArray(Point)
+    assert gc.is_tracked(arr)
+    items = [Point(1, 2), Point(3, 4)]
+    arr = quickle.StructArray(Point, items)
+    assert not any(gc.is_tracked(x) for x in arr)
+
+    class Node(Struct):
+        value: object
+
+    arr = quickle.StructArray(Node)
+    arr.append(Node(arr))
+    assert arr[0].value is arr
+    del arr
+    gc.collect()
+
+
+def test_struct_array_pickleable():
+    arr = quickle.StructArray(MyStruct, [MyStruct(1, 2), MyStruct(3, 4, "x")])
+    assert pickle.loads(pickle.dumps(arr)) == arr
+
+
+@pytest.mark.parametrize("n", [0, 1, 100])
+def test_struct_array_serialize(n):
+    arr = quickle.StructArray(Point, [Point(i, i * 2) for i in range(n)])
+    data = quickle.dumps(arr, registry=[Point])
+    res = quickle.loads(data, registry=[Point])
+    assert type(res) is quickle.StructArray
+    assert res.type is Point
+    assert res == arr
+    if n >= 16:
+        # Integer columns are packed
+        assert b"\xc1" in data
+
+
+def test_struct_array_serialize_shared_and_recursive():
+    class Node(Struct):
+        value: object
+
+    registry = [Point, Node]
+    arr = quickle.StructArray(Point, [Point(1, 2)])
+    res = quickle.loads(quickle.dumps([arr, arr], registry=registry), registry=registry)
+    assert res[0] is res[1]
+    assert res[0] == arr
+
+    arr = quickle.StructArray(Node)
+    arr.append(Node(arr))
+    arr.append(Node([1, 2]))
+    res = quickle.loads(quickle.dumps(arr, registry=registry), registry=registry)
+    assert res[0].value is res
+    assert res[1].value == [1, 2]
+
+
+def test_struct_array_serialize_registry_mismatch():
+    class Old(Struct):
+        x: int
+        y: int
+
+    class New(Struct):
+        x: int
+        y: int
+        z: list = []
+
+    arr = quickle.StructArray(Old, [Old(1, 2), Old(3, 4)])
+    data = quickle.dumps(arr, registry=[Old])
+    res = quickle.loads(data, registry=[New])
+    assert res.tolist() == [New(1, 2), New(3, 4)]
+    assert res[0].z is not res[1].z
+
+    data = quickle.dumps(quickle.StructArray(New, [New(1, 2, [3])]), registry=[New])
+    res = quickle.loads(data, registry=[Old])
+    assert res.tolist() == [Old(1, 2)]
+
+    class Bigger(Struct):
+        x: int
+        y: int
+        w: int
+
+    with pytest.raises(TypeError, match="Missing required argument 'w'"):
+        quickle.loads(quickle.dumps(arr, registry=[Old]), registry=[Bigger])
+    with pytest.raises(TypeError, match="isn't in type registry"):
+        quickle.dumps(arr)
+    with pytest.raises(TypeError, match="isn't a Struct type"):
+        quickle.loads(data, registry=[Fruit])
+
+
+def test_struct_array_decode_errors():
+    registry = [Point]
+    # Not enough columns on the stack
+    with pytest.raises(quickle.DecodingError, match="stack"):
+        quickle.loads(b"\xd3\x00]\xd6\x00\x02.", registry=registry)
+    # Empty stack, or empty above a mark
+    for args in [b"\x00\x00", b"\x00\x01", b"\x05\x02"]:
+        with pytest.raises(quickle.DecodingError, match="stack"):
+            quickle.loads(b"\xd6" + args + b".", registry=registry)
+        with pytest.raises(quickle.DecodingError, match="MARK"):
+            quickle.loads(b"\xd3\x00(\xd6" + args + b".", registry=registry)
+    # Column length mismatch
+    with pytest.raises(quickle.DecodingError, match="equal length"):
+        quickle.loads(b"\xd3\x00]]\xd6\x01\x02.", registry=registry)
+    # Target isn't a StructArray
+    with pytest.raises(quickle.DecodingError, match="STRUCT_ARRAY_EXTEND"):
+        quickle.loads(b"]]]\xd6\x00\x02.", registry=registry)
+
+    # A huge length without any columns to back it
+    class Defaults(Struct):
+        x: list = []
+
+    msg = b"\xd3\x00\xd6\x80\x87\xa7\x0e\x00."  # 30_000_000 rows
+    with pytest.raises(quickle.DecodingError, match="without columns"):
+        quickle.loads(msg, registry=[Defaults])